@@ -15,19 +15,39 @@
 int send_control_message(int fd, uint32_t code, uint32_t value)
 {
   uint32_t ctl_message = ((code & 0xff) << 24) | (value & 0xffffff);
+  size_t offset = 0;
+  ssize_t n;
 
   if ( fd < 0 )
     return 0;
 
   ulog(LOG_DEBUG, "[S>] M=%u C=%u V=%u\n", ctl_message, code, value);
 
+  // for blocking sockets, the daemon queues its own messages per session
   ctl_message = htonl(ctl_message);
-  if (write(fd, (char *)&ctl_message, sizeof(uint32_t)) != sizeof(uint32_t))
-    return 1;
+  while ( offset < sizeof(uint32_t) )
+  {
+    if ( (n = write(fd, (char *)&ctl_message + offset, sizeof(uint32_t) - offset)) < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      return 1;
+    }
+
+    offset += n;
+  }
 
   return 0;
 }
 
+void decode_control_message(uint32_t ctl_message, uint32_t *code, uint32_t *value)
+{
+  // expects the message in host byte order
+  *code = (ctl_message & 0xff000000) >> 24;
+  *value = (ctl_message & 0x00ffffff);
+}
+
 int receive_control_message(int fd, uint32_t *code, uint32_t *value)
 {
   uint32_t ctl_message = 0;
@@ -45,9 +65,7 @@ int receive_control_message(int fd, uint32_t *code, uint32_t *value)
 
   if ( bytes_read == sizeof(uint32_t))
   {
-    ctl_message = ntohl(ctl_message);
-    ctl_code = (ctl_message & 0xff000000) >> 24;
-    ctl_value = (ctl_message & 0x00ffffff);
+    decode_control_message(ntohl(ctl_message), &ctl_code, &ctl_value);
 
     ret = 0;
   }
@@ -84,6 +102,40 @@ double time_delta_us(struct timeval t1, struct timeval t2)
   return (double)( (t2.tv_sec-t1.tv_sec)*1e6 + (t2.tv_usec-t1.tv_usec));
 }
 
+double time_delta_ts_us(struct timespec t1, struct timespec t2)
+{
+  return (double)( (t2.tv_sec-t1.tv_sec)*1e6 + (t2.tv_nsec-t1.tv_nsec)/1e3);
+}
+
+void timespec_add_ns(struct timespec *t, long ns)
+{
+  t->tv_sec += ns / 1000000000L;
+  t->tv_nsec += ns % 1000000000L;
+
+  // normalise
+  if ( t->tv_nsec >= 1000000000L )
+  {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000L;
+  }
+  else if ( t->tv_nsec < 0 )
+  {
+    t->tv_sec--;
+    t->tv_nsec += 1000000000L;
+  }
+}
+
+int timespec_cmp(const struct timespec *t1, const struct timespec *t2)
+{
+  if ( t1->tv_sec != t2->tv_sec )
+    return (t1->tv_sec < t2->tv_sec) ? -1 : 1;
+
+  if ( t1->tv_nsec != t2->tv_nsec )
+    return (t1->tv_nsec < t2->tv_nsec) ? -1 : 1;
+
+  return 0;
+}
+
 
 //
 // ARRAY MANIPULATION
@@ -229,6 +281,36 @@ double stat_array_kurtosis(double array[], unsigned int elements)
 
 
 
+//
+// RATE CHIRPS
+//
+// a chirp's gaps shrink geometrically, by the spread factor between each
+// pair, so a single train sweeps the path from its slowest rate up to the
+// rate of its last gap. the client looks for the packet from which the
+// queueing delay keeps on rising.
+//
+
+double chirp_gap_us(double rate, double spread, unsigned int length, unsigned int packet_length, unsigned int index)
+{
+  double gap_min = (double)(packet_length << 3) / rate;
+
+  // the gap ahead of packet index, widest first
+  return gap_min * pow(spread, (double)(length - 1 - index));
+}
+
+double chirp_duration_us(double rate, double spread, unsigned int length, unsigned int packet_length)
+{
+  double duration = 0.0;
+  unsigned int i;
+
+  for (i=1; i<length; i++)
+    duration += chirp_gap_us(rate, spread, length, packet_length, i);
+
+  return duration;
+}
+
+
+
 //
 // MISC
 //
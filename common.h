@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 
 #define VER_MAJOR "0"
 #define VER_MINOR "4"
@@ -35,12 +36,41 @@
 
 #define P1_TRAIN_DISCARD_COUNT_MAX 5
 
+// in-band marker closing every train: train ID, this packet ID, then the
+// train length and the daemon's marker sequence number
+#define TRAIN_MARKER_ID     0xffffffff
+#define TRAIN_MARKER_LENGTH 16
+
+// entries a client may upload in one measurement plan
+#define PLAN_ENTRIES_MAX 64
+
+// a rate chirp's gaps shrink by a spread factor sent scaled by this, its
+// highest rate being sent in kbps
+#define CHIRP_SPREAD_SCALE   1000
+#define CHIRP_SPREAD_DEFAULT 1.2
+#define CHIRP_SPREAD_MIN     1.01
+#define CHIRP_SPREAD_MAX     2.0
+
+// longest a chirp may hold the daemon's sender [us], well within the time
+// the client waits for a train
+#define CHIRP_DURATION_MAX_US 500000
+
+// trains each end sends or receives over loopback to learn its own limit,
+// and the share of the lower limit above which an estimate is the hosts'
+#define HOST_CALIBRATE_TRAINS 200
+#define HOST_LIMITED_RATIO    0.8
+
+// drop trains whose sender stalls add more than this share of the dispersion
+#define TX_DISPERSION_DISTURBED_RATIO 0.25
+#define TX_DISTURBED_RUN_MAX 8
+
 // ASSESSMENT TYPES
 #define BW_ASSESS_UNKNOWN 0
 #define BW_ASSESS_MODE    1
 #define BW_ASSESS_NOMODE  2
 #define BW_ASSESS_LBOUND  3
 #define BW_ASSESS_QUICK   4
+#define BW_ASSESS_CHIRP   5
 
 
 // OPERATING MODE
@@ -49,6 +79,16 @@
 #define MODE_NET_BIND   0x04
 #define MODE_CSV        0x08
 #define MODE_QUICK      0x10
+#define MODE_POISSON    0x20
+#define MODE_BENCH      0x40
+#define MODE_PLAN       0x80
+#define MODE_CHIRP      0x100
+#define MODE_URING      0x200
+#define MODE_BENCH_RX   0x400
+#define MODE_USER_STAMP 0x800
+#define MODE_BUSY_POLL  0x1000
+#define MODE_CAPTURE    0x2000
+#define MODE_XDP        0x4000
 
 
 // MODE CALCULATION
@@ -73,10 +113,28 @@
 #define MSG_TRAIN_PACKET_LENGTH_SET      17
 #define MSG_TRAIN_PACKET_LENGTH_MIN_SET  18
 #define MSG_TRAIN_PACKET_LENGTH_MAX_SET  19
+#define MSG_TRAIN_SCHEDULE_SET           20
+#define MSG_PLAN_RESET                   21
+#define MSG_PLAN_ENTRY_ADD               22
+#define MSG_CHIRP_RATE_SET               23
+#define MSG_CHIRP_SPREAD_SET             24
+#define MSG_HOST_RECEIVE_RATE_SET        25
+#define MSG_HOST_SEND_RATE_GET           26
 #define MSG_TRAIN_SEND                   40
 #define MSG_TRAIN_SENT                   41
 #define MSG_TRAIN_RECEIVE_ACK            42
 #define MSG_TRAIN_RECEIVE_FAIL           43
+#define MSG_TRAIN_REFUSED                44
+#define MSG_TRAIN_TX_GAP                 45
+#define MSG_PLAN_START                   46
+#define MSG_PLAN_DONE                    47
+#define MSG_CHIRP_SEND                   48
+#define MSG_HOST_SEND_RATE               49
+#define MSG_TRAIN_DROPPED                50
+
+// TRAIN SCHEDULES
+#define TRAIN_SCHEDULE_PERIODIC 0
+#define TRAIN_SCHEDULE_POISSON  1
 
 // FSM STATES
 #define FSM_INIT      0
@@ -94,8 +152,12 @@
 // PUBLIC FUNCTIONS
 int send_control_message(int fd, uint32_t code, uint32_t value);
 int receive_control_message(int fd, uint32_t *code, uint32_t *value);
+void decode_control_message(uint32_t ctl_message, uint32_t *code, uint32_t *value);
 
 double time_delta_us(struct timeval t1, struct timeval t2);
+double time_delta_ts_us(struct timespec t1, struct timespec t2);
+void timespec_add_ns(struct timespec *t, long ns);
+int timespec_cmp(const struct timespec *t1, const struct timespec *t2);
 
 void array_sort(double array[], double array_ordered[], unsigned int elements);
 void array_print(double array[], unsigned int elements); 
@@ -106,6 +168,9 @@ double stat_array_median(double array[], unsigned int elements);
 double stat_array_std(double array[], unsigned int elements);
 double stat_array_kurtosis(double array[], unsigned int elements);
 
+double chirp_gap_us(double rate, double spread, unsigned int length, unsigned int packet_length, unsigned int index);
+double chirp_duration_us(double rate, double spread, unsigned int length, unsigned int packet_length);
+
 int int_min(int a, int b);
 int int_max(int a, int b);
 
@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <net/if.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
@@ -21,9 +22,20 @@
 
 #include <ifaddrs.h>
 
+#include <math.h>
 
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+
+
+#include "loco.h"
 #include "common.h"
 #include "debug.h"
+#include "uring.h"
+#include "spsc.h"
+#include "xdp.h"
 
 
 
@@ -41,6 +53,79 @@ struct mode_s
   double bell_kurtosis;
 };
 
+struct receive_batch_s
+{
+  struct mmsghdr msgs[RECEIVE_BATCH];
+  struct iovec iov[RECEIVE_BATCH];
+  char buffers[RECEIVE_BATCH][TRAIN_PACKET_LENGTH_MAX];
+  char control[RECEIVE_BATCH][RECEIVE_CONTROL_SIZE] __attribute__((aligned(sizeof(size_t))));
+
+  // read by the last call, handed out so far, and the most one call reads
+  int count;
+  int next;
+  int size;
+};
+
+struct capture_record_s
+{
+  // of the header, all that is copied of a packet
+  int length;
+  struct timespec t_mark;
+  char header[CAPTURE_HEADER_LENGTH];
+};
+
+struct capture_s
+{
+  pthread_t thread;
+  int running;
+
+  // CPU the thread is pinned to
+  int cpu;
+
+  // stamped packets on their way to the session, the eventfd that wakes
+  // it and the one that stops the thread
+  struct spsc_s records;
+  int notify_fd;
+  int stop_fd;
+
+  struct receive_batch_s batch;
+
+  // packets lost to a full ring
+  unsigned long overruns;
+};
+
+struct plan_entry_s
+{
+  int length;
+  int packet_length;
+  double spacing;
+  int count;
+};
+
+struct plan_train_s
+{
+  // position in the plan, -1 while the slot is free
+  int index;
+  int length;
+  int sent;
+  int dropped;
+
+  uint32_t expected_packet_id;
+  struct timespec timestamps[TRAIN_LENGTH_MAX];
+
+  double tx_gaps[TRAIN_LENGTH_MAX];
+  int tx_gaps_count;
+};
+
+struct plan_result_s
+{
+  int entry;
+
+  // as returned by receive_train(), and the dispersion when received
+  int state;
+  double delta;
+};
+
 struct config_s
 {
   int udp_socket;
@@ -60,6 +145,7 @@ struct config_s
   struct hostent *server;
 
   int mode;
+  int bench_sessions;
   char *csv_filepath;
   char *csv_out_filepath;
   char *assessment_format;
@@ -81,6 +167,73 @@ struct config_s
 
   double packet_dispersion_delta_min;
 
+  // gaps between the daemon's transmit timestamps of the last train [us]
+  double train_tx_gaps[TRAIN_LENGTH_MAX];
+  int train_tx_gaps_count;
+
+  // the daemon has stamped a train, its gaps precede each end of train
+  int train_tx_stamped;
+  int trains_disturbed;
+
+  // the daemon lost part of the current train before it left, and how many
+  // trains that has cost us
+  int train_dropped;
+  int trains_dropped;
+  int trains_disturbed_run;
+
+  // rate chirps: the rate of the last gap [Mbps] and the ratio between
+  // consecutive gaps, as the daemon was told them
+  double chirp_rate;
+  double chirp_spread;
+  double chirp_estimates[CHIRP_COUNT];
+  int chirp_count;
+
+  // fastest this client timestamps a train and the daemon sends one, both
+  // measured over loopback [Mbps], and the lower of the two when known
+  double host_receive_rate;
+  double host_send_rate;
+  double host_bound;
+  int host_limited;
+
+  // io_uring receive backend, and whether its requests are in flight
+  struct uring_s uring;
+  int uring_recv_armed;
+  int uring_poll_armed;
+
+  // both sockets registered for the waits of the socket path
+  int rx_epoll;
+
+  // system calls made waiting for and picking up train packets
+  unsigned long rx_syscalls;
+
+  // the kernel stamps datagrams as they arrive, and how many came without
+  // one and were stamped as they were picked up instead
+  int rx_stamp;
+  unsigned long rx_stamps_missing;
+
+  // sizes the control data ahead of each datagram an io_uring recvmsg reaps
+  struct msghdr uring_msg;
+
+  // datagrams the last recvmmsg() read ahead, handed out one at a time
+  // before the sockets are waited on again
+  struct receive_batch_s rx_batch;
+
+  // receive thread the train packets come through with -C
+  struct capture_s capture;
+
+  // AF_XDP socket the train packets come through with -X, and where
+  struct xdp_s xdp;
+  char xdp_interface[IF_NAMESIZE];
+  int xdp_queue;
+  int xdp_generic;
+
+  // measurement plan uploaded to the daemon and the fate of every train
+  struct plan_entry_s plan[PLAN_ENTRIES_MAX];
+  int plan_count;
+  struct plan_result_s plan_results[PLAN_TRAINS_MAX];
+  int plan_results_count;
+  struct plan_train_s plan_window[PLAN_WINDOW];
+
   // prelim
 
   double prelim_bw_mean;
@@ -153,18 +306,61 @@ int session_csv_write(const char *filepath);
 int session_init(void);
 
 int session_net_init(void);
+int loopback_pair_open(int *source, int *sink);
+double host_receive_rate_measure(void);
+void host_limit_check(void);
 int session_rtt_sync(void);
 int session_prelim(void);
+int session_chirp(void);
+double chirp_rate_get(struct timespec *timestamps, int length, int packet_length);
 int session_p1(void);
+int session_p1_plan(int packet_length_step, int count_size, int count_size_max);
 int session_p1_calculate(void);
 int session_p2(void);
+int session_p2_plan(int count_required);
 int session_p2_calculate(void);
 
 void session_calculate(void);
 
 void session_end(int exit_code);
 
-int receive_train(uint32_t train_id, int length, int packet_length, struct timeval *timestamps);
+int session_bench(void);
+int session_bench_round(int *fds, int count, double *latencies);
+int session_bench_receive(void);
+double bench_receive_drain(int batch_size);
+
+void receive_flush(void);
+int receive_stamp_enable(int fd);
+void receive_stamp_get(struct msghdr *msg, struct timespec *t_mark);
+int receive_datagram(int fd, char *buffer, size_t size, struct timespec *t_mark);
+void receive_batch_init(struct receive_batch_s *batch, int batch_size);
+int receive_batch_fill(struct receive_batch_s *batch, int fd);
+int receive_batch_get(struct receive_batch_s *batch, char *buffer, size_t size, int *n, struct timespec *t_mark);
+int receive_uring_init(void);
+int receive_wait(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us);
+int receive_wait_uring(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us);
+int receive_wait_busy(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us);
+int receive_wait_capture(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us);
+int receive_wait_xdp(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us);
+int receive_wait_epoll(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us);
+int receive_xdp_init(void);
+int capture_start(void);
+void capture_stop(void);
+void * capture_run(void *arg);
+int receive_epoll_init(void);
+int receive_train(uint32_t train_id, int length, int packet_length, struct timespec *timestamps);
+int receive_chirp(uint32_t train_id, int length, int packet_length, struct timespec *timestamps);
+int receive_train_as(uint32_t send_code, uint32_t train_id, int length, int packet_length, struct timespec *timestamps);
+void receive_train_control(uint32_t c_code, uint32_t c_value, int *train_sent);
+void receive_train_control_drain(int *train_sent);
+
+void plan_reset(void);
+int plan_entry_add(int length, int packet_length, double spacing, int count);
+double plan_spacing_get(int length, int packet_length);
+int receive_plan(uint32_t train_id);
+struct plan_train_s * plan_train_get(int index, int *done);
+void plan_train_finish(int index);
+double train_dispersion_get(struct timespec *timestamps, int length);
 
 int calculate_mode(double ordered_array[], short validity_array[], int elements, double bin_width, struct mode_s *mode);
 
@@ -177,6 +373,9 @@ int main(int argc, char **argv)
   if ( session_init() != 0 )
     session_end(1);
 
+  if ( conf.mode & MODE_BENCH )
+    exit( session_bench() );
+
   //
   // CALCULATION SESSION
 
@@ -186,6 +385,28 @@ int main(int argc, char **argv)
   if ( session_rtt_sync() != 0 )
     session_end(1);
 
+  // the calibration reads the socket, only now is our port redirected
+  if ( (conf.mode & MODE_XDP) &&
+       xdp_redirect_set(&conf.xdp, 1) != 0 )
+  {
+    fprintf(stderr, "Unable to redirect to AF_XDP (%s), receiving on the socket.\n", strerror(errno));
+    conf.mode &= ~MODE_XDP;
+  }
+
+  // the benchmark starts and stops its own
+  if ( (conf.mode & MODE_CAPTURE) && ! (conf.mode & MODE_BENCH_RX) &&
+       capture_start() != 0 )
+  {
+    fprintf(stderr, "Unable to start the capture thread (%s).\n", strerror(errno));
+    session_end(1);
+  }
+
+  if ( conf.mode & MODE_BENCH_RX )
+    session_end( session_bench_receive() );
+
+  if ( session_chirp() != 0 )
+    session_end(1);
+
   if ( session_prelim() != 0 )
     session_end(1);
 
@@ -258,11 +479,22 @@ int parse_cmdline(int argc, char **argv)
     {"format", 1, NULL, 'f'},
     {"host", 1, NULL, 'h'},
     {"quick", 0, NULL, 'q'},
+    {"poisson", 0, NULL, 'P'},
     {"interface", 1, NULL, 'I'},
+    {"bench-sessions", 1, NULL, 'S'},
+    {"plan", 0, NULL, 'L'},
+    {"chirp", 0, NULL, 'c'},
+    {"uring", 0, NULL, 'u'},
+    {"bench-receive", 0, NULL, 'R'},
+    {"user-stamps", 0, NULL, 'U'},
+    {"busy-poll", 0, NULL, 'B'},
+    {"capture-cpu", 1, NULL, 'C'},
+    {"xdp", 1, NULL, 'X'},
+    {"xdp-generic", 0, NULL, 'G'},
     {0, 0, 0, 0}
   };
 
-  while( (c=getopt_long(argc, argv, "?b:f:h:p:qr:w:I:V", long_options, &long_option_index)) != EOF )
+  while( (c=getopt_long(argc, argv, "?b:cf:h:p:qr:uw:BC:GI:LPRS:UVX:", long_options, &long_option_index)) != EOF )
   {
     switch (c)
     {
@@ -311,6 +543,65 @@ int parse_cmdline(int argc, char **argv)
       case 'q':
         conf.mode |= MODE_QUICK;
         break;
+      case 'P':
+        conf.mode |= MODE_POISSON;
+        break;
+      case 'L':
+        conf.mode |= MODE_PLAN;
+        break;
+      case 'c':
+        conf.mode |= MODE_CHIRP;
+        break;
+      case 'u':
+        conf.mode |= MODE_URING;
+        break;
+      case 'R':
+        conf.mode |= MODE_BENCH_RX;
+        break;
+      case 'U':
+        conf.mode |= MODE_USER_STAMP;
+        break;
+      case 'B':
+        conf.mode |= MODE_BUSY_POLL;
+        break;
+      case 'C':
+        conf.capture.cpu = atoi(optarg);
+        if ( (conf.capture.cpu < 0) || (conf.capture.cpu >= CPU_SETSIZE) )
+        {
+          fprintf(stderr, "FATAL: Capture CPU %s is not valid!\n", optarg);
+          exit(1);
+        }
+        conf.mode |= MODE_CAPTURE;
+        break;
+      case 'X':
+        // "interface[:queue]", the first queue if none is given
+        snprintf(conf.xdp_interface, IF_NAMESIZE, "%s", optarg);
+        if ( strchr(conf.xdp_interface, ':') != NULL )
+        {
+          *strchr(conf.xdp_interface, ':') = '\0';
+          conf.xdp_queue = atoi(strchr(optarg, ':') + 1);
+        }
+        if ( (conf.xdp_interface[0] == '\0') || (conf.xdp_queue < 0) )
+        {
+          fprintf(stderr, "FATAL: XDP interface %s is not valid!\n", optarg);
+          exit(1);
+        }
+        // the ring's frames are stamped in user space, so is everything
+        // else, or a train could mix the kernel's clock with ours
+        conf.mode |= MODE_XDP | MODE_USER_STAMP;
+        break;
+      case 'G':
+        conf.xdp_generic = 1;
+        break;
+      case 'S':
+        conf.bench_sessions = atoi(optarg);
+        if ( (conf.bench_sessions <= 0) || (conf.bench_sessions > BENCH_SESSION_COUNT_MAX) )
+        {
+          fprintf(stderr, "FATAL: Session count %s is not valid (1-%d)!\n", optarg, BENCH_SESSION_COUNT_MAX);
+          exit(1);
+        }
+        conf.mode |= MODE_BENCH;
+        break;
       case 'r':
         if ( NULL == conf.csv_filepath )
           conf.csv_filepath = strdup(optarg);
@@ -331,6 +622,13 @@ int parse_cmdline(int argc, char **argv)
     fprintf(stderr, "FATAL: You can't mix online and offline parameters!\n");
     exit(1);
   }
+  else if ( (conf.mode & (MODE_BENCH | MODE_BENCH_RX)) &&
+            ! (conf.mode & MODE_NET) )
+  {
+    // benchmarking needs a daemon to talk to
+    fprintf(stderr, "FATAL: Session benchmark requires a host!\n");
+    exit(1);
+  }
   else if ( ! ((conf.mode & MODE_CSV) ||
                (conf.mode & MODE_NET)) )
   {
@@ -375,6 +673,17 @@ void usage(const char *program_name)
   fprintf(stdout, "  -h <hostname> Specify the testing server's hostname to coordinate with.\n");
   fprintf(stdout, "  -I <iface>    Specify the interface to bind traffic on.\n");
   fprintf(stdout, "  -q            Force a quick (most likely less accurate) assessment.\n");
+  fprintf(stdout, "  -P            Space trains with exponential (Poisson) gaps.\n");
+  fprintf(stdout, "  -L            Upload each phase as a plan the daemon streams on its own.\n");
+  fprintf(stdout, "  -c            Estimate from a few rate chirps instead (quickest).\n");
+  fprintf(stdout, "  -u            Receive trains through io_uring instead of epoll.\n");
+  fprintf(stdout, "  -S <n>        Benchmark control latency with up to n concurrent sessions.\n");
+  fprintf(stdout, "  -R            Benchmark the recvmsg(), recvmmsg(), busy poll and io_uring receive paths.\n");
+  fprintf(stdout, "  -U            Timestamp trains in user space instead of the kernel.\n");
+  fprintf(stdout, "  -B            Spin on the sockets instead of sleeping (dedicated cores).\n");
+  fprintf(stdout, "  -C <cpu>      Receive train packets on a thread pinned to the given CPU.\n");
+  fprintf(stdout, "  -X <if[:q]>   Receive train packets through AF_XDP on the interface's queue.\n");
+  fprintf(stdout, "  -G            Attach the XDP program in generic (skb) mode.\n");
   fprintf(stdout, "  -w <file>     Specify file for writing of collected metric data. (Default: /tmp/loco.csv)\n");
   fprintf(stdout, "\n");
   fprintf(stdout, " Offline Options:\n");
@@ -388,6 +697,17 @@ void usage(const char *program_name)
   fprintf(stdout, "  --host        Same as 'h'\n");
   fprintf(stdout, "  --interface   Same as 'I'\n");
   fprintf(stdout, "  --quick       Same as 'q'\n");
+  fprintf(stdout, "  --poisson     Same as 'P'\n");
+  fprintf(stdout, "  --plan        Same as 'L'\n");
+  fprintf(stdout, "  --chirp       Same as 'c'\n");
+  fprintf(stdout, "  --uring       Same as 'u'\n");
+  fprintf(stdout, "  --bench-sessions Same as 'S'\n");
+  fprintf(stdout, "  --bench-receive Same as 'R'\n");
+  fprintf(stdout, "  --user-stamps Same as 'U'\n");
+  fprintf(stdout, "  --busy-poll   Same as 'B'\n");
+  fprintf(stdout, "  --capture-cpu Same as 'C'\n");
+  fprintf(stdout, "  --xdp         Same as 'X'\n");
+  fprintf(stdout, "  --xdp-generic Same as 'G'\n");
   fprintf(stdout, "\n");
   fprintf(stdout, " Format Options:\n");
   fprintf(stdout, "  %%be           Bandwidth estimated [Mbps]\n");
@@ -401,6 +721,8 @@ void usage(const char *program_name)
   fprintf(stdout, "  %%pm           Preliminary assessed bandwidth average [Mbps]\n");
   fprintf(stdout, "  %%ps           Preliminary assessed standard deviation [Mbps]\n");
   fprintf(stdout, "  %%lt           Round trip / latency time of the communication channel (TCP) [us]\n");
+  fprintf(stdout, "  %%hl           Estimate limited by the end-hosts (1) or not (0)\n");
+  fprintf(stdout, "  %%hb           End-host bound, the slower of sending and receiving [Mbps]\n");
   fprintf(stdout, "\n");
 }
 
@@ -431,6 +753,13 @@ int session_init()
   conf.p2_train_packet_length_max = TRAIN_PACKET_LENGTH_MAX;
 
   conf.packet_dispersion_delta_min = 0.0;
+  conf.train_tx_gaps_count = 0;
+  conf.trains_disturbed = 0;
+  conf.trains_disturbed_run = 0;
+  conf.train_dropped = 0;
+  conf.trains_dropped = 0;
+
+  receive_batch_init(&conf.rx_batch, RECEIVE_BATCH);
 
   conf.bandwidth_assessment = BW_ASSESS_UNKNOWN;
   conf.bandwidth_lo = 0.0;
@@ -439,7 +768,7 @@ int session_init()
   conf.bin_width = 0.0;
 
   if ( NULL == conf.assessment_format)
-    conf.assessment_format = "%be%am%AM%bl%bu%bw%pd%ul";
+    conf.assessment_format = "%be%am%AM%bl%bu%bw%pd%ul%hl%hb";
 
   if ( NULL == conf.csv_out_filepath)
     conf.csv_out_filepath = "/tmp/loco.csv";
@@ -466,6 +795,10 @@ int session_net_init()
   if ( fsm_state_get() != FSM_INIT )
     return 1;
 
+  uint32_t ctl_code, ctl_value;
+
+  conf.host_receive_rate = host_receive_rate_measure();
+
   /* gethostbyname: get the server's DNS entry */
   conf.server = gethostbyname(conf.hostname);
   if (conf.server == NULL)
@@ -485,6 +818,9 @@ int session_net_init()
   if (conf.udp_socket < 0)
     exit(1);
 
+  // train packets are stamped by the kernel on arrival where it can
+  conf.rx_stamp = (receive_stamp_enable(conf.udp_socket) == 0);
+
   /* bondage time */
   if ( conf.mode & MODE_NET_BIND )
   {
@@ -597,6 +933,30 @@ int session_net_init()
   int udp_flags = fcntl(conf.udp_socket, F_GETFL, 0);
   fcntl(conf.udp_socket, udp_flags | O_NONBLOCK);
 
+  if ( receive_epoll_init() != 0 )
+  {
+    fprintf(stderr, "Unable to set up epoll (%s).\n", strerror(errno));
+    session_end(1);
+  }
+
+  // a failed io_uring set up costs nothing but the speed up
+  if ( (conf.mode & (MODE_URING | MODE_BENCH_RX)) &&
+       receive_uring_init() != 0 )
+  {
+    if ( conf.mode & MODE_URING )
+      fprintf(stderr, "Unable to set up io_uring (%s), receiving with epoll.\n", strerror(errno));
+
+    conf.mode &= ~MODE_URING;
+    conf.uring.fd = -1;
+  }
+
+  // as with io_uring, the socket is always there to fall back on
+  if ( (conf.mode & MODE_XDP) &&
+       receive_xdp_init() != 0 )
+  {
+    fprintf(stderr, "Unable to set up AF_XDP on %s (%s), receiving on the socket.\n", conf.xdp_interface, strerror(errno));
+    conf.mode &= ~MODE_XDP;
+  }
 
   // TCP/UDP SOCKET INIT - END
   //
@@ -606,11 +966,142 @@ int session_net_init()
   // inform daemon our listening port for trains' destination
   send_control_message(conf.tcp_socket, MSG_SESSION_CLIENT_UDP_PORT_SET, conf.udp_port);
 
+  // swap what each end can do, nothing else is in flight yet
+  send_control_message(conf.tcp_socket, MSG_HOST_RECEIVE_RATE_SET, (conf.host_receive_rate > 0xffffff) ? 0xffffff : (uint32_t)conf.host_receive_rate);
+  send_control_message(conf.tcp_socket, MSG_HOST_SEND_RATE_GET, 0);
+
+  if ( (receive_control_message(conf.tcp_socket, &ctl_code, &ctl_value) == 0) &&
+       (ctl_code == MSG_HOST_SEND_RATE) )
+    conf.host_send_rate = ctl_value;
+
+  if ( (conf.host_send_rate > 0) && (conf.host_receive_rate > 0) )
+    conf.host_bound = (conf.host_send_rate < conf.host_receive_rate) ? conf.host_send_rate : conf.host_receive_rate;
+  else
+    conf.host_bound = (conf.host_send_rate > 0) ? conf.host_send_rate : conf.host_receive_rate;
+
+  ulog(LOG_INFO, "Host rates: %.0f Mbps daemon sending, %.0f Mbps receiving\n", conf.host_send_rate, conf.host_receive_rate);
+
   fsm_state_set(FSM_RTT_SYNC);
 
   return 0;
 }
 
+//
+// HOST CAPABILITY
+//
+// trains are sent to ourselves over loopback and timestamped as
+// receive_train() would, after the whole train has been queued, so only the
+// cost of picking up and stamping each packet is timed. with the kernel
+// stamping arrivals that cost drops out, leaving how fast loopback takes
+// the train in, which bounds the stamps just the same. an estimate near
+// the slower of this and the daemon's send rate says more about the hosts
+// than about the path.
+//
+
+int loopback_pair_open(int *source, int *sink)
+{
+  struct sockaddr_in sink_addr;
+  socklen_t len = sizeof(sink_addr);
+  int rcvbuf = TRAIN_LENGTH_MAX * TRAIN_PACKET_LENGTH_MAX * 4;
+
+  if ( (*sink = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
+    return 1;
+
+  if ( (*source = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
+  {
+    close(*sink);
+    return 1;
+  }
+
+  // stamped as train packets are, a whole train at a time
+  setsockopt(*sink, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  receive_stamp_enable(*sink);
+
+  bzero(&sink_addr, sizeof(sink_addr));
+  sink_addr.sin_family = AF_INET;
+  sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ( bind(*sink, (struct sockaddr *)&sink_addr, sizeof(sink_addr)) != 0 ||
+       getsockname(*sink, (struct sockaddr *)&sink_addr, &len) != 0 ||
+       connect(*source, (struct sockaddr *)&sink_addr, sizeof(sink_addr)) != 0 )
+  {
+    close(*source);
+    close(*sink);
+    return 1;
+  }
+
+  return 0;
+}
+
+double host_receive_rate_measure()
+{
+  struct timespec t_first, t_mark;
+  struct timeval t_select;
+  fd_set read_fds;
+  char packet_buffer[TRAIN_PACKET_LENGTH_MAX];
+  double bits = 0.0;
+  double time_us = 0.0;
+  int source, sink;
+  int received;
+  int i, j;
+
+  bzero(packet_buffer, sizeof(packet_buffer));
+
+  if ( loopback_pair_open(&source, &sink) != 0 )
+    return 0.0;
+
+  for (i=0; i<HOST_CALIBRATE_TRAINS; i++)
+  {
+    for (j=0; j<TRAIN_LENGTH_MAX; j++)
+      send(source, packet_buffer, sizeof(packet_buffer), 0);
+
+    received = 0;
+
+    while ( received < TRAIN_LENGTH_MAX )
+    {
+      FD_ZERO(&read_fds);
+      FD_SET(sink, &read_fds);
+      t_select.tv_sec = 0;
+      t_select.tv_usec = 10000;
+
+      if ( select(sink + 1, &read_fds, NULL, NULL, &t_select) <= 0 )
+        break;
+
+      if ( receive_datagram(sink, packet_buffer, sizeof(packet_buffer), &t_mark) <= 0 )
+        break;
+
+      if ( received++ == 0 )
+        t_first = t_mark;
+    }
+
+    // the first packet only opens the train, as for a dispersion
+    if ( received > 1 )
+    {
+      bits += (double)((received - 1) * TRAIN_PACKET_LENGTH_MAX * 8);
+      time_us += time_delta_ts_us(t_first, t_mark);
+    }
+  }
+
+  close(source);
+  close(sink);
+
+  return (time_us > 0) ? bits / time_us : 0.0;
+}
+
+void host_limit_check()
+{
+  if ( conf.host_bound <= 0 )
+    return;
+
+  conf.host_limited = (conf.bandwidth_estimated >= conf.host_bound * HOST_LIMITED_RATIO);
+
+  if ( conf.host_limited )
+  {
+    ulog(LOG_INFO, "Estimate of %.2f Mbps is close to the %.0f Mbps the hosts can do, the path may be faster.\n",
+         conf.bandwidth_estimated, conf.host_bound);
+  }
+}
+
 int session_rtt_sync()
 {
   progress_set(5);
@@ -678,6 +1169,13 @@ int session_rtt_sync()
 
   ulog(LOG_INFO, "Maximum train spacing: %.4fus\n", conf.train_spacing_max);
 
+  // sample the path at exponential intervals within the spacing range
+  if ( conf.mode & MODE_POISSON )
+  {
+    send_control_message(conf.tcp_socket, MSG_TRAIN_SCHEDULE_SET, TRAIN_SCHEDULE_POISSON);
+    ulog(LOG_INFO, "Train schedule: poisson\n");
+  }
+
   // determine maximum packet size (base on TCP MSS)
   socklen_t opt_len;
   opt_len = sizeof(conf.train_packet_length_max);
@@ -701,11 +1199,16 @@ int session_rtt_sync()
   // we need to remove the average user/kernel latency from our final
   // measurement.
   //
+  // with kernel stamps a packet is only timed as far as its arrival, the
+  // hand over to user space is then measured on its own rather than taken
+  // as half the round trip.
+  //
 
   ulog(LOG_INFO, "[I] UDP kernel/userspace latency detection ...\n");
 
   int n;
   char *packet_random;
+  struct timespec t_send, t_stamp, t_user;
   double packet_deltas[LATENCY_VALID_COUNT] = { 0.0 };
   double latency_total_time = 0;
 
@@ -717,23 +1220,21 @@ int session_rtt_sync()
     return 1;
   }
 
-  opt_len = sizeof(conf.udp_addr);
-
   int latency_count = 0;
   int latency_count_valid = 0;
 
   while ( latency_count_valid < LATENCY_VALID_COUNT && latency_count < LATENCY_COUNT_MAX )
   {
-    gettimeofday(&t_mark1, (struct timezone*)0);
+    clock_gettime(CLOCK_REALTIME, &t_send);
     sendto(conf.udp_socket, packet_random, conf.train_packet_length_max, 0, (struct sockaddr *)&conf.udp_addr, sizeof(struct sockaddr_in));
-    n = recvfrom(conf.udp_socket, packet_random, conf.train_packet_length_max, 0, (struct sockaddr *)&conf.udp_addr, &opt_len);
-    gettimeofday(&t_mark2, (struct timezone*)0);
+    n = receive_datagram(conf.udp_socket, packet_random, conf.train_packet_length_max, &t_stamp);
+    clock_gettime(CLOCK_REALTIME, &t_user);
 
     if ( (latency_count > 0) &&
          (n == conf.train_packet_length_max) )
     {
-      packet_deltas[latency_count_valid] = time_delta_us(t_mark1, t_mark2);
-      latency_total_time += packet_deltas[latency_count_valid];
+      packet_deltas[latency_count_valid] = time_delta_ts_us(t_send, t_stamp);
+      latency_total_time += conf.rx_stamp ? time_delta_ts_us(t_stamp, t_user) : packet_deltas[latency_count_valid] / 2.0;
       latency_count_valid++;
     }
 
@@ -753,9 +1254,9 @@ int session_rtt_sync()
     return 1;
   }
 
-  conf.latency_udp_kernel_user_average = (latency_total_time / (double)LATENCY_VALID_COUNT / 2.0);
+  conf.latency_udp_kernel_user_average = (latency_total_time / (double)LATENCY_VALID_COUNT);
 
-  ulog(LOG_INFO, "Average UDP kernel/user latency: %.4fus\n", conf.latency_udp_kernel_user_average);
+  ulog(LOG_INFO, "Average UDP kernel/user latency: %.4fus (%s timestamps)\n", conf.latency_udp_kernel_user_average, conf.rx_stamp ? "kernel" : "user space");
 
 
 
@@ -765,7 +1266,7 @@ int session_rtt_sync()
   conf.train_length = TRAIN_LENGTH_MIN;
   conf.train_packet_length = conf.train_packet_length_max;
 
-  struct timeval timestamps[TRAIN_LENGTH_MAX];
+  struct timespec timestamps[TRAIN_LENGTH_MAX];
   int train_id = 1;
   int train_state = 0;
   int train_fails[TRAIN_LENGTH_MAX] = { 0 };
@@ -805,7 +1306,15 @@ int session_rtt_sync()
       continue;
     }
 
-    delta = time_delta_us(timestamps[0], timestamps[conf.train_length-1]);
+    delta = train_dispersion_get(timestamps, conf.train_length);
+
+    // the daemon stalled mid train, the dispersion is not the path's
+    if ( delta < 0 )
+    {
+      conf.p1_trains_count_discarded++;
+      continue;
+    }
+
     bandwidth = (double)((conf.train_packet_length_max << 3) * conf.train_length) / delta;
 
     if ( delta > conf.packet_dispersion_delta_min )
@@ -880,7 +1389,7 @@ int session_prelim()
 
   ulog(LOG_INFO, "[I] Preliminary assessment ...\n");
 
-  struct timeval timestamps[TRAIN_LENGTH_MAX];
+  struct timespec timestamps[TRAIN_LENGTH_MAX];
 
   int train_id = 1;
   int train_state = 0;
@@ -913,7 +1422,15 @@ int session_prelim()
       if ( train_state != 0 )
         continue;
 
-      delta = time_delta_us(timestamps[0], timestamps[conf.train_length-1]);
+      delta = train_dispersion_get(timestamps, conf.train_length);
+
+      // the daemon stalled mid train, the dispersion is not the path's
+      if ( delta < 0 )
+      {
+        conf.p1_trains_count_discarded++;
+        continue;
+      }
+
       bandwidth = (double)((conf.train_packet_length_max << 3) * conf.train_length) / delta;
 
       if ( delta > conf.packet_dispersion_delta_min )
@@ -946,7 +1463,9 @@ int session_prelim()
                  "  Valid measurements: %d (out of %d)\n"
                  "  Average: %.4f Mbps\n"
                  "  Standard Deviation: %.4f Mbps\n"
-                 "  Coefficient of Variance: %.4f\n", conf.p1_trains_count, conf.p1_trains_count + conf.p1_trains_count_discarded, conf.prelim_bw_mean, conf.prelim_bw_std, conf.prelim_bw_std/conf.prelim_bw_mean);
+                 "  Coefficient of Variance: %.4f\n"
+                 "  Trains disturbed at sender: %d\n"
+                 "  Trains dropped at sender: %d\n", conf.p1_trains_count, conf.p1_trains_count + conf.p1_trains_count_discarded, conf.prelim_bw_mean, conf.prelim_bw_std, conf.prelim_bw_std/conf.prelim_bw_mean, conf.trains_disturbed, conf.trains_dropped);
 
   conf.bandwidth_assessment = BW_ASSESS_QUICK;
   conf.bandwidth_estimated = conf.prelim_bw_mean;
@@ -975,6 +1494,168 @@ int session_prelim()
   return 0;
 }
 
+//
+// RATE CHIRPS
+//
+// each chirp sweeps from a rate well under the estimate taken during train
+// length discovery to twice it, its gaps shrinking geometrically. while the
+// probing rate stays under the available bandwidth every packet meets an
+// empty queue, once above it the queueing delay keeps on rising. the rate
+// at that turn is the estimate, the median over a few chirps the result.
+// it stands in for the preliminary assessment and both phases.
+//
+
+int session_chirp()
+{
+  struct timespec timestamps[TRAIN_LENGTH_MAX];
+  double estimates_ordered[CHIRP_COUNT];
+  double prior;
+  double range = CHIRP_RATE_RANGE;
+  int train_id = 1;
+  int count = 0;
+  int length;
+
+  // only if we've been asked for chirps
+  if ( ! (conf.mode & MODE_CHIRP) || ! (conf.mode & MODE_NET) )
+    return 0;
+
+  // only valid once the train length is known
+  if ( fsm_state_get() != FSM_PRELIM )
+    return 1;
+
+  ulog(LOG_INFO, "[I] Rate chirp assessment ...\n");
+
+  prior = stat_array_interquartile_mean(conf.p1_trains_bw, conf.p1_trains_count);
+
+  // a chirp needs at least two gaps to have a turn in it
+  length = (conf.train_length_max < 3) ? 3 : conf.train_length_max;
+
+  // work from what the daemon will make of them
+  conf.chirp_rate = prior * CHIRP_RATE_FACTOR;
+  conf.chirp_rate = (double)((uint32_t)(conf.chirp_rate * 1000.0) & 0xffffff) / 1000.0;
+
+  // the daemon sends no chirp longer than CHIRP_DURATION_MAX_US, on a slow
+  // path sweep a narrower range and then, if need be, use fewer packets
+  while ( 1 )
+  {
+    conf.chirp_spread = pow(range, 1.0 / (double)(length - 2));
+    conf.chirp_spread = (conf.chirp_spread < CHIRP_SPREAD_MIN) ? CHIRP_SPREAD_MIN : conf.chirp_spread;
+    conf.chirp_spread = (conf.chirp_spread > CHIRP_SPREAD_MAX) ? CHIRP_SPREAD_MAX : conf.chirp_spread;
+    conf.chirp_spread = (double)(uint32_t)(conf.chirp_spread * CHIRP_SPREAD_SCALE) / CHIRP_SPREAD_SCALE;
+
+    if ( (conf.chirp_rate <= 0.0) ||
+         chirp_duration_us(conf.chirp_rate, conf.chirp_spread, length, conf.train_packet_length_max) <= CHIRP_DURATION_MAX_US )
+      break;
+
+    if ( range > CHIRP_RATE_RANGE_MIN )
+      range = (range / 2.0 < CHIRP_RATE_RANGE_MIN) ? CHIRP_RATE_RANGE_MIN : range / 2.0;
+    else if ( length > 3 )
+      length = (length - length / 4 < 3) ? 3 : length - length / 4;
+    else
+    {
+      ulog(LOG_ERROR, "Path too slow for a chirp to fit in %d us.\n", CHIRP_DURATION_MAX_US);
+      return 1;
+    }
+  }
+
+  ulog(LOG_INFO, "Chirps of %d packets from %.4f to %.4f Mbps (spread %.3f)\n", length,
+       conf.chirp_rate / pow(conf.chirp_spread, length - 2), conf.chirp_rate, conf.chirp_spread);
+
+  send_control_message(conf.tcp_socket, MSG_TRAIN_LENGTH_SET, length);
+  send_control_message(conf.tcp_socket, MSG_TRAIN_PACKET_LENGTH_SET, conf.train_packet_length_max);
+  send_control_message(conf.tcp_socket, MSG_CHIRP_RATE_SET, (uint32_t)(conf.chirp_rate * 1000.0));
+  send_control_message(conf.tcp_socket, MSG_CHIRP_SPREAD_SET, (uint32_t)(conf.chirp_spread * CHIRP_SPREAD_SCALE));
+
+  conf.chirp_count = 0;
+
+  while ( (conf.chirp_count < CHIRP_COUNT) && (count < CHIRP_COUNT_MAX) )
+  {
+    send_control_message(conf.tcp_socket, MSG_TRAIN_ID_SET, train_id);
+
+    count++;
+
+    if ( receive_chirp(train_id++, length, conf.train_packet_length_max, timestamps) != 0 )
+      continue;
+
+    conf.chirp_estimates[conf.chirp_count] = chirp_rate_get(timestamps, length, conf.train_packet_length_max);
+
+    ulog(LOG_DEBUG, "Chirp %d turned at %.4f Mbps\n", conf.chirp_count, conf.chirp_estimates[conf.chirp_count]);
+
+    conf.chirp_count++;
+    progress_set(15 + (int)(80.0*((double)conf.chirp_count / (double)CHIRP_COUNT)));
+  }
+
+  if ( conf.chirp_count == 0 )
+  {
+    ulog(LOG_ERROR, "No chirps have been received.\n");
+    return 1;
+  }
+
+  array_sort(conf.chirp_estimates, estimates_ordered, conf.chirp_count);
+
+  conf.bandwidth_assessment = BW_ASSESS_CHIRP;
+  conf.bandwidth_estimated = (estimates_ordered[(conf.chirp_count - 1) / 2] + estimates_ordered[conf.chirp_count / 2]) / 2.0;
+  conf.bandwidth_lo = estimates_ordered[conf.chirp_count / 4];
+  conf.bandwidth_hi = estimates_ordered[(conf.chirp_count * 3) / 4];
+  conf.bin_width = 0.0;
+
+  ulog(LOG_INFO, "Rate chirp measurements:\n"
+                 "  Valid chirps: %d (out of %d)\n"
+                 "  Median: %.4f Mbps\n"
+                 "  Interquartile range: %.4f - %.4f Mbps\n", conf.chirp_count, count,
+                 conf.bandwidth_estimated, conf.bandwidth_lo, conf.bandwidth_hi);
+
+  session_end(0);
+
+  return 0;
+}
+
+double chirp_rate_get(struct timespec *timestamps, int length, int packet_length)
+{
+  double gaps[TRAIN_LENGTH_MAX];
+  double queue[TRAIN_LENGTH_MAX];
+  double bits = (double)(packet_length << 3);
+  double sent = 0.0;
+  double base;
+  int stamped = (conf.train_tx_gaps_count == length - 1);
+  int turn = 0;
+  int i;
+
+  // the daemon's own stamps where it sent them, the nominal gaps otherwise
+  gaps[0] = 0.0;
+  for (i=1; i<length; i++)
+  {
+    gaps[i] = (bits / conf.chirp_rate) * pow(conf.chirp_spread, length - 1 - i);
+
+    if ( stamped && (conf.train_tx_gaps[i-1] > 0) )
+      gaps[i] = conf.train_tx_gaps[i-1];
+  }
+
+  // one way delay of each packet relative to the first, free of clock offset
+  for (i=0; i<length; i++)
+  {
+    sent += gaps[i];
+    queue[i] = time_delta_ts_us(timestamps[0], timestamps[i]) - sent;
+  }
+
+  base = queue[0];
+  for (i=1; i<length; i++)
+    if ( queue[i] < base )
+      base = queue[i];
+
+  // the last packet to find the queue empty, the delay never drops back after it
+  for (i=0; i<length; i++)
+    if ( queue[i] <= base + CHIRP_QUEUE_THRESHOLD_US )
+      turn = i;
+
+  // never filled, the path has at least the chirp's highest rate to spare
+  if ( turn == length - 1 )
+    return bits / gaps[length - 1];
+
+  // otherwise between the last rate it absorbed and the first it did not
+  return (bits / gaps[int_max(turn, 1)] + bits / gaps[turn + 1]) / 2.0;
+}
+
 
 int session_p1()
 {
@@ -1000,7 +1681,7 @@ int session_p1()
 
   ulog(LOG_INFO, "[I] Phase 1 processing ...\n");
 
-  struct timeval timestamps[TRAIN_LENGTH_MAX];
+  struct timespec timestamps[TRAIN_LENGTH_MAX];
 
   int i;
   int train_id = 1;
@@ -1020,6 +1701,15 @@ int session_p1()
   conf.train_length = TRAIN_LENGTH_MIN;
   conf.train_packet_length = conf.train_packet_length_min;
 
+  if ( conf.mode & MODE_PLAN )
+  {
+    session_p1_plan(p1_packet_length_step, p1_train_count_size, p1_train_count_size_max);
+
+    fsm_state_set(FSM_P1_CALC);
+
+    return 0;
+  }
+
   for (i=0; i<TRAIN_PACKET_LENGTH_SIZES; i++)
   {
     // set initial train conditions
@@ -1046,7 +1736,15 @@ int session_p1()
       if ( train_state != 0 )
         continue;
 
-      delta = time_delta_us(timestamps[0], timestamps[conf.train_length-1]);
+      delta = train_dispersion_get(timestamps, conf.train_length);
+
+      // the daemon stalled mid train, the dispersion is not the path's
+      if ( delta < 0 )
+      {
+        conf.p1_trains_count_discarded++;
+        continue;
+      }
+
       bandwidth = (double)((conf.train_packet_length_max << 3) * conf.train_length) / delta;
 
       if ( delta > conf.packet_dispersion_delta_min )
@@ -1095,23 +1793,114 @@ int session_p1()
   return 0;
 }
 
-int session_p1_calculate()
+int session_p1_plan(int packet_length_step, int count_size, int count_size_max)
 {
-  progress_set(50);
+  int valid[TRAIN_PACKET_LENGTH_SIZES];
+  int attempts[TRAIN_PACKET_LENGTH_SIZES];
+  int sizes[PLAN_ENTRIES_MAX];
+  int packet_length;
+  int total;
+  int count;
+  int i, k;
+  uint32_t train_id = 1;
 
-  // only valid if we're initialising
-  if ( fsm_state_get() != FSM_P1_CALC )
-    return 1;
+  struct plan_entry_s *entry;
+  double delta = 0.0;
+  double bandwidth = 0.0;
 
-  ulog(LOG_INFO, "[I] Phase 1 mode calculation ...\n");
+  bzero(valid, sizeof(valid));
+  bzero(attempts, sizeof(attempts));
 
-  if ( conf.prelim_bw_mean < 1.0 )
-    conf.bin_width = conf.prelim_bw_mean * .25;
-  else
-    conf.bin_width = conf.prelim_bw_mean * .125;
+  // every packet length is planned at once, shortfalls are planned again
+  // until each has its valid trains or has used up its discards
+  while ( 1 )
+  {
+    plan_reset();
+    total = 0;
 
-  // sort the array in preperation for mode calculation and mark all trains as valid for classification
-  array_sort(conf.p1_trains_bw, conf.p1_trains_bw, conf.p1_trains_count);
+    for (i=0; i<TRAIN_PACKET_LENGTH_SIZES; i++)
+    {
+      count = int_min(count_size - valid[i], count_size_max - attempts[i]);
+      count = int_min(count, PLAN_TRAINS_MAX - total);
+
+      if ( count <= 0 )
+        continue;
+
+      packet_length = int_min(conf.train_packet_length_min + (i * packet_length_step), conf.train_packet_length_max);
+
+      sizes[conf.plan_count] = i;
+      if ( plan_entry_add(TRAIN_LENGTH_MIN, packet_length, plan_spacing_get(TRAIN_LENGTH_MIN, packet_length), count) != 0 )
+        break;
+
+      total += count;
+    }
+
+    if ( conf.plan_count == 0 )
+      break;
+
+    ulog(LOG_INFO, "Streaming plan of %d trains over %d packet lengths\n", total, conf.plan_count);
+
+    receive_plan(train_id);
+    train_id += conf.plan_results_count;
+
+    for (k=0; k<conf.plan_results_count; k++)
+    {
+      entry = &conf.plan[conf.plan_results[k].entry];
+      i = sizes[conf.plan_results[k].entry];
+
+      attempts[i]++;
+
+      if ( conf.plan_results[k].state != 0 )
+        continue;
+
+      delta = conf.plan_results[k].delta;
+
+      // the daemon stalled mid train, the dispersion is not the path's
+      if ( delta < 0 )
+      {
+        conf.p1_trains_count_discarded++;
+        continue;
+      }
+
+      bandwidth = (double)((conf.train_packet_length_max << 3) * entry->length) / delta;
+
+      if ( (delta > conf.packet_dispersion_delta_min) && (conf.p1_trains_count < 4096) )
+      {
+        conf.p1_trains_delta[conf.p1_trains_count] = delta;
+        conf.p1_trains_bw[conf.p1_trains_count] = bandwidth;
+        conf.p1_trains_count++;
+
+        valid[i]++;
+      }
+      else
+        conf.p1_trains_count_discarded++;
+
+      ulog(LOG_DEBUG, "  Detected bandwith: %.4f Mbps (%.2f, %.2f)\n", bandwidth, delta, conf.packet_dispersion_delta_min);
+    }
+
+    progress_set(25 + (int)(25.0 * ((double)conf.p1_trains_count / (double)(count_size * TRAIN_PACKET_LENGTH_SIZES))));
+  }
+
+  return 0;
+}
+
+int session_p1_calculate()
+{
+  progress_set(50);
+
+  // only valid if we're initialising
+  if ( fsm_state_get() != FSM_P1_CALC )
+    return 1;
+
+  ulog(LOG_INFO, "[I] Phase 1 mode calculation ...\n");
+
+  if ( conf.prelim_bw_mean < 1.0 )
+    conf.bin_width = conf.prelim_bw_mean * .25;
+  else
+    conf.bin_width = conf.prelim_bw_mean * .125;
+
+  // sort the array in preperation for mode calculation and mark all trains as valid for classification
+  array_sort(conf.p1_trains_bw, conf.p1_trains_bw, conf.p1_trains_count);
 
   short trains_valid[4096];
   int i;
@@ -1150,7 +1939,7 @@ int session_p2()
 
   ulog(LOG_INFO, "[I] Phase 2 assessment ...\n");
 
-  struct timeval timestamps[TRAIN_LENGTH_MAX];
+  struct timespec timestamps[TRAIN_LENGTH_MAX];
 
   int train_id = 1;
   int train_state = 0;
@@ -1164,6 +1953,15 @@ int session_p2()
   conf.train_length = conf.train_length_max;
   conf.train_packet_length = conf.train_packet_length_max;
 
+  if ( conf.mode & MODE_PLAN )
+  {
+    session_p2_plan(p2_train_count_required);
+
+    fsm_state_set(FSM_P2_CALC);
+
+    return 0;
+  }
+
   // set initial train conditions
   send_control_message(conf.tcp_socket, MSG_TRAIN_ID_SET, train_id);
   send_control_message(conf.tcp_socket, MSG_TRAIN_LENGTH_SET, conf.train_length);
@@ -1179,7 +1977,15 @@ int session_p2()
     if ( train_state != 0 )
       continue;
 
-    delta = time_delta_us(timestamps[0], timestamps[conf.train_length-1]);
+    delta = train_dispersion_get(timestamps, conf.train_length);
+
+    // the daemon stalled mid train, the dispersion is not the path's
+    if ( delta < 0 )
+    {
+      conf.p2_trains_count_discarded++;
+      continue;
+    }
+
     bandwidth = (double)((conf.train_packet_length_max << 3) * conf.train_length) / delta;
 
     if ( delta > conf.packet_dispersion_delta_min )
@@ -1206,6 +2012,62 @@ int session_p2()
   return 0;
 }
 
+int session_p2_plan(int count_required)
+{
+  int count_valid = 0;
+  uint32_t train_id = 1;
+  int k;
+
+  double delta = 0.0;
+  double bandwidth = 0.0;
+
+  while ( count_valid < count_required )
+  {
+    plan_reset();
+    plan_entry_add(conf.train_length, conf.train_packet_length, plan_spacing_get(conf.train_length, conf.train_packet_length),
+                   int_min(count_required - count_valid, PLAN_TRAINS_MAX));
+
+    ulog(LOG_INFO, "Streaming plan of %d trains\n", conf.plan[0].count);
+
+    receive_plan(train_id);
+    train_id += conf.plan_results_count;
+
+    for (k=0; k<conf.plan_results_count; k++)
+    {
+      if ( conf.plan_results[k].state != 0 )
+        continue;
+
+      delta = conf.plan_results[k].delta;
+
+      // the daemon stalled mid train, the dispersion is not the path's
+      if ( delta < 0 )
+      {
+        conf.p2_trains_count_discarded++;
+        continue;
+      }
+
+      bandwidth = (double)((conf.train_packet_length_max << 3) * conf.train_length) / delta;
+
+      if ( (delta > conf.packet_dispersion_delta_min) && (conf.p2_trains_count < 4096) )
+      {
+        conf.p2_trains_delta[conf.p2_trains_count] = delta;
+        conf.p2_trains_bw[conf.p2_trains_count] = bandwidth;
+        conf.p2_trains_count++;
+
+        count_valid++;
+      }
+      else
+        conf.p2_trains_count_discarded++;
+
+      ulog(LOG_DEBUG, "  Detected bandwith: %f Mbps\n", bandwidth);
+    }
+
+    progress_set(60 + (int)(25.0*((double)count_valid / (double)count_required)));
+  }
+
+  return 0;
+}
+
 int session_p2_calculate()
 {
   progress_set(85);
@@ -1250,7 +2112,11 @@ void session_calculate()
   ulog(LOG_INFO, "Final bandwidth measurements:\n"
                  "  Average Dispersion Rate: %.4f Mbps\n"
                  "  Standard Deviation: %.4f Mbps\n"
-                 "  Coefficient of Variance: %.4f\n", adr, adr_std, adr_std/adr);
+                 "  Coefficient of Variance: %.4f\n"
+                 "  Trains disturbed at sender: %d\n"
+                 "  Trains dropped at sender: %d\n"
+                 "  Packets stamped in user space: %lu\n"
+                 "  Packets lost to a full capture ring: %lu\n", adr, adr_std, adr_std/adr, conf.trains_disturbed, conf.trains_dropped, conf.rx_stamps_missing, conf.capture.overruns);
 
   if ( conf.p2_modes_count == 1 &&
        adr_std/adr < BW_COVAR_THRESHOLD &&
@@ -1369,6 +2235,8 @@ void result_format_validate(const char *format)
     else if ( strncmp(fp, "%pm", 3) == 0 ) {}
     else if ( strncmp(fp, "%ps", 3) == 0 ) {}
     else if ( strncmp(fp, "%lt", 3) == 0 ) {}
+    else if ( strncmp(fp, "%hl", 3) == 0 ) {}
+    else if ( strncmp(fp, "%hb", 3) == 0 ) {}
     else
     {
       fprintf(stderr, "FATAL: Undefined format \"%s\" specified!\n", fp);
@@ -1423,6 +2291,10 @@ void result_format_write(FILE *fd, const char *format)
       fprintf(fd, "%.4f", conf.prelim_bw_std);
     else if ( strncmp(fp, "%lt", 3) == 0 )
       fprintf(fd, "%.4f", conf.rtt_tcp_socket_average); 
+    else if ( strncmp(fp, "%hl", 3) == 0 )
+      fprintf(fd, "%d", conf.host_limited);
+    else if ( strncmp(fp, "%hb", 3) == 0 )
+      fprintf(fd, "%.4f", conf.host_bound);
 
     fp+=3;
   }
@@ -1471,18 +2343,316 @@ const char * assessment_mode_literal_get(int mode)
       return "LBOUND";
     case BW_ASSESS_QUICK:
       return "QUICK";
+    case BW_ASSESS_CHIRP:
+      return "CHIRP";
   }
 
   return "UNKNOWN";
 }
 
+//
+// SESSION BENCHMARK
+//
+// opens a growing number of concurrent sessions against the daemon and
+// bounces MSG_RTT_SYNC off each of them in turn. an event driven daemon
+// keeps the per message latency flat as sessions are added, where a
+// single session daemon never answers the second one at all.
+//
+
+int session_bench()
+{
+  struct sockaddr_in addr;
+  double latencies[BENCH_SESSION_SAMPLES + BENCH_SESSION_COUNT_MAX];
+  double latencies_ordered[BENCH_SESSION_SAMPLES + BENCH_SESSION_COUNT_MAX];
+  int fds[BENCH_SESSION_COUNT_MAX];
+  int count = 0;
+  int samples;
+  int level;
+  int opt;
+
+  if ( (conf.server = gethostbyname(conf.hostname)) == NULL )
+  {
+    fprintf(stderr, "ERROR, no such host as %s\n", conf.hostname);
+    return 1;
+  }
+
+  bzero((char *)&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  bcopy((char *)conf.server->h_addr, (char *)&addr.sin_addr.s_addr, conf.server->h_length);
+  addr.sin_port = htons(conf.tcp_port);
+
+  fprintf(stdout, "Benchmarking control latency against %s with up to %d sessions\n", conf.hostname, conf.bench_sessions);
+  fprintf(stdout, "%-10s %10s %12s %12s %12s\n", "sessions", "samples", "median [us]", "p99 [us]", "max [us]");
+
+  // double the session count each level, ending on the requested count
+  for (level=1; count<conf.bench_sessions; level=int_min(level << 1, conf.bench_sessions))
+  {
+    for (; count<level; count++)
+    {
+      if ( (fds[count] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+           connect(fds[count], (struct sockaddr *)&addr, sizeof(addr)) < 0 )
+      {
+        fprintf(stderr, "Unable to connect session %d.\n", count + 1);
+        return 1;
+      }
+
+      opt = 1;
+      setsockopt(fds[count], IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+      send_control_message(fds[count], MSG_SESSION_INIT, 0);
+    }
+
+    for (samples=0; samples<BENCH_SESSION_SAMPLES; samples+=count)
+    {
+      if ( session_bench_round(fds, count, latencies + samples) != 0 )
+      {
+        fprintf(stderr, "Daemon stopped answering with %d sessions.\n", count);
+        return 1;
+      }
+    }
+
+    array_sort(latencies, latencies_ordered, samples);
+
+    fprintf(stdout, "%-10d %10d %12.1f %12.1f %12.1f\n", count, samples,
+            latencies_ordered[samples / 2], latencies_ordered[(samples * 99) / 100], latencies_ordered[samples - 1]);
+  }
+
+  for (level=0; level<count; level++)
+  {
+    send_control_message(fds[level], MSG_SESSION_END, 0);
+    close(fds[level]);
+  }
+
+  return 0;
+}
+
+int session_bench_round(int *fds, int count, double *latencies)
+{
+  struct timespec t_sent;
+  struct timespec t_now;
+  struct timeval t_select;
+  fd_set read_fds;
+  uint32_t ctl_code, ctl_value;
+  int i;
+
+  // each session asks in turn while the others sit connected
+  for (i=0; i<count; i++)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &t_sent);
+    send_control_message(fds[i], MSG_RTT_SYNC, i);
+
+    do
+    {
+      FD_ZERO(&read_fds);
+      FD_SET(fds[i], &read_fds);
+
+      t_select.tv_sec = 2;
+      t_select.tv_usec = 0;
+
+      if ( select(fds[i] + 1, &read_fds, NULL, NULL, &t_select) <= 0 ||
+           receive_control_message(fds[i], &ctl_code, &ctl_value) != 0 )
+        return 1;
+    }
+    while ( ctl_code != MSG_RTT_SYNC );
+
+    clock_gettime(CLOCK_MONOTONIC, &t_now);
+    latencies[i] = time_delta_ts_us(t_sent, t_now);
+  }
+
+  return 0;
+}
+
+//
+// RECEIVE BENCHMARK
+//
+// receives the same maximum length trains through each receive path in
+// turn, the socket paths first as the io_uring receive holds on to the
+// socket once armed. recvmsg reads one datagram per call, recvmmsg as many
+// as have queued up, and busy does the same spinning instead of waiting on
+// epoll. with -C the capture thread is measured as well, reading as
+// recvmmsg does, or as busy does along with -B, and with -X the AF_XDP
+// ring, the program redirecting our port for that row alone and spinning
+// along with -B. the spread of the gaps between a train's timestamps is
+// the jitter the receive path adds, best seen with the daemon pacing
+// packets (-g) so every gap should be the same.
+//
+// the most a socket path sustains is measured apart from the daemon, a
+// train's worth of datagrams queued on loopback at a time and read back as
+// fast as the path allows.
+//
+
+int session_bench_receive()
+{
+  struct timespec timestamps[TRAIN_LENGTH_MAX];
+  double gaps[TRAIN_LENGTH_MAX];
+  double jitter[BENCH_RX_TRAINS];
+  double jitter_ordered[BENCH_RX_TRAINS];
+  char rate[16];
+  unsigned long syscalls;
+  uint32_t train_id = 1;
+  const char *names[] = { "recvmsg", "recvmmsg", "busy", "capture", "xdp", "uring" };
+  int backends[] = { 0, 0, MODE_BUSY_POLL, MODE_CAPTURE, MODE_XDP, MODE_URING };
+  int batches[] = { 1, RECEIVE_BATCH, RECEIVE_BATCH, RECEIVE_BATCH, RECEIVE_BATCH, RECEIVE_BATCH };
+  int capture = conf.mode & (MODE_CAPTURE | MODE_BUSY_POLL | MODE_XDP);
+  int backend;
+  int count;
+  int i, j;
+
+  send_control_message(conf.tcp_socket, MSG_TRAIN_LENGTH_SET, TRAIN_LENGTH_MAX);
+  send_control_message(conf.tcp_socket, MSG_TRAIN_PACKET_LENGTH_SET, conf.train_packet_length_max);
+
+  fprintf(stdout, "Benchmarking %d trains of %d x %d byte packets from %s per receive path\n", BENCH_RX_TRAINS, TRAIN_LENGTH_MAX, conf.train_packet_length_max, conf.hostname);
+  fprintf(stdout, "%-10s %10s %14s %14s %14s %14s\n", "path", "trains", "syscalls/train", "jitter [us]", "p99 [us]", "max [kpps]");
+
+  for (backend=0; backend<sizeof(backends)/sizeof(int); backend++)
+  {
+    if ( (backends[backend] == MODE_URING) && (conf.uring.fd < 0) )
+    {
+      fprintf(stdout, "%-10s %10s\n", names[backend], "unavailable");
+      continue;
+    }
+
+    // only when asked for, it wants a CPU of its own
+    if ( (backends[backend] == MODE_CAPTURE) && ! (capture & MODE_CAPTURE) )
+      continue;
+
+    // only when asked for and set up, it takes over the interface queue
+    if ( (backends[backend] == MODE_XDP) && ! (capture & MODE_XDP) )
+      continue;
+
+    conf.mode = (conf.mode & ~(MODE_URING | MODE_BUSY_POLL | MODE_CAPTURE | MODE_XDP)) | backends[backend];
+    conf.rx_batch.size = batches[backend];
+
+    // the program passes our port up the stack unless the xdp row is on
+    if ( (capture & MODE_XDP) && (xdp_redirect_set(&conf.xdp, backends[backend] == MODE_XDP) != 0) )
+    {
+      fprintf(stdout, "%-10s %10s\n", names[backend], "failed");
+      continue;
+    }
+
+    if ( backends[backend] == MODE_XDP )
+      conf.mode |= (capture & MODE_BUSY_POLL);
+
+    if ( backends[backend] == MODE_CAPTURE )
+    {
+      conf.mode |= (capture & MODE_BUSY_POLL);
+
+      if ( capture_start() != 0 )
+      {
+        fprintf(stdout, "%-10s %10s\n", names[backend], "failed");
+        continue;
+      }
+    }
+
+    syscalls = conf.rx_syscalls;
+    count = 0;
+
+    for (i=0; i<BENCH_RX_TRAINS; i++, train_id++)
+    {
+      send_control_message(conf.tcp_socket, MSG_TRAIN_ID_SET, train_id);
+
+      if ( receive_train(train_id, TRAIN_LENGTH_MAX, conf.train_packet_length_max, timestamps) != 0 )
+        continue;
+
+      for (j=1; j<TRAIN_LENGTH_MAX; j++)
+        gaps[j-1] = time_delta_ts_us(timestamps[j-1], timestamps[j]);
+
+      jitter[count++] = stat_array_std(gaps, TRAIN_LENGTH_MAX - 1);
+    }
+
+    capture_stop();
+
+    // a fallback mid run leaves nothing to compare
+    if ( (backends[backend] == MODE_URING) && ! (conf.mode & MODE_URING) )
+    {
+      fprintf(stdout, "%-10s %10s\n", names[backend], "failed");
+      continue;
+    }
+
+    if ( count == 0 )
+    {
+      fprintf(stdout, "%-10s %10d\n", names[backend], 0);
+      continue;
+    }
+
+    array_sort(jitter, jitter_ordered, count);
+
+    // spinning picks packets up no faster once they are queued
+    if ( backends[backend] != 0 )
+      snprintf(rate, sizeof(rate), "-");
+    else
+      snprintf(rate, sizeof(rate), "%.1f", bench_receive_drain(batches[backend]));
+
+    fprintf(stdout, "%-10s %10d %14.2f %14.2f %14.2f %14s\n", names[backend], count,
+            (double)(conf.rx_syscalls - syscalls) / (double)BENCH_RX_TRAINS,
+            jitter_ordered[count / 2], jitter_ordered[(count * 99) / 100], rate);
+  }
+
+  conf.rx_batch.size = RECEIVE_BATCH;
+
+  return 0;
+}
+
+double bench_receive_drain(int batch_size)
+{
+  struct timespec t_start, t_end, t_mark;
+  char packet_buffer[TRAIN_PACKET_LENGTH_MAX];
+  unsigned long packets = 0;
+  double time_us = 0.0;
+  int source, sink;
+  int received;
+  int i, j, n;
+
+  bzero(packet_buffer, sizeof(packet_buffer));
+
+  if ( loopback_pair_open(&source, &sink) != 0 )
+    return 0.0;
+
+  // nothing is left to hand out from the trains just received
+  conf.rx_batch.count = 0;
+  conf.rx_batch.size = batch_size;
+
+  for (i=0; i<BENCH_RX_DRAIN_ROUNDS; i++)
+  {
+    for (j=0; j<TRAIN_LENGTH_MAX; j++)
+      send(source, packet_buffer, conf.train_packet_length_max, 0);
+
+    received = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    while ( received < TRAIN_LENGTH_MAX )
+    {
+      // read ahead once the last batch has been handed out
+      if ( (conf.rx_batch.next >= conf.rx_batch.count) && (receive_batch_fill(&conf.rx_batch, sink) == 0) )
+        break;
+
+      receive_batch_get(&conf.rx_batch, packet_buffer, sizeof(packet_buffer), &n, &t_mark);
+      received++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+    packets += received;
+    time_us += time_delta_ts_us(t_start, t_end);
+  }
+
+  close(source);
+  close(sink);
+
+  return (time_us > 0) ? (double)packets / time_us * 1000.0 : 0.0;
+}
+
 void session_end(int exit_code)
 {
   progress_set(98);
 
-  // write the result if exit code is normal
-  if ( exit_code == 0 )
+  // write the result if exit code is normal, a benchmark has none
+  if ( (exit_code == 0) && ! (conf.mode & MODE_BENCH_RX) )
+  {
+    host_limit_check();
     result_format_write(stdout, conf.assessment_format);
+  }
 
   if ( (NULL != conf.csv_out_filepath) &&
        (conf.mode & MODE_NET) )
@@ -1576,82 +2746,693 @@ int session_csv_read(const char *filepath)
   return 0;
 }
 
-int receive_train(uint32_t train_id, int length, int packet_length, struct timeval *timestamps)
+void receive_flush()
 {
-  struct timeval t_mark;
-  struct timeval t_select;
-
-  char packet_buffer[packet_length];
-
-  int train_state = 0;
-  int processing = 1;
-  int train_sent = 0;
-  int n = 0;
-
+  struct timespec t_mark;
+  char packet_buffer[TRAIN_PACKET_LENGTH_MAX];
   uint32_t c_code, c_value;
-
-  uint32_t expected_packet_id = 0;
-  uint32_t received_packet_id = 0;
-  uint32_t received_train_id = 0;
-
-  fd_set read_fds;
-  int max_fd;
-
-  FD_ZERO(&read_fds);
-  t_select.tv_sec = 0;
-  t_select.tv_usec = 0;
-
-  socklen_t opt_len = sizeof(conf.udp_addr);
-
-  // grab the largest socket file descriptor for select
-  max_fd = (conf.tcp_socket > conf.udp_socket) ? conf.tcp_socket : conf.udp_socket;
-
-
-  FD_SET(conf.udp_socket, &read_fds);
-  FD_SET(conf.tcp_socket, &read_fds);
+  int events;
+  int n;
 
   // ensure the TCP/UDP buffers are empty
-  while ( select(max_fd + 1, &read_fds, NULL, NULL, &t_select) > 0)
+  while ( (events = receive_wait(packet_buffer, sizeof(packet_buffer), &n, &t_mark, 0)) > 0 )
   {
-    if ( FD_ISSET(conf.udp_socket, &read_fds) )
-      n = recvfrom(conf.udp_socket, packet_buffer, packet_length, 0, (struct sockaddr *)&conf.udp_addr, &opt_len);
-
-    if ( FD_ISSET(conf.tcp_socket, &read_fds) )
+    if ( events & RECEIVE_TCP )
       receive_control_message(conf.tcp_socket, &c_code, &c_value);
+  }
+}
+
+//
+// RECEIVE BACKENDS
+//
+// every train loop waits on the UDP and TCP sockets through receive_wait(),
+// which hands back at most one datagram, stamped, and whether a control
+// message is waiting. by default that is an epoll_wait() on both sockets,
+// registered once per session, and a recvmmsg() that reads whatever has
+// queued up, up to a train's worth, the rest handed out by the calls that
+// follow without another system call. draining stale packets ahead of a
+// train goes the same way. with -B nothing sleeps: the UDP socket is read
+// without waiting, spinning on the device queue for a while where the
+// kernel busy polls (SO_BUSY_POLL), and the TCP socket polled, until one
+// of them has something or the timeout passes. it costs a core, and buys
+// the wakeup the other paths pay on every train. with -u the UDP socket
+// instead has a multishot recvmsg armed on an io_uring, each datagram
+// completing into a buffer from a ring we refill, and the TCP socket a one
+// shot poll re-armed after every read. a single io_uring_enter() then waits
+// for the next event and reaps whatever else has arrived, later calls
+// taking from the completion queue.
+//
+// the stamp is the one the kernel took as the datagram arrived
+// (SO_TIMESTAMPNS), free of however long we took to wake up and read it.
+// the real time clock is read instead with -U, or for any datagram that
+// comes without one, so the two kinds of stamp stay comparable.
+//
+// with -X an XDP program hands train packets to an AF_XDP socket ahead of
+// the stack (see xdp.c). its receive ring is read before anything else and
+// without a system call, its socket sits in the epoll set beside the other
+// two for the waits, and the UDP socket keeps whatever the program passed
+// up. frames come unstamped, the real time clock is read as each is taken
+// off the ring, so -X is best combined with -B. -X implies -U, packets off
+// the socket are stamped the same way and a train never mixes two clocks.
+//
+// a control message is only read after its poll has completed, so a read
+// never blocks, and nothing but these loops reads either socket once the
+// receives are armed.
+//
+
+int receive_stamp_enable(int fd)
+{
+  int opt = 1;
+
+  if ( conf.mode & MODE_USER_STAMP )
+    return 1;
+
+  return ( setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt)) != 0 );
+}
 
-    FD_SET(conf.udp_socket, &read_fds);
-    FD_SET(conf.tcp_socket, &read_fds);
+void receive_stamp_get(struct msghdr *msg, struct timespec *t_mark)
+{
+  struct cmsghdr *cmsg;
+
+  for (cmsg=CMSG_FIRSTHDR(msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(msg, cmsg))
+  {
+    if ( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS) )
+    {
+      memcpy(t_mark, CMSG_DATA(cmsg), sizeof(struct timespec));
+      return;
+    }
   }
 
-  // send the train already
-  send_control_message(conf.tcp_socket, MSG_TRAIN_SEND, train_id);
+  if ( conf.rx_stamp )
+    conf.rx_stamps_missing++;
 
-  int p;
+  clock_gettime(CLOCK_REALTIME, t_mark);
+}
 
-  while ( processing )
+int receive_datagram(int fd, char *buffer, size_t size, struct timespec *t_mark)
+{
+  char control[RECEIVE_CONTROL_SIZE];
+  struct iovec iov;
+  struct msghdr msg;
+  int n;
+
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+
+  bzero(&msg, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  // nothing was received, so there is no control data to read either
+  if ( (n = recvmsg(fd, &msg, 0)) < 0 )
+    msg.msg_controllen = 0;
+
+  receive_stamp_get(&msg, t_mark);
+
+  return n;
+}
+
+void receive_batch_init(struct receive_batch_s *batch, int batch_size)
+{
+  int i;
+
+  for (i=0; i<RECEIVE_BATCH; i++)
+  {
+    batch->iov[i].iov_base = batch->buffers[i];
+    batch->iov[i].iov_len = TRAIN_PACKET_LENGTH_MAX;
+
+    bzero(&batch->msgs[i], sizeof(struct mmsghdr));
+    batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  batch->size = batch_size;
+  batch->count = 0;
+  batch->next = 0;
+}
+
+int receive_batch_fill(struct receive_batch_s *batch, int fd)
+{
+  int i;
+
+  // the kernel shrinks these to what it wrote
+  for (i=0; i<batch->size; i++)
+  {
+    batch->msgs[i].msg_hdr.msg_control = batch->control[i];
+    batch->msgs[i].msg_hdr.msg_controllen = RECEIVE_CONTROL_SIZE;
+  }
+
+  batch->next = 0;
+  batch->count = recvmmsg(fd, batch->msgs, batch->size, MSG_DONTWAIT, NULL);
+
+  if ( batch->count < 0 )
+    batch->count = 0;
+
+  return batch->count;
+}
+
+int receive_batch_get(struct receive_batch_s *batch, char *buffer, size_t size, int *n, struct timespec *t_mark)
+{
+  struct mmsghdr *entry;
+
+  if ( batch->next >= batch->count )
+    return 0;
+
+  entry = &batch->msgs[batch->next];
+
+  receive_stamp_get(&entry->msg_hdr, t_mark);
+
+  *n = (entry->msg_len > size) ? (int)size : (int)entry->msg_len;
+  memcpy(buffer, batch->buffers[batch->next++], *n);
+
+  return 1;
+}
+
+int receive_epoll_init()
+{
+  struct epoll_event event;
+  int busy_poll = RECEIVE_BUSY_POLL_US;
+
+  if ( (conf.rx_epoll = epoll_create1(0)) < 0 )
+    return 1;
+
+  bzero(&event, sizeof(event));
+  event.events = EPOLLIN;
+
+  event.data.u32 = RECEIVE_UDP;
+  if ( epoll_ctl(conf.rx_epoll, EPOLL_CTL_ADD, conf.udp_socket, &event) != 0 )
+    return 1;
+
+  event.data.u32 = RECEIVE_TCP;
+  if ( epoll_ctl(conf.rx_epoll, EPOLL_CTL_ADD, conf.tcp_socket, &event) != 0 )
+    return 1;
+
+  // spinning works without it, only less closely
+  if ( (conf.mode & (MODE_BUSY_POLL | MODE_BENCH_RX)) &&
+       setsockopt(conf.udp_socket, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) != 0 )
+  {
+    ulog(LOG_INFO, "Unable to busy poll the UDP socket (%s), spinning on reads alone.\n", strerror(errno));
+  }
+
+  return 0;
+}
+
+int receive_xdp_init()
+{
+  struct epoll_event event;
+
+  if ( xdp_open(&conf.xdp, conf.xdp_interface, conf.xdp_queue, (uint16_t)conf.udp_port, conf.xdp_generic) != 0 )
+    return 1;
+
+  bzero(&event, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = RECEIVE_XDP;
+
+  if ( epoll_ctl(conf.rx_epoll, EPOLL_CTL_ADD, conf.xdp.fd, &event) != 0 )
+  {
+    xdp_close(&conf.xdp);
+    return 1;
+  }
+
+  ulog(LOG_INFO, "AF_XDP receive on %s queue %d, %s mode\n", conf.xdp_interface, conf.xdp_queue, xdp_attach_literal_get(conf.xdp.attach));
+
+  return 0;
+}
+
+int receive_uring_init()
+{
+  if ( uring_init(&conf.uring, URING_ENTRIES) != 0 )
+    return 1;
+
+  // no source address, just room for the timestamp
+  bzero(&conf.uring_msg, sizeof(conf.uring_msg));
+  conf.uring_msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+
+  if ( uring_recv_buffers_init(&conf.uring) != 0 )
+  {
+    uring_free(&conf.uring);
+    return 1;
+  }
+
+  return 0;
+}
+
+int receive_wait_uring(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us)
+{
+  struct uring_cqe_s cqe;
+  struct msghdr msg;
+  const char *data, *payload;
+  int events = 0;
+  int length;
+
+  if ( ! conf.uring_recv_armed &&
+       uring_prep_recvmsg_multishot(&conf.uring, conf.udp_socket, &conf.uring_msg, RECEIVE_UDP) == 0 )
+    conf.uring_recv_armed = 1;
+
+  if ( ! conf.uring_poll_armed &&
+       uring_prep_poll(&conf.uring, conf.tcp_socket, POLLIN, RECEIVE_TCP) == 0 )
+    conf.uring_poll_armed = 1;
+
+  // completions reaped by an earlier wait are handed out first
+  if ( ! uring_cqe_get(&conf.uring, &cqe) )
+  {
+    conf.rx_syscalls++;
+
+    if ( uring_submit(&conf.uring, (timeout_us > 0) ? 1 : 0, timeout_us) != 0 )
+      return -1;
+
+    if ( ! uring_cqe_get(&conf.uring, &cqe) )
+      return 0;
+  }
+
+  if ( cqe.user_data == RECEIVE_TCP )
+  {
+    conf.uring_poll_armed = 0;
+    return RECEIVE_TCP;
+  }
+
+  if ( ! uring_cqe_more(&cqe) )
+    conf.uring_recv_armed = 0;
+
+  if ( (cqe.res >= 0) && ((data = uring_recv_buffer_get(&conf.uring, cqe.flags)) != NULL) &&
+       ((payload = uring_recvmsg_payload(&conf.uring_msg, data, cqe.res, &msg, &length)) != NULL) )
+  {
+    receive_stamp_get(&msg, t_mark);
+
+    *n = ((size_t)length > size) ? (int)size : length;
+    memcpy(buffer, payload, *n);
+    events = RECEIVE_UDP;
+  }
+  else if ( (cqe.res < 0) && (cqe.res != -ENOBUFS) )
+  {
+    // a kernel without multishot receives, carry on as we would without -u
+    fprintf(stderr, "io_uring receive failed (%s), falling back to epoll.\n", strerror(-cqe.res));
+    conf.mode &= ~MODE_URING;
+  }
+
+  uring_recv_buffer_release(&conf.uring, cqe.flags);
+
+  return events;
+}
+
+//
+// CAPTURE THREAD
+//
+// with -C a thread pinned to the given CPU does nothing but read and stamp
+// train packets, so neither control messages, logging nor the statistics
+// of the session ever hold up a timestamp. it reads as the socket path
+// does, spinning instead of sleeping with -B, and pushes the stamp and the
+// head of every packet onto a single producer single consumer ring. an
+// eventfd, written once per read, stands in for the UDP socket in the
+// session's epoll set and receive_wait() hands the records out in order.
+//
+// the thread owns the UDP socket while it runs, and with -X the AF_XDP
+// ring too, as packets arriving on another queue of the NIC still come up
+// the stack. the calibration ahead of it reads the socket itself.
+//
+
+int capture_start()
+{
+  struct capture_s *capture = &conf.capture;
+  struct epoll_event event;
+  sigset_t signals, previous;
+  int ret;
+
+  capture->notify_fd = -1;
+  capture->stop_fd = -1;
+  capture->overruns = 0;
+
+  if ( spsc_init(&capture->records, CAPTURE_RING_SIZE, sizeof(struct capture_record_s)) != 0 )
+    return 1;
+
+  receive_batch_init(&capture->batch, RECEIVE_BATCH);
+
+  if ( ((capture->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) ||
+       ((capture->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) )
+    return 1;
+
+  // signals are for the session, a read is never interrupted by one
+  capture->running = 1;
+
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  ret = pthread_create(&capture->thread, NULL, capture_run, capture);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if ( ret != 0 )
   {
-    t_select.tv_sec = 2;
+    capture->running = 0;
+    errno = ret;
+    return 1;
+  }
+
+  // the session now waits on the ring where it waited on the socket
+  bzero(&event, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = RECEIVE_UDP;
 
-    FD_SET(conf.udp_socket, &read_fds);
-    FD_SET(conf.tcp_socket, &read_fds);
+  epoll_ctl(conf.rx_epoll, EPOLL_CTL_DEL, conf.udp_socket, NULL);
+  epoll_ctl(conf.rx_epoll, EPOLL_CTL_ADD, capture->notify_fd, &event);
+
+  // and with -X the thread reads the AF_XDP ring in place of the socket
+  if ( conf.mode & MODE_XDP )
+    epoll_ctl(conf.rx_epoll, EPOLL_CTL_DEL, conf.xdp.fd, NULL);
+
+  return 0;
+}
 
-    if ( (p=select(max_fd + 1, &read_fds, NULL, NULL, &t_select)) == -1 )
+void capture_stop()
+{
+  struct capture_s *capture = &conf.capture;
+  struct epoll_event event;
+  uint64_t wake = 1;
+
+  if ( ! capture->running )
+    return;
+
+  __atomic_store_n(&capture->running, 0, __ATOMIC_RELEASE);
+
+  if ( write(capture->stop_fd, &wake, sizeof(wake)) != sizeof(wake) )
+  {
+    ulog(LOG_DEBUG, "Unable to wake capture thread (%s)\n", strerror(errno));
+  }
+
+  pthread_join(capture->thread, NULL);
+
+  bzero(&event, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = RECEIVE_UDP;
+
+  epoll_ctl(conf.rx_epoll, EPOLL_CTL_DEL, capture->notify_fd, NULL);
+  epoll_ctl(conf.rx_epoll, EPOLL_CTL_ADD, conf.udp_socket, &event);
+
+  if ( conf.mode & MODE_XDP )
+  {
+    event.data.u32 = RECEIVE_XDP;
+    epoll_ctl(conf.rx_epoll, EPOLL_CTL_ADD, conf.xdp.fd, &event);
+  }
+
+  // whatever is still on the ring is stale by now
+  close(capture->notify_fd);
+  close(capture->stop_fd);
+  spsc_free(&capture->records);
+}
+
+void * capture_run(void *arg)
+{
+  struct capture_s *capture = (struct capture_s *)arg;
+  struct capture_record_s record;
+  struct pollfd fds[3];
+  int fds_count = 2;
+  cpu_set_t cpus;
+  uint64_t wake = 1;
+  int pushed;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(capture->cpu, &cpus);
+
+  if ( sched_setaffinity(0, sizeof(cpus), &cpus) != 0 )
+  {
+    ulog(LOG_WARN, "Unable to pin capture thread to CPU %d (%s)\n", capture->cpu, strerror(errno));
+  }
+  else
+  {
+    ulog(LOG_INFO, "Capture thread pinned to CPU %d\n", capture->cpu);
+  }
+
+  fds[0].fd = capture->stop_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = conf.udp_socket;
+  fds[1].events = POLLIN;
+
+  if ( conf.mode & MODE_XDP )
+  {
+    fds[2].fd = conf.xdp.fd;
+    fds[2].events = POLLIN;
+    fds_count = 3;
+  }
+
+  while ( __atomic_load_n(&capture->running, __ATOMIC_ACQUIRE) )
+  {
+    if ( ! (conf.mode & MODE_BUSY_POLL) )
     {
-      if ( errno != EINTR )
+      if ( poll(fds, fds_count, -1) <= 0 )
+        continue;
+
+      if ( fds[0].revents & POLLIN )
+        break;
+    }
+
+    pushed = 0;
+
+    // the ring needs no system call to read, the socket one per batch
+    if ( conf.mode & MODE_XDP )
+    {
+      while ( xdp_receive(&conf.xdp, record.header, sizeof(record.header), &record.length, &record.t_mark) )
       {
-        perror("Select error: ");
-        session_end(1);
+        if ( spsc_push(&capture->records, &record) != 0 )
+          capture->overruns++;
+        else
+          pushed++;
+      }
+    }
+
+    // whatever the program passed up, or every packet without -X
+    if ( receive_batch_fill(&capture->batch, conf.udp_socket) > 0 )
+    {
+      while ( receive_batch_get(&capture->batch, record.header, sizeof(record.header), &record.length, &record.t_mark) )
+      {
+        if ( spsc_push(&capture->records, &record) != 0 )
+          capture->overruns++;
+        else
+          pushed++;
       }
     }
 
-//    ulog(LOG_DEBUG, "select: %d\n", p);
+    if ( (pushed > 0) && (write(capture->notify_fd, &wake, sizeof(wake)) != sizeof(wake)) )
+    {
+      ulog(LOG_DEBUG, "Unable to wake session (%s)\n", strerror(errno));
+    }
+  }
+
+  return NULL;
+}
+
+int receive_wait_capture(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us)
+{
+  struct capture_record_s record;
+  struct epoll_event ready[2];
+  uint64_t wake;
+  int events = 0;
+  int p, i;
+
+  while ( 1 )
+  {
+    // records first, the eventfd only says some may have arrived
+    if ( spsc_pop(&conf.capture.records, &record) == 0 )
+    {
+      *n = ((size_t)record.length > size) ? (int)size : record.length;
+      memcpy(buffer, record.header, *n);
+      *t_mark = record.t_mark;
+
+      return events | RECEIVE_UDP;
+    }
+
+    if ( events )
+      return events;
+
+    conf.rx_syscalls++;
+
+    if ( (p=epoll_wait(conf.rx_epoll, ready, 2, (int)((timeout_us + 999) / 1000))) <= 0 )
+      return p;
+
+    for (i=0; i<p; i++)
+      events |= ready[i].data.u32;
 
-    if ( FD_ISSET(conf.udp_socket, &read_fds) )
+    // cleared ahead of the pop, so a record pushed after it wakes us again
+    if ( events & RECEIVE_UDP )
     {
-      n=recvfrom(conf.udp_socket, packet_buffer, packet_length, 0, (struct sockaddr *)&conf.udp_addr, &opt_len);
+      conf.rx_syscalls++;
+
+      if ( read(conf.capture.notify_fd, &wake, sizeof(wake)) != sizeof(wake) )
+      {
+        ulog(LOG_DEBUG, "Unable to clear capture wake up (%s)\n", strerror(errno));
+      }
+    }
+
+    events &= ~RECEIVE_UDP;
+  }
+}
+
+int receive_wait_busy(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us)
+{
+  struct pollfd tcp_poll;
+  struct timespec t_start, t_now;
+  int events = 0;
+
+  tcp_poll.fd = conf.tcp_socket;
+  tcp_poll.events = POLLIN;
+
+  clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+  do
+  {
+    conf.rx_syscalls += 2;
+
+    if ( (receive_batch_fill(&conf.rx_batch, conf.udp_socket) > 0) &&
+         receive_batch_get(&conf.rx_batch, buffer, size, n, t_mark) )
+      events |= RECEIVE_UDP;
+
+    if ( (poll(&tcp_poll, 1, 0) > 0) && (tcp_poll.revents & POLLIN) )
+      events |= RECEIVE_TCP;
+
+    if ( events )
+      return events;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_now);
+  }
+  while ( time_delta_ts_us(t_start, t_now) < timeout_us );
+
+  return 0;
+}
+
+int receive_wait_xdp(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us)
+{
+  struct timespec t_start, t_now;
+  long left = timeout_us;
+  int events;
+
+  clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+  while ( 1 )
+  {
+    // the ring is read without a system call, so it goes first every time
+    if ( xdp_receive(&conf.xdp, buffer, size, n, t_mark) )
+      return RECEIVE_UDP;
+
+    // a single pass over the sockets when spinning, for what the program
+    // passed up and for the control connection
+    if ( conf.mode & MODE_BUSY_POLL )
+      events = receive_wait_busy(buffer, size, n, t_mark, 0);
+    else
+      events = receive_wait_epoll(buffer, size, n, t_mark, left);
+
+    if ( events < 0 )
+      return events;
+
+    // readiness of the ring alone sends us round again
+    if ( events & ~RECEIVE_XDP )
+      return events & ~RECEIVE_XDP;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_now);
+
+    if ( (left = timeout_us - (long)time_delta_ts_us(t_start, t_now)) <= 0 )
+      return xdp_receive(&conf.xdp, buffer, size, n, t_mark) ? RECEIVE_UDP : 0;
+  }
+}
+
+int receive_wait(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us)
+{
+  // whatever an earlier wait read ahead goes first, whichever the backend
+  if ( receive_batch_get(&conf.rx_batch, buffer, size, n, t_mark) )
+    return RECEIVE_UDP;
+
+  if ( conf.capture.running )
+    return receive_wait_capture(buffer, size, n, t_mark, timeout_us);
 
-      gettimeofday(&t_mark, (struct timezone *)0);
+  if ( conf.mode & MODE_XDP )
+    return receive_wait_xdp(buffer, size, n, t_mark, timeout_us);
 
+  if ( conf.mode & MODE_URING )
+    return receive_wait_uring(buffer, size, n, t_mark, timeout_us);
+
+  if ( conf.mode & MODE_BUSY_POLL )
+    return receive_wait_busy(buffer, size, n, t_mark, timeout_us);
+
+  return receive_wait_epoll(buffer, size, n, t_mark, timeout_us);
+}
+
+int receive_wait_epoll(char *buffer, size_t size, int *n, struct timespec *t_mark, long timeout_us)
+{
+  struct epoll_event ready[3];
+  int events = 0;
+  int p, i;
+
+  conf.rx_syscalls++;
+
+  // rounded up, a wait must never return before its time
+  if ( (p=epoll_wait(conf.rx_epoll, ready, 3, (int)((timeout_us + 999) / 1000))) <= 0 )
+    return p;
+
+  for (i=0; i<p; i++)
+    events |= ready[i].data.u32;
+
+  if ( events & RECEIVE_UDP )
+  {
+    conf.rx_syscalls++;
+
+    if ( (receive_batch_fill(&conf.rx_batch, conf.udp_socket) == 0) ||
+         ! receive_batch_get(&conf.rx_batch, buffer, size, n, t_mark) )
+      *n = -1;
+  }
+
+  return events;
+}
+
+int receive_train(uint32_t train_id, int length, int packet_length, struct timespec *timestamps)
+{
+  return receive_train_as(MSG_TRAIN_SEND, train_id, length, packet_length, timestamps);
+}
+
+int receive_chirp(uint32_t train_id, int length, int packet_length, struct timespec *timestamps)
+{
+  return receive_train_as(MSG_CHIRP_SEND, train_id, length, packet_length, timestamps);
+}
+
+int receive_train_as(uint32_t send_code, uint32_t train_id, int length, int packet_length, struct timespec *timestamps)
+{
+  struct timespec t_mark;
+
+  char packet_buffer[int_max(packet_length, TRAIN_MARKER_LENGTH)];
+
+  int train_state = 0;
+  int processing = 1;
+  int train_sent = 0;
+  int events;
+  int n = 0;
+
+  uint32_t marker_length;
+
+  uint32_t c_code, c_value;
+
+  uint32_t expected_packet_id = 0;
+  uint32_t received_packet_id = 0;
+  uint32_t received_train_id = 0;
+
+  receive_flush();
+
+  // send the train already
+  conf.train_tx_gaps_count = 0;
+  conf.train_dropped = 0;
+  send_control_message(conf.tcp_socket, send_code, train_id);
+
+  while ( processing )
+  {
+    if ( (events = receive_wait(packet_buffer, sizeof(packet_buffer), &n, &t_mark, RECEIVE_TIMEOUT_US)) < 0 )
+    {
+      if ( errno != EINTR )
+      {
+        perror("Select error: ");
+        session_end(1);
+      }
+
+      continue;
+    }
+
+    if ( events & RECEIVE_UDP )
+    {
       memcpy(&received_train_id, packet_buffer, sizeof(uint32_t));
       memcpy(&received_packet_id, packet_buffer+sizeof(uint32_t), sizeof(uint32_t));
       received_train_id=ntohl(received_train_id);
@@ -1659,7 +3440,27 @@ int receive_train(uint32_t train_id, int length, int packet_length, struct timev
 
 //      ulog(LOG_DEBUG, "Got train packet: %u (%u) %u (%u) %u\n", received_train_id, train_id, received_packet_id, expected_packet_id, length);
 
-      if ( train_id != received_train_id )
+      if ( received_packet_id == TRAIN_MARKER_ID )
+      {
+        // markers resent for an earlier train are simply late
+        if ( (received_train_id == train_id) && (n >= TRAIN_MARKER_LENGTH) )
+        {
+          memcpy(&marker_length, packet_buffer+2*sizeof(uint32_t), sizeof(uint32_t));
+
+          if ( ntohl(marker_length) != length )
+          {
+            ulog(LOG_DEBUG, "Marker reports %u packets, expected %d\n", ntohl(marker_length), length);
+          }
+
+          // nothing of the train follows its marker, the gaps went ahead of it
+          receive_train_control_drain(&train_sent);
+
+          // a written off train still owes us the MSG_TRAIN_SENT behind the drop
+          if ( train_sent || ! conf.train_dropped )
+            processing = 0;
+        }
+      }
+      else if ( train_id != received_train_id )
       {
         train_state = 2;
       }
@@ -1671,33 +3472,30 @@ int receive_train(uint32_t train_id, int length, int packet_length, struct timev
         timestamps[received_packet_id] = t_mark;
       }
 
-      if ( train_sent )
-        if ( expected_packet_id == length )
-          processing = 0;
+      // without stamps to wait for the last packet ends the train
+      if ( (train_sent || ! conf.train_tx_stamped) && (expected_packet_id == length) )
+        processing = 0;
     }
 
     // we've timed out or we have TCP data waiting
     // either are valid states to stop processing the train
-    if ( FD_ISSET(conf.tcp_socket, &read_fds) )
+    if ( events & RECEIVE_TCP )
     {
 //      ulog(LOG_DEBUG, "Got end signal\n");
       receive_control_message(conf.tcp_socket, &c_code, &c_value);
+      receive_train_control(c_code, c_value, &train_sent);
 
-      if ( c_code == MSG_TRAIN_SENT )
-      {
-        train_sent = 1;
-
-        if ( expected_packet_id == length )
-          processing = 0;
-      }
+      // what the daemon wrote off is not worth waiting for
+      if ( train_sent && ((expected_packet_id == length) || conf.train_dropped) )
+        processing = 0;
     }
 
     // timeout
-    if ( p == 0 )
+    if ( events == 0 )
       processing = 0;
   }
 
-  if (expected_packet_id == length)
+  if ( (expected_packet_id == length) && ! conf.train_dropped )
   {
     /* send control message to ACK burst */
     send_control_message(conf.tcp_socket, MSG_TRAIN_RECEIVE_ACK, 0);
@@ -1713,6 +3511,369 @@ int receive_train(uint32_t train_id, int length, int packet_length, struct timev
   return train_state;
 }
 
+void receive_train_control(uint32_t c_code, uint32_t c_value, int *train_sent)
+{
+  if ( c_code == MSG_TRAIN_TX_GAP )
+  {
+    conf.train_tx_stamped = 1;
+
+    if ( conf.train_tx_gaps_count < TRAIN_LENGTH_MAX )
+      conf.train_tx_gaps[conf.train_tx_gaps_count++] = (double)c_value / 1000.0;
+  }
+  else if ( c_code == MSG_TRAIN_SENT )
+  {
+    *train_sent = 1;
+  }
+  else if ( c_code == MSG_TRAIN_DROPPED )
+  {
+    // always ahead of MSG_TRAIN_SENT, which then ends the train
+    ulog(LOG_DEBUG, "Daemon dropped part of train %u\n", c_value);
+
+    conf.train_dropped = 1;
+    conf.trains_dropped++;
+  }
+  else if ( c_code == MSG_TRAIN_REFUSED )
+  {
+    // no point carrying on once the daemon's budget for us is spent
+    fprintf(stderr, "Daemon refused train %u, session budget exhausted.\n", c_value);
+    session_end(1);
+  }
+}
+
+void receive_train_control_drain(int *train_sent)
+{
+  struct timespec t_mark;
+  char packet_buffer[TRAIN_PACKET_LENGTH_MAX];
+  uint32_t c_code, c_value;
+  int events;
+  int n;
+
+  // take whatever control messages have already arrived, without waiting,
+  // anything trailing the marker belongs to no train and is let go
+  while ( (*train_sent == 0) && ((events = receive_wait(packet_buffer, sizeof(packet_buffer), &n, &t_mark, 0)) > 0) )
+  {
+    if ( events & RECEIVE_TCP )
+    {
+      receive_control_message(conf.tcp_socket, &c_code, &c_value);
+      receive_train_control(c_code, c_value, train_sent);
+    }
+  }
+}
+
+//
+// MEASUREMENT PLANS
+//
+// a whole phase is uploaded up front and the daemon streams it without
+// waiting on us, so nothing is acknowledged. trains overlap in flight, the
+// next one's packets may beat the previous one's MSG_TRAIN_SENT over TCP,
+// so each is held in a small window until its MSG_TRAIN_SENT and either its
+// last packet or any sign of a later train arrive.
+//
+
+void plan_reset()
+{
+  conf.plan_count = 0;
+  conf.plan_results_count = 0;
+}
+
+int plan_entry_add(int length, int packet_length, double spacing, int count)
+{
+  struct plan_entry_s *entry;
+
+  if ( conf.plan_count >= PLAN_ENTRIES_MAX )
+    return 1;
+
+  entry = &conf.plan[conf.plan_count++];
+  entry->length = length;
+  entry->packet_length = packet_length;
+  entry->spacing = spacing;
+  entry->count = count;
+
+  return 0;
+}
+
+double plan_spacing_get(int length, int packet_length)
+{
+  double spacing;
+
+  // nothing measured yet to size it by
+  if ( conf.prelim_bw_mean <= 0 )
+    return conf.train_spacing_min;
+
+  // Mbps is bits per microsecond
+  spacing = PLAN_SPACING_FACTOR * (double)((length * packet_length) << 3) / conf.prelim_bw_mean;
+
+  // the daemon takes whole microseconds, and a plan that is slower than
+  // trains asked for one at a time would defeat its purpose
+  spacing = ceil(spacing);
+
+  if ( (conf.train_spacing_min > 0) && (spacing > conf.train_spacing_min) )
+    spacing = conf.train_spacing_min;
+
+  return spacing;
+}
+
+struct plan_train_s * plan_train_get(int index, int *done)
+{
+  struct plan_train_s *train = &conf.plan_window[index % PLAN_WINDOW];
+
+  if ( train->index == index )
+    return train;
+
+  // a late packet for a train already pushed out of the window
+  if ( train->index > index )
+    return NULL;
+
+  // the window is full, whatever the oldest trains have is all they get
+  while ( (train->index >= 0) && (*done <= train->index) )
+    plan_train_finish((*done)++);
+
+  bzero(train, sizeof(struct plan_train_s));
+  train->index = index;
+  train->length = conf.plan[conf.plan_results[index].entry].length;
+
+  return train;
+}
+
+void plan_train_finish(int index)
+{
+  struct plan_train_s *train = &conf.plan_window[index % PLAN_WINDOW];
+  struct plan_result_s *result = &conf.plan_results[index];
+
+  result->state = 1;
+  result->delta = 0.0;
+
+  if ( train->index != index )
+    return;
+
+  if ( (train->expected_packet_id == train->length) && ! train->dropped )
+  {
+    memcpy(conf.train_tx_gaps, train->tx_gaps, sizeof(double) * train->tx_gaps_count);
+    conf.train_tx_gaps_count = train->tx_gaps_count;
+
+    result->state = 0;
+    result->delta = train_dispersion_get(train->timestamps, train->length);
+  }
+
+  train->index = -1;
+}
+
+int receive_plan(uint32_t train_id)
+{
+  struct plan_train_s *train;
+  struct timespec t_mark;
+
+  char packet_buffer[TRAIN_PACKET_LENGTH_MAX];
+  double tx_gaps[TRAIN_LENGTH_MAX];
+  int tx_gaps_count = 0;
+
+  int total = 0;
+  int done = 0;
+  int seen = -1;
+  int index;
+  int events;
+  int e, i, n;
+  long timeout_us = RECEIVE_TIMEOUT_US;
+
+  uint32_t c_code, c_value;
+  uint32_t received_packet_id = 0;
+  uint32_t received_train_id = 0;
+
+  // lay out every train the plan will produce
+  for (e=0; e<conf.plan_count; e++)
+  {
+    for (i=0; (i<conf.plan[e].count) && (total < PLAN_TRAINS_MAX); i++, total++)
+    {
+      conf.plan_results[total].entry = e;
+      conf.plan_results[total].state = 1;
+      conf.plan_results[total].delta = 0.0;
+    }
+  }
+
+  conf.plan_results_count = total;
+
+  for (i=0; i<PLAN_WINDOW; i++)
+    conf.plan_window[i].index = -1;
+
+  receive_flush();
+
+  send_control_message(conf.tcp_socket, MSG_PLAN_RESET, 0);
+
+  for (e=0; e<conf.plan_count; e++)
+  {
+    send_control_message(conf.tcp_socket, MSG_TRAIN_LENGTH_SET, conf.plan[e].length);
+    send_control_message(conf.tcp_socket, MSG_TRAIN_PACKET_LENGTH_SET, conf.plan[e].packet_length);
+    send_control_message(conf.tcp_socket, MSG_TRAIN_SPACING_SET, (uint32_t)conf.plan[e].spacing);
+    send_control_message(conf.tcp_socket, MSG_PLAN_ENTRY_ADD, conf.plan[e].count);
+  }
+
+  send_control_message(conf.tcp_socket, MSG_PLAN_START, train_id);
+
+  while ( done < total )
+  {
+    if ( (events = receive_wait(packet_buffer, sizeof(packet_buffer), &n, &t_mark, timeout_us)) < 0 )
+    {
+      if ( errno != EINTR )
+      {
+        perror("Select error: ");
+        session_end(1);
+      }
+
+      continue;
+    }
+
+    // timeout, the daemon has stopped streaming or what is left was lost
+    if ( events == 0 )
+      break;
+
+    if ( (events & RECEIVE_UDP) && (n >= (int)(2 * sizeof(uint32_t))) )
+    {
+      memcpy(&received_train_id, packet_buffer, sizeof(uint32_t));
+      memcpy(&received_packet_id, packet_buffer+sizeof(uint32_t), sizeof(uint32_t));
+      received_train_id=ntohl(received_train_id);
+      received_packet_id=ntohl(received_packet_id);
+
+      index = (int)(received_train_id - train_id);
+
+      // a marker only tells us its train is over, the gaps still come with MSG_TRAIN_SENT
+      if ( received_packet_id == TRAIN_MARKER_ID )
+      {
+        if ( (received_train_id >= train_id) && (index < total) )
+          seen = int_max(seen, index + 1);
+      }
+      else if ( (received_train_id >= train_id) && (index >= done) && (index < total) &&
+                ((train = plan_train_get(index, &done)) != NULL) )
+      {
+        if ( received_packet_id == train->expected_packet_id && received_packet_id < train->length )
+        {
+          train->timestamps[received_packet_id] = t_mark;
+          train->expected_packet_id++;
+        }
+
+        seen = int_max(seen, index);
+      }
+    }
+
+    if ( events & RECEIVE_TCP )
+    {
+      receive_control_message(conf.tcp_socket, &c_code, &c_value);
+
+      if ( c_code == MSG_TRAIN_TX_GAP )
+      {
+        if ( tx_gaps_count < TRAIN_LENGTH_MAX )
+          tx_gaps[tx_gaps_count++] = (double)c_value / 1000.0;
+      }
+      else if ( c_code == MSG_TRAIN_SENT )
+      {
+        // the gaps before it belong to this train
+        index = (int)(c_value - train_id);
+
+        if ( (c_value >= train_id) && (index >= done) && (index < total) &&
+             ((train = plan_train_get(index, &done)) != NULL) )
+        {
+          memcpy(train->tx_gaps, tx_gaps, sizeof(double) * tx_gaps_count);
+          train->tx_gaps_count = tx_gaps_count;
+          train->sent = 1;
+
+          seen = int_max(seen, index);
+        }
+
+        tx_gaps_count = 0;
+      }
+      else if ( c_code == MSG_TRAIN_DROPPED )
+      {
+        index = (int)(c_value - train_id);
+
+        if ( (c_value >= train_id) && (index >= done) && (index < total) &&
+             ((train = plan_train_get(index, &done)) != NULL) )
+          train->dropped = 1;
+
+        conf.trains_dropped++;
+      }
+      else if ( c_code == MSG_TRAIN_REFUSED )
+      {
+        // no point carrying on once the daemon's budget for us is spent
+        fprintf(stderr, "Daemon refused train %u, session budget exhausted.\n", c_value);
+        session_end(1);
+      }
+      else if ( c_code == MSG_PLAN_DONE )
+      {
+        // every MSG_TRAIN_SENT is in, only packets still on the path are worth a wait
+        ulog(LOG_DEBUG, "Plan done at train %u\n", c_value);
+        timeout_us = PLAN_DONE_WAIT_US;
+      }
+    }
+
+    // finish trains in order as soon as nothing more can arrive for them
+    while ( done < total )
+    {
+      train = &conf.plan_window[done % PLAN_WINDOW];
+
+      if ( (train->index != done) || ! train->sent ||
+           ((train->expected_packet_id < train->length) && ! train->dropped && (seen <= done)) )
+        break;
+
+      plan_train_finish(done++);
+    }
+  }
+
+  // anything left never completed
+  while ( done < total )
+    plan_train_finish(done++);
+
+  return 0;
+}
+
+//
+// INPUT DISPERSION
+//
+// the daemon returns the gaps between its transmit timestamps. gaps above
+// the train's median are the sender's own stalls rather than the path, so
+// their excess is taken off the measured dispersion. a train with too much
+// of it no longer probes the path and is dropped, unless the last few were
+// all dropped too and the sender is simply that noisy.
+//
+
+double train_dispersion_get(struct timespec *timestamps, int length)
+{
+  double delta = time_delta_ts_us(timestamps[0], timestamps[length-1]);
+  double gaps_ordered[TRAIN_LENGTH_MAX];
+  double median;
+  double excess = 0.0;
+  int count = conf.train_tx_gaps_count;
+  int i;
+
+  // without every gap assume the train left back to back
+  if ( count != length - 1 )
+    return delta;
+
+  array_sort(conf.train_tx_gaps, gaps_ordered, count);
+  median = gaps_ordered[count / 2];
+
+  for (i=0; i<count; i++)
+    if ( conf.train_tx_gaps[i] > median )
+      excess += conf.train_tx_gaps[i] - median;
+
+  if ( excess > delta * TX_DISPERSION_DISTURBED_RATIO )
+  {
+    // a sender that never settles would starve the assessment, take it as is
+    if ( conf.trains_disturbed_run >= TX_DISTURBED_RUN_MAX )
+    {
+      conf.trains_disturbed_run = 0;
+      return delta;
+    }
+
+    ulog(LOG_DEBUG, "Dropping train disturbed at sender (%.2fus of %.2fus)\n", excess, delta);
+    conf.trains_disturbed++;
+    conf.trains_disturbed_run++;
+    return -1.0;
+  }
+
+  conf.trains_disturbed_run = 0;
+
+  return delta - excess;
+}
+
 void progress_set(int progress)
 {
   conf.progress = progress;
@@ -1,5 +1,67 @@
 #ifndef LOCO_H
 #define LOCO_H
 
+// control message round trips measured per session count when benchmarking
+#define BENCH_SESSION_SAMPLES 2000
+
+// most sessions opened against one daemon when benchmarking
+#define BENCH_SESSION_COUNT_MAX 64
+
+// trains received per backend when benchmarking the receive paths
+#define BENCH_RX_TRAINS 500
+
+// trains streamed from one uploaded plan
+#define PLAN_TRAINS_MAX 4096
+
+// trains of a plan being received at once, later ones finish the oldest
+#define PLAN_WINDOW 16
+
+// a planned train is spaced to cross the path this many times over at the
+// preliminary estimate, though never further apart than serial trains
+#define PLAN_SPACING_FACTOR 2.0
+
+// once the daemon reports a plan done, how long packets and markers still
+// on the path are waited for [us]
+#define PLAN_DONE_WAIT_US 100000
+
+// chirps averaged in chirp mode, and how many may be sent to get them
+#define CHIRP_COUNT     16
+#define CHIRP_COUNT_MAX 32
+
+// a chirp's last gap runs at this multiple of the estimate from the train
+// length discovery, its first gap this many times slower again
+#define CHIRP_RATE_FACTOR 2.0
+#define CHIRP_RATE_RANGE  100.0
+
+// narrowest range a chirp is cut down to before it loses packets instead,
+// when the full sweep would outlast CHIRP_DURATION_MAX_US
+#define CHIRP_RATE_RANGE_MIN 4.0
+
+// rise in queueing delay taken as the path filling up [us]
+#define CHIRP_QUEUE_THRESHOLD_US 4.0
+
+// what receive_wait() found, and how long a train loop waits for it [us]
+#define RECEIVE_UDP 1
+#define RECEIVE_TCP 2
+#define RECEIVE_XDP 4
+#define RECEIVE_TIMEOUT_US 2000000
+
+// control data read alongside a datagram, room for its receive timestamp
+#define RECEIVE_CONTROL_SIZE 64
+
+// most datagrams one recvmmsg() reads ahead, a whole train of them
+#define RECEIVE_BATCH TRAIN_LENGTH_MAX
+
+// how long a read spins on the device queue when busy polling (SO_BUSY_POLL)
+#define RECEIVE_BUSY_POLL_US 50
+
+// packets the capture thread may have stamped ahead of the session, and as
+// much of each as a train loop reads: its ids and a marker's train length
+#define CAPTURE_RING_SIZE     4096
+#define CAPTURE_HEADER_LENGTH TRAIN_MARKER_LENGTH
+
+// rounds of a train's worth of datagrams queued on loopback and read back
+// when benchmarking how fast each receive path picks them up
+#define BENCH_RX_DRAIN_ROUNDS 500
 
 #endif  /* LOCO_H */
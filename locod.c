@@ -2,11 +2,21 @@
 
 #include "common.h"
 #include "debug.h"
+#include "pace.h"
+#include "slot.h"
+#include "txring.h"
 
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 
 #include <stdio.h>
@@ -16,6 +26,11 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <math.h>
 
 #include <getopt.h>
 // global variables
@@ -23,7 +38,6 @@
 struct config_s
 {
   // binding address information
-  int udp_socket;
   int udp_port;
   struct sockaddr_in udp_addr;
 
@@ -31,38 +45,59 @@ struct config_s
   int tcp_port;
   struct sockaddr_in tcp_addr;
 
+  int epoll_fd;
+  struct timer_wheel_s timers;
+
+  // trains are sent from their own thread, the event loop only queues them
+  struct dataplane_s dataplane;
+
   // global variables
-  char *random_packet;
+  struct packet_pool_s pool;
 
-  struct timeval time_now;
+  // built on first use, for trains sent while zerocopy sends pin the pool
+  struct packet_pool_s pool_spare;
 
-  int fsm_state;
+  int send_mode;
 
-  // session specific variables
-  struct hostent *receiver;
+  // raw sender, one ring per worker
+  char *txring_ifname;
+  struct txring_s txring;
 
-  int failed_messages;
+  // io_uring sender, and the pool allocation its registered buffer covers
+  struct uring_s uring;
+  unsigned int uring_pool_allocs;
 
-  // receiving address information
-  struct sockaddr_in tcp_cli_addr;
-  int tcp_fd;
+  struct pace_s pace;
+  double packet_spacing;
+
+  // fastest this worker puts an unpaced train on the wire [Mbps]
+  double host_send_rate;
+
+  // admission onto the link, shared by all workers
+  struct slot_s slot;
 
-  struct sockaddr_in udp_cli_addr;
-  int udp_cli_port;
+  int benchmark;
 
-  // train description
-  int train_id;
+  struct timeval time_now;
+
+  int fsm_state;
+
+  // forked workers sharing the control port
+  int workers;
+  int workers_count;
+  int worker_id;
+  pid_t worker_pids[WORKER_COUNT_MAX];
 
-  double train_spacing;
-  double train_spacing_min;
-  double train_spacing_max;
+  // active sessions
+  struct session_s *sessions[SESSION_COUNT_MAX];
+  int sessions_count;
 
-  unsigned int train_length;
-  unsigned int train_length_max;
+  // counters shared by all workers, served by the first
+  struct metrics_s metrics;
+  char *metrics_address;
 
-  unsigned int train_packet_length;
-  unsigned int train_packet_length_min;
-  unsigned int train_packet_length_max;
+  // known load offered alongside the measurements
+  struct xtraffic_s xtraffic;
 };
 
 struct config_s conf;
@@ -74,9 +109,73 @@ void banner(void);
 void usage(const char *);
 int init(void);
 int init_packet_train(void);
-char * create_packet_train(uint32_t train_id, uint32_t packet_id, unsigned int packet_length);
-int send_train(uint32_t id, unsigned int length, unsigned int packet_length, const struct sockaddr_in * client_address);
+int packet_pool_init(struct packet_pool_s *pool, unsigned int length);
+int packet_pool_grow(struct packet_pool_s *pool, unsigned int length);
+char * packet_pool_train(struct packet_pool_s *pool, uint32_t train_id, unsigned int length);
+void packet_pool_free(struct packet_pool_s *pool);
+int packet_pool_uring_register(struct packet_pool_s *pool);
+
+int session_accept(void);
+struct session_s * session_create(int tcp_fd, const struct sockaddr_in *tcp_cli_addr);
+void session_destroy(struct session_s *session);
+void session_control_read(struct session_s *session);
+int session_control_send(struct session_s *session, uint32_t code, uint32_t value);
+int session_control_flush(struct session_s *session);
+void session_control_handle(struct session_s *session, uint32_t ctl_code, uint32_t ctl_value);
+void session_train_schedule(struct session_s *session);
+void session_train_release(struct session_s *session);
+void session_train_complete(struct session_s *session, const struct dataplane_cmd_s *cmd);
+void session_train_marker_send(struct session_s *session, uint32_t train_id, unsigned int length, uint32_t seq);
+void session_dataplane_message(struct session_s *session, uint32_t code, uint32_t value);
+void session_ack_expect(struct session_s *session);
+void session_ack_timeout(void *arg);
+void session_release_timeout(void *arg);
+void session_idle_timeout(void *arg);
+void session_idle_touch(struct session_s *session);
+void session_plan_entry_add(struct session_s *session, unsigned int count);
+void session_plan_entry_load(struct session_s *session);
+void session_plan_start(struct session_s *session, uint32_t train_id);
+void session_plan_advance(struct session_s *session);
+void session_stats_log(struct session_s *session);
+int session_udp_connect(struct session_s *session, const struct sockaddr_in *client_address);
+double session_train_spacing_get(struct session_s *session);
+unsigned long session_train_bytes(struct session_s *session);
+
+void sessions_reap(void);
+
+int dataplane_start(struct dataplane_s *dataplane);
+void dataplane_stop(struct dataplane_s *dataplane);
+int dataplane_submit(struct dataplane_s *dataplane, struct dataplane_cmd_s *cmd);
+void * dataplane_run(void *arg);
+void dataplane_train_send(struct dataplane_cmd_s *cmd);
+void dataplane_complete(struct dataplane_s *dataplane);
+
+int session_tx_stamp_enable(struct session_s *session);
+int session_zerocopy_enable(struct session_s *session);
+void session_zerocopy_release(struct session_s *session);
+int session_sndbuf_size(struct session_s *session, unsigned int length, unsigned int packet_length);
+int session_errqueue_drain(struct session_s *session, unsigned int length, const struct timespec *sent_from);
+void session_tx_stamp_send(struct session_s *session, unsigned int length);
+
+int send_train(const struct dataplane_cmd_s *cmd);
+int send_train_sendto(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length);
+int send_train_mmsg(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length, int flags);
+int send_train_gso(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length);
+int send_train_paced(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length);
+int send_train_chirp(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length, double rate, double spread);
+int send_train_txring(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length);
+int send_train_uring(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length);
+int session_txring_ready(struct session_s *session);
+int send_mode_connected(int mode);
+int benchmark_send(void);
+double host_send_rate_measure(void);
+const char * send_mode_literal_get(int mode);
 void signal_handler(int signal);
+void signal_child(int signal);
+int workers_run(void);
+int worker_cpu_pin(int worker_id);
+int worker_cpu_release(int worker_id);
+int worker_run(void);
 int exit_clean(void);
 
 
@@ -86,6 +185,8 @@ int exit_clean(void);
 
 int main(int argc, char **argv)
 {
+  int status;
+
   /* check command line arguments */
   if ( parse_cmdline(argc, argv) != 0 )
   {
@@ -93,23 +194,231 @@ int main(int argc, char **argv)
     exit(1);
   }
 
+  if ( conf.benchmark )
+  {
+    // the send path counts into a worker's block, even here
+    if ( metrics_init(&conf.metrics, 1) != 0 )
+    {
+      fprintf(stderr, "Unable to create metrics.\n");
+      exit(1);
+    }
+
+    if ( init_packet_train() != 0 )
+    {
+      fprintf(stderr, "Unable to build packet pool.\n");
+      exit(1);
+    }
+
+    exit( benchmark_send() );
+  }
+
   fprintf(stdout, "Initialising...\n");
 
   conf.fsm_state = FSM_INIT;
-  conf.train_id = 1;
-  conf.train_packet_length = TRAIN_PACKET_LENGTH_MIN;
-  conf.train_length = TRAIN_LENGTH_MIN;
 
-  signal(SIGPIPE, signal_handler);
+  // mapped before forking so every worker writes into the same blocks
+  if ( metrics_init(&conf.metrics, conf.workers) != 0 )
+  {
+    fprintf(stderr, "Unable to create metrics.\n");
+    exit(1);
+  }
+
+  // a client dying mid write is noticed on its next read
+  signal(SIGPIPE, SIG_IGN);
   signal(SIGHUP, signal_handler);
-  signal(SIGALRM, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  if ( slot_init(&conf.slot) != 0 )
+  {
+    fprintf(stderr, "Unable to create slot scheduler.\n");
+    exit(1);
+  }
+
+  if ( xtraffic_start(&conf.xtraffic) != 0 )
+  {
+    fprintf(stderr, "Unable to start cross traffic.\n");
+    exit(1);
+  }
+
+  if ( conf.workers > 1 )
+    status = workers_run();
+  else
+    status = worker_run();
+
+  xtraffic_stop(&conf.xtraffic);
+
+  exit(status);
+}
+
+void signal_handler(int signal)
+{
+  conf.fsm_state = FSM_CLOSE;
+}
+
+void signal_child(int signal)
+{
+  // nothing to do, the signal only wakes workers_run() to reap the child
+}
+
+
+//
+// WORKERS
+//
+// with -w every worker is a forked copy of the daemon pinned to its own
+// CPU. the kernel spreads new control connections across the workers'
+// listen sockets through SO_REUSEPORT, so each session lives and sends
+// its trains entirely on one core without sharing anything. only the
+// worker's data plane thread stays on that core, its control thread may
+// run on any other.
+//
+
+int workers_run()
+{
+  struct sigaction action;
+  sigset_t signals, previous;
+  int i, status;
+  pid_t pid;
+
+  // held except while asleep in sigsuspend(), so none can land between
+  // checking the state and going to sleep
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &signals, &previous);
+
+  bzero(&action, sizeof(action));
+  action.sa_handler = signal_handler;
+  sigaction(SIGHUP, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  // a child exiting must wake us too, ignored it never would
+  action.sa_handler = signal_child;
+  sigaction(SIGCHLD, &action, NULL);
+
+  for (i=0; i<conf.workers; i++)
+  {
+    if ( (pid = fork()) < 0 )
+    {
+      fprintf(stderr, "Unable to fork worker %d.\n", i);
+      conf.fsm_state = FSM_CLOSE;
+      break;
+    }
+    else if ( pid == 0 )
+    {
+      signal(SIGCHLD, SIG_DFL);
+      sigprocmask(SIG_SETMASK, &previous, NULL);
+
+      conf.worker_id = i;
+      worker_cpu_pin(i);
+
+      exit( worker_run() );
+    }
+
+    conf.worker_pids[i] = pid;
+    conf.workers_count++;
+  }
+
+  fprintf(stdout, "Started %d workers\n", conf.workers_count);
+
+  // a worker exiting on its own takes only its sessions with it
+  while ( conf.workers_count > 0 )
+  {
+    if ( conf.fsm_state == FSM_CLOSE )
+    {
+      for (i=0; i<conf.workers; i++)
+        if ( conf.worker_pids[i] > 0 )
+          kill(conf.worker_pids[i], SIGHUP);
+    }
+
+    if ( (pid = waitpid(-1, &status, WNOHANG)) < 0 )
+      break;
+
+    // nobody to reap, sleep until a signal or a child's exit
+    if ( pid == 0 )
+    {
+      sigsuspend(&previous);
+      continue;
+    }
+
+    // the cross traffic generator only ends when asked to, or on failure
+    if ( pid == conf.xtraffic.pid )
+      conf.xtraffic.pid = 0;
+
+    for (i=0; i<conf.workers; i++)
+    {
+      if ( conf.worker_pids[i] == pid )
+      {
+        fprintf(stdout, "Worker %d exited (%d)\n", i, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+
+        conf.worker_pids[i] = 0;
+        conf.workers_count--;
+      }
+    }
+  }
+
+  sigprocmask(SIG_SETMASK, &previous, NULL);
+
+  return 0;
+}
+
+int worker_cpu_pin(int worker_id)
+{
+  cpu_set_t cpus;
+  long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+  int cpu = worker_id % ((cpu_count > 0) ? cpu_count : 1);
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+
+  if ( sched_setaffinity(0, sizeof(cpus), &cpus) != 0 )
+  {
+    ulog(LOG_WARN, "Unable to pin worker %d to CPU %d (%s)\n", worker_id, cpu, strerror(errno));
+    return 1;
+  }
+
+  ulog(LOG_INFO, "Worker %d pinned to CPU %d\n", worker_id, cpu);
+
+  return 0;
+}
+
+int worker_cpu_release(int worker_id)
+{
+  cpu_set_t cpus;
+  long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+  int cpu = worker_id % ((cpu_count > 0) ? cpu_count : 1);
+  int i;
+
+  // with a single core there is nowhere else to go
+  if ( cpu_count < 2 )
+    return 0;
+
+  CPU_ZERO(&cpus);
+  for (i=0; i<cpu_count; i++)
+    if ( i != cpu )
+      CPU_SET(i, &cpus);
+
+  // only the calling thread moves, the data plane keeps the pinned core
+  if ( sched_setaffinity(0, sizeof(cpus), &cpus) != 0 )
+  {
+    ulog(LOG_WARN, "Unable to move worker %d control off CPU %d (%s)\n", worker_id, cpu, strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+int worker_run()
+{
+  conf.sessions_count = 0;
+
+  metrics_worker_set(&conf.metrics, conf.worker_id);
 
   //
   // TCP SOCKET INIT
-  socklen_t len;
   int opt;
 
-  if ( (conf.tcp_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+  if ( (conf.tcp_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 )
   {
     fprintf(stderr, "Unable to open TCP socket.\n");
     exit(1);
@@ -122,6 +431,14 @@ int main(int argc, char **argv)
     exit(1);
   }
 
+  // every worker listens on the same port
+  if ( conf.workers > 1 &&
+       setsockopt(conf.tcp_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 )
+  {
+    fprintf(stderr, "Unable set TCP socket options for port reuse.\n");
+    exit(1);
+  }
+
   bzero(&conf.tcp_addr, sizeof(conf.tcp_addr));
   conf.tcp_addr.sin_family = AF_INET;
   conf.tcp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -133,7 +450,7 @@ int main(int argc, char **argv)
     exit(1);
   }
 
-  if ( listen(conf.tcp_socket, 1) < 0 )
+  if ( listen(conf.tcp_socket, SESSION_COUNT_MAX) < 0 )
   {
     fprintf(stderr, "Unable to listen on TCP socket.\n");
     exit(1);
@@ -144,176 +461,171 @@ int main(int argc, char **argv)
 
   //
   // UDP SOCKET INIT
-  if ( (conf.udp_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
-  {
-    fprintf(stderr, "Unable to open UDP socket.\n");
-    exit(1);
-  }
-
+  //
+  // each session opens its own UDP socket bound to this address
   bzero(&conf.udp_addr, sizeof(conf.udp_addr));
   conf.udp_addr.sin_family = AF_INET;
   conf.udp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
   conf.udp_addr.sin_port = htons(conf.udp_port);
 
-  if ( bind(conf.udp_socket,(struct sockaddr *)&conf.udp_addr, sizeof(conf.udp_addr)) != 0 )
-  {
-    fprintf(stderr, "Unable to bind to UDP socket.\n");
-    exit(1);
-  }
-
   // UDP SOCKET INIT - END
   //
 
 
-//  init_system();
+  //
+  // EVENT LOOP INIT
+  struct epoll_event event;
+  struct epoll_event events[SESSION_EVENTS_MAX];
+  struct session_s *session;
+  struct metrics_conn_s *conn;
 
-  fd_set read_fds;
+  if ( (conf.epoll_fd = epoll_create1(0)) < 0 )
+  {
+    fprintf(stderr, "Unable to create event loop.\n");
+    exit(1);
+  }
 
-  init_packet_train();
+  // the listener is the only event without a session attached
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
 
-  uint32_t ctl_code, ctl_value;
+  if ( epoll_ctl(conf.epoll_fd, EPOLL_CTL_ADD, conf.tcp_socket, &event) != 0 )
+  {
+    fprintf(stderr, "Unable to watch TCP socket.\n");
+    exit(1);
+  }
 
-  while ( conf.fsm_state != FSM_CLOSE )
+  // every session deadline runs off this worker's timer wheel
+  if ( timer_wheel_init(&conf.timers) != 0 )
   {
-    
-    conf.fsm_state = FSM_INIT;
-    conf.failed_messages = 0;
+    fprintf(stderr, "Unable to create timer wheel.\n");
+    exit(1);
+  }
 
-    fprintf(stdout, "Listening ...\n");
+  event.events = EPOLLIN;
+  event.data.ptr = &conf.timers;
+
+  if ( epoll_ctl(conf.epoll_fd, EPOLL_CTL_ADD, conf.timers.fd, &event) != 0 )
+  {
+    fprintf(stderr, "Unable to watch timer wheel.\n");
+    exit(1);
+  }
 
-    // wait for receiver to start a new measurement cycle
-    len = sizeof(conf.tcp_cli_addr);
-    if ( (conf.tcp_fd = accept(conf.tcp_socket, (struct sockaddr*)&conf.tcp_cli_addr, &len)) < 0 )
+  // scrapes are answered by one worker only, the others' counters are shared
+  if ( (NULL != conf.metrics_address) && (conf.worker_id == 0) )
+  {
+    if ( metrics_listen(&conf.metrics, conf.metrics_address) != 0 )
     {
-      perror("OOPS! accept(conf.tcp_socket):");
-      continue;
+      fprintf(stderr, "Unable to serve metrics on %s.\n", conf.metrics_address);
+      exit(1);
     }
 
+    event.events = EPOLLIN;
+    event.data.ptr = &conf.metrics;
+
+    if ( epoll_ctl(conf.epoll_fd, EPOLL_CTL_ADD, conf.metrics.fd, &event) != 0 )
     {
-      // who has connected to us
-      conf.receiver = gethostbyaddr((char*)&(conf.tcp_cli_addr.sin_addr), sizeof(conf.tcp_cli_addr.sin_addr), AF_INET);
-      fprintf(stdout, "Session initiated by %s\n", (NULL == conf.receiver) ? "unknown" : conf.receiver->h_name);
+      fprintf(stderr, "Unable to watch metrics socket.\n");
+      exit(1);
+    }
+  }
+  // EVENT LOOP INIT - END
+  //
 
-      // we have the receiver's TCP address sorted out, let's get the UDP address
-      bzero((char *)&conf.udp_cli_addr, sizeof(conf.udp_cli_addr));
-      conf.udp_cli_addr.sin_family = AF_INET;
-      conf.udp_cli_addr.sin_addr.s_addr = conf.tcp_cli_addr.sin_addr.s_addr;
-      conf.udp_cli_addr.sin_port = htons(conf.udp_cli_port);
+  if ( init_packet_train() != 0 )
+  {
+    fprintf(stderr, "Unable to build packet pool.\n");
+    exit(1);
+  }
 
-      FD_ZERO(&read_fds);
+  if ( conf.send_mode == SEND_MODE_TXRING &&
+       txring_open(&conf.txring, conf.txring_ifname) != 0 )
+  {
+    fprintf(stderr, "Unable to open TX ring on %s.\n", conf.txring_ifname);
+    exit(1);
+  }
 
-      // loop until session wants to end
-      while ( conf.fsm_state != FSM_END && conf.fsm_state != FSM_CLOSE )
-      {
-        FD_SET(conf.tcp_fd, &read_fds);  
+  if ( conf.send_mode == SEND_MODE_URING &&
+       uring_init(&conf.uring, URING_ENTRIES) != 0 )
+  {
+    fprintf(stderr, "Unable to set up io_uring (%s).\n", strerror(errno));
+    exit(1);
+  }
 
-        if ( select(conf.tcp_fd + 1, &read_fds, NULL, NULL, NULL) == -1 )
-        {
-          perror("OOPS! select(): ");
-          conf.fsm_state = FSM_END;            
-        }
+  pace_calibrate(&conf.pace);
 
-        if ( FD_ISSET(conf.tcp_fd, &read_fds) )
-        {
-          int ret;
-          if ( (ret=receive_control_message(conf.tcp_fd, &ctl_code, &ctl_value)) == 0)
-          {
-            switch ( ctl_code )
-            {
-              case MSG_SESSION_INIT:
-                ulog(LOG_INFO, "Intialising session.\n");     
-                break;
-              case MSG_SESSION_END:
-                ulog(LOG_INFO, "Ending session.\n");
-                conf.fsm_state = FSM_END;
-                break;
-              case MSG_SESSION_CLIENT_UDP_PORT_SET:
-                conf.udp_cli_port = (short)ctl_value;
-                conf.udp_cli_addr.sin_port = htons(conf.udp_cli_port);
-                ulog(LOG_INFO, "Setting client UDP listen port to: %u\n", conf.udp_cli_port);
-                break;
-              case MSG_RTT_SYNC:
-                ulog(LOG_DEBUG, "RTT Sync\n");
-                send_control_message(conf.tcp_fd, MSG_RTT_SYNC, (0xffffff-ctl_value));
-                break;
-              case MSG_TRAIN_SPACING_SET:
-                conf.train_spacing = (double)ctl_value;
-                ulog(LOG_INFO, "Setting train spacing to: %.0fus\n", conf.train_spacing);
-                break;
-              case MSG_TRAIN_SPACING_MIN_SET:
-                conf.train_spacing_min = (double)ctl_value;
-                ulog(LOG_INFO, "Setting minimum train spacing to: %.0fus\n", conf.train_spacing_min);
-                break;
-              case MSG_TRAIN_SPACING_MAX_SET:
-                conf.train_spacing_max = (double)ctl_value;
-                ulog(LOG_INFO, "Setting maximum train spacing to: %.0fus\n", conf.train_spacing_max);
-                break;
-              case MSG_TRAIN_LENGTH_SET:
-                conf.train_length = ctl_value;
-                ulog(LOG_INFO, "Setting train length to: %u packets\n", conf.train_length);
-                break;
-              case MSG_TRAIN_LENGTH_MAX_SET:
-                conf.train_length_max = ctl_value;
-                ulog(LOG_INFO, "Setting maximum train length to: %u packets\n", conf.train_length_max);
-                break;
-              case MSG_TRAIN_PACKET_LENGTH_SET:
-                conf.train_packet_length = ctl_value;
-                ulog(LOG_INFO, "Setting train packet length to: %u packets\n", conf.train_packet_length);
-                break;
-              case MSG_TRAIN_PACKET_LENGTH_MIN_SET:
-                conf.train_packet_length_min = ctl_value;
-                ulog(LOG_INFO, "Setting minimum train packet length to: %u bytes\n", conf.train_packet_length_min);
-                break;
-              case MSG_TRAIN_PACKET_LENGTH_MAX_SET:
-                conf.train_packet_length_max = ctl_value;
-                ulog(LOG_INFO, "Setting maximum train packet length to: %u bytes\n", conf.train_packet_length_max);
-                break;
-              case MSG_TRAIN_ID_SET:
-                conf.train_id = ctl_value;
-                ulog(LOG_INFO, "Setting train ID to: %d\n", conf.train_id);     
-                break;
-              case MSG_TRAIN_SEND:
-                send_train(conf.train_id, conf.train_length, conf.train_packet_length, &conf.udp_cli_addr);
-                // set alarm for confirmation of acknowledgement
-                alarm(10);
-                break;
-              case MSG_TRAIN_RECEIVE_ACK:
-              case MSG_TRAIN_RECEIVE_FAIL:
-                alarm(0);
-                break;
-              default:
-                ulog(LOG_INFO, "Unknown code received: %d\n", ctl_value);
-                break;
-            }
-          }
-          else if ( ret == 2 )
-          {
-            ulog(LOG_INFO, "Terminating session due closed connection.\n");
-            conf.fsm_state = FSM_END;            
-          }
-        }
-      }
+  conf.host_send_rate = host_send_rate_measure();
+  fprintf(stdout, "Host send rate: %.0f Mbps\n", conf.host_send_rate);
 
-      alarm(0);
-      close(conf.tcp_fd);
-    }
+  // from here on only the data plane thread touches the pool and senders
+  if ( dataplane_start(&conf.dataplane) != 0 )
+  {
+    fprintf(stderr, "Unable to start data plane thread.\n");
+    exit(1);
   }
 
-  exit( exit_clean() );
-}
+  event.events = EPOLLIN;
+  event.data.ptr = &conf.dataplane;
 
-void signal_handler(int signal)
-{
-  // sigpipe is likely the client died so just abort the connection
-  if ( signal == SIGPIPE )
-    conf.fsm_state = FSM_END;
-  else if ( signal == SIGALRM )
+  if ( epoll_ctl(conf.epoll_fd, EPOLL_CTL_ADD, conf.dataplane.completion_fd, &event) != 0 )
   {
-    send_control_message(conf.tcp_fd, MSG_TRAIN_SENT, conf.train_id);
-    alarm(10);
+    fprintf(stderr, "Unable to watch data plane.\n");
+    exit(1);
   }
+
+  if ( conf.workers > 1 )
+    worker_cpu_release(conf.worker_id);
+
+  if ( conf.workers > 1 )
+    fprintf(stdout, "Worker %d listening ...\n", conf.worker_id);
   else
-    conf.fsm_state = FSM_CLOSE;
+    fprintf(stdout, "Listening ...\n");
+
+  int i, n;
+
+  while ( conf.fsm_state != FSM_CLOSE )
+  {
+    n = epoll_wait(conf.epoll_fd, events, SESSION_EVENTS_MAX, -1);
+
+    if ( n < 0 )
+    {
+      if ( errno != EINTR )
+      {
+        perror("OOPS! epoll_wait(): ");
+        conf.fsm_state = FSM_CLOSE;
+      }
+
+      continue;
+    }
+
+    for (i=0; i<n; i++)
+    {
+      if ( NULL == events[i].data.ptr )
+        session_accept();
+      else if ( events[i].data.ptr == &conf.timers )
+        timer_wheel_run(&conf.timers);
+      else if ( events[i].data.ptr == &conf.metrics )
+        metrics_serve(&conf.metrics, conf.epoll_fd);
+      else if ( NULL != (conn = metrics_conn_get(&conf.metrics, events[i].data.ptr)) )
+        metrics_conn_run(&conf.metrics, conn, conf.epoll_fd);
+      else if ( events[i].data.ptr == &conf.dataplane )
+        dataplane_complete(&conf.dataplane);
+      else
+      {
+        session = (struct session_s *)events[i].data.ptr;
+
+        if ( events[i].events & EPOLLOUT )
+          session_control_flush(session);
+
+        if ( events[i].events & ~EPOLLOUT )
+          session_control_read(session);
+      }
+    }
+
+    sessions_reap();
+  }
+
+  return exit_clean();
 }
 
 
@@ -323,7 +635,22 @@ int parse_cmdline(int argc, char **argv)
   conf.tcp_port = DEFAULT_TCP_SERVER_PORT;
   conf.udp_port = DEFAULT_UDP_SERVER_PORT;
 
-  conf.udp_cli_port = DEFAULT_UDP_CLIENT_PORT;
+  conf.send_mode = SEND_MODE_SENDTO;
+  conf.txring_ifname = NULL;
+  conf.txring.fd = -1;
+  conf.uring.fd = -1;
+  conf.packet_spacing = 0.0;
+  conf.benchmark = 0;
+  conf.workers = 1;
+  conf.metrics_address = NULL;
+
+  xtraffic_init(&conf.xtraffic);
+
+  conf.slot.link_rate = SLOT_LINK_RATE_DEFAULT;
+  conf.slot.session_rate = 0.0;
+  conf.slot.session_budget = 0;
+
+  pace_init(&conf.pace);
 
   int c;
   int long_option_index = 0;
@@ -331,13 +658,117 @@ int parse_cmdline(int argc, char **argv)
     {"help", 0, NULL, '?'},
     {"version", 0, NULL, 'V'},
     {"port", 1, NULL, 'f'},
+    {"send-mode", 1, NULL, 's'},
+    {"benchmark", 0, NULL, 'B'},
+    {"packet-spacing", 1, NULL, 'g'},
+    {"workers", 1, NULL, 'w'},
+    {"interface", 1, NULL, 'i'},
+    {"link-rate", 1, NULL, 'l'},
+    {"session-rate", 1, NULL, 'r'},
+    {"session-budget", 1, NULL, 'b'},
+    {"metrics", 1, NULL, 'm'},
+    {"cross-traffic", 1, NULL, 'x'},
+    {"cross-target", 1, NULL, 'X'},
+    {"cross-sizes", 1, NULL, 'z'},
     {0, 0, 0, 0}
   };
 
-  while( (c=getopt_long(argc, argv, "?Vp:", long_options, &long_option_index)) != EOF )
+  while( (c=getopt_long(argc, argv, "?BVX:b:g:i:l:m:p:r:s:w:x:z:", long_options, &long_option_index)) != EOF )
   {
     switch (c)
     {
+      case 'g':
+        conf.packet_spacing = strtod(optarg, (char **)NULL);
+        if ( conf.packet_spacing <= 0 )
+        {
+          fprintf(stderr, "FATAL: Packet spacing %s is not valid!\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'B':
+        conf.benchmark = 1;
+        break;
+      case 'l':
+        conf.slot.link_rate = strtod(optarg, (char **)NULL);
+        if ( conf.slot.link_rate <= 0 )
+        {
+          fprintf(stderr, "FATAL: Link rate %s is not valid!\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'r':
+        conf.slot.session_rate = strtod(optarg, (char **)NULL);
+        if ( conf.slot.session_rate <= 0 )
+        {
+          fprintf(stderr, "FATAL: Session rate %s is not valid!\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'b':
+        conf.slot.session_budget = (unsigned long)(strtod(optarg, (char **)NULL) * 1000000.0);
+        if ( conf.slot.session_budget == 0 )
+        {
+          fprintf(stderr, "FATAL: Session budget %s is not valid!\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'i':
+        if ( NULL == conf.txring_ifname )
+          conf.txring_ifname = strdup(optarg);
+        break;
+      case 'm':
+        if ( NULL == conf.metrics_address )
+          conf.metrics_address = strdup(optarg);
+        break;
+      case 'x':
+        if ( xtraffic_model_parse(&conf.xtraffic, optarg) != 0 )
+        {
+          fprintf(stderr, "FATAL: Cross traffic \"%s\" is not valid (cbr|poisson|pareto:<Mbps>[:seed])!\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'X':
+        if ( xtraffic_target_parse(&conf.xtraffic, optarg) != 0 )
+        {
+          fprintf(stderr, "FATAL: Cross traffic target %s is not valid!\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'z':
+        if ( xtraffic_sizes_parse(&conf.xtraffic, optarg) != 0 )
+        {
+          fprintf(stderr, "FATAL: Cross traffic sizes %s are not valid (%d-%d bytes, %d entries)!\n", optarg,
+                  XTRAFFIC_SIZE_MIN, XTRAFFIC_SIZE_MAX, XTRAFFIC_SIZES_MAX);
+          exit(1);
+        }
+        break;
+      case 'w':
+        conf.workers = atoi(optarg);
+        if ( (conf.workers <= 0) || (conf.workers > WORKER_COUNT_MAX) )
+        {
+          fprintf(stderr, "FATAL: Worker count %s is not valid (1-%d)!\n", optarg, WORKER_COUNT_MAX);
+          exit(1);
+        }
+        break;
+      case 's':
+        if ( strcmp(optarg, "sendto") == 0 )
+          conf.send_mode = SEND_MODE_SENDTO;
+        else if ( strcmp(optarg, "mmsg") == 0 )
+          conf.send_mode = SEND_MODE_MMSG;
+        else if ( strcmp(optarg, "txring") == 0 )
+          conf.send_mode = SEND_MODE_TXRING;
+        else if ( strcmp(optarg, "gso") == 0 )
+          conf.send_mode = SEND_MODE_GSO;
+        else if ( strcmp(optarg, "zerocopy") == 0 )
+          conf.send_mode = SEND_MODE_ZEROCOPY;
+        else if ( strcmp(optarg, "uring") == 0 )
+          conf.send_mode = SEND_MODE_URING;
+        else
+        {
+          fprintf(stderr, "FATAL: Send mode \"%s\" is not valid!\n", optarg);
+          exit(1);
+        }
+        break;
       case '?':
         usage(argv[0]);
         exit(0);
@@ -357,6 +788,12 @@ int parse_cmdline(int argc, char **argv)
     }
   }
 
+  if ( conf.send_mode == SEND_MODE_TXRING && NULL == conf.txring_ifname )
+  {
+    fprintf(stderr, "FATAL: Send mode \"txring\" requires an interface (-i)!\n");
+    exit(1);
+  }
+
   return 0;
 }
 
@@ -385,97 +822,2301 @@ void usage(const char *program_name)
   fprintf(stdout, "  -?        You're reading it.\n");
   fprintf(stdout, "  -V        Version and compiled in options.\n");
   fprintf(stdout, "  -p <port> Specify C&C listen port (TCP).\n");
+  fprintf(stdout, "  -s <mode> Specify train send mode: sendto (default), mmsg, gso, zerocopy, uring, txring.\n");
+  fprintf(stdout, "  -i <if>   Interface the txring send mode writes frames to.\n");
+  fprintf(stdout, "  -g <us>   Pace packets within a train this far apart.\n");
+  fprintf(stdout, "  -w <n>    Fork n workers pinned to CPUs sharing the C&C port.\n");
+  fprintf(stdout, "  -l <Mbps> Link rate used to size each train's transmission slot. (Default: 1000)\n");
+  fprintf(stdout, "  -r <Mbps> Limit each session's average train rate.\n");
+  fprintf(stdout, "  -b <MB>   Limit the bytes each session may send.\n");
+  fprintf(stdout, "  -m <addr> Serve Prometheus metrics on a loopback port or Unix socket path.\n");
+  fprintf(stdout, "  -x <spec> Offer cross traffic: cbr, poisson or pareto:<Mbps>[:seed].\n");
+  fprintf(stdout, "  -X <host> Send cross traffic to host[:port]. (Default: 127.0.0.1:9)\n");
+  fprintf(stdout, "  -z <mix>  Cross traffic IP datagram sizes, size[*weight],... (Default: %s)\n", XTRAFFIC_SIZES_DEFAULT);
+  fprintf(stdout, "  -B        Benchmark the send modes over loopback and exit.\n");
   fprintf(stdout, "\n");
   fprintf(stdout, " Long Options:\n");
-  fprintf(stdout, "  --help    Same as '?'\n");
-  fprintf(stdout, "  --version Same as 'V'\n");
+  fprintf(stdout, "  --help           Same as '?'\n");
+  fprintf(stdout, "  --version        Same as 'V'\n");
+  fprintf(stdout, "  --send-mode      Same as 's'\n");
+  fprintf(stdout, "  --interface      Same as 'i'\n");
+  fprintf(stdout, "  --packet-spacing Same as 'g'\n");
+  fprintf(stdout, "  --workers        Same as 'w'\n");
+  fprintf(stdout, "  --link-rate      Same as 'l'\n");
+  fprintf(stdout, "  --session-rate   Same as 'r'\n");
+  fprintf(stdout, "  --session-budget Same as 'b'\n");
+  fprintf(stdout, "  --metrics        Same as 'm'\n");
+  fprintf(stdout, "  --cross-traffic  Same as 'x'\n");
+  fprintf(stdout, "  --cross-target   Same as 'X'\n");
+  fprintf(stdout, "  --cross-sizes    Same as 'z'\n");
+  fprintf(stdout, "  --benchmark      Same as 'B'\n");
   fprintf(stdout, "\n");
 }
 
-int init_packet_train()
-{
-  int ret = 0;
 
-  // generate a seed for randomizing
-  gettimeofday(&conf.time_now, (struct timezone*)0);
-  srandom(conf.time_now.tv_sec);
+//
+// SESSIONS
+//
+// every client owns a session holding its control channel, its own UDP
+// socket and the train it has described. all sessions are served from a
+// single epoll loop, nothing on the way blocks on any one client.
+//
+
+int session_accept()
+{
+  struct sockaddr_in tcp_cli_addr;
+  struct session_s *session;
+  struct epoll_event event;
+  socklen_t len;
+  int tcp_fd;
 
-  if ( (conf.random_packet = malloc(TRAIN_PACKET_LENGTH_MAX)) != NULL )
+  while ( 1 )
   {
-    int i;
+    len = sizeof(tcp_cli_addr);
+    if ( (tcp_fd = accept4(conf.tcp_socket, (struct sockaddr *)&tcp_cli_addr, &len, SOCK_NONBLOCK)) < 0 )
+    {
+      if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) )
+        perror("OOPS! accept(conf.tcp_socket):");
 
-    // create random payload to compensate for any payload compression
-    for (i=0; i<TRAIN_PACKET_LENGTH_MAX-1; i++)
-      conf.random_packet[i]=(char)(random() & 0xff);
-  }
-  else
-    ret = 1;
+      return 0;
+    }
 
-  return ret;
-}
+    if ( conf.sessions_count >= SESSION_COUNT_MAX )
+    {
+      ulog(LOG_WARN, "Refusing session, %d sessions already active.\n", conf.sessions_count);
+      close(tcp_fd);
+      continue;
+    }
 
-char * create_packet_train(uint32_t train_id, uint32_t packet_id, unsigned int packet_length)
-{
-  char *packet_train = NULL;
+    if ( (session = session_create(tcp_fd, &tcp_cli_addr)) == NULL )
+    {
+      close(tcp_fd);
+      continue;
+    }
 
-  uint32_t train_id_n = htonl(train_id);
-  uint32_t packet_id_n = htonl(packet_id);
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+
+    if ( epoll_ctl(conf.epoll_fd, EPOLL_CTL_ADD, tcp_fd, &event) != 0 )
+    {
+      session_destroy(session);
+      continue;
+    }
+
+    conf.sessions[conf.sessions_count++] = session;
+    session_idle_touch(session);
+
+    conf.metrics.self->sessions_accepted++;
+    conf.metrics.self->sessions_active++;
+
+    fprintf(stdout, "Session initiated by %s (%d active)\n", session->host, conf.sessions_count);
+  }
+}
+
+struct session_s * session_create(int tcp_fd, const struct sockaddr_in *tcp_cli_addr)
+{
+  struct session_s *session;
+  socklen_t len;
+  int opt;
+
+  if ( (session = calloc(1, sizeof(struct session_s))) == NULL )
+    return NULL;
+
+  session->fsm_state = FSM_INIT;
+  session->tcp_fd = tcp_fd;
+  session->tcp_cli_addr = *tcp_cli_addr;
+  session->train_id = 1;
+  session->train_packet_length = TRAIN_PACKET_LENGTH_MIN;
+  session->train_length = TRAIN_LENGTH_MIN;
+  session->train_schedule = TRAIN_SCHEDULE_PERIODIC;
+  session->chirp_spread = CHIRP_SPREAD_DEFAULT;
+
+  slot_session_init(&session->slot);
+
+  timer_init(&session->release_timer, session_release_timeout, session);
+  timer_init(&session->ack_timer, session_ack_timeout, session);
+  timer_init(&session->idle_timer, session_idle_timeout, session);
+
+  // numeric only, a reverse lookup would stall every other session
+  inet_ntop(AF_INET, &tcp_cli_addr->sin_addr, session->host, sizeof(session->host));
+
+  // we have the receiver's TCP address sorted out, let's get the UDP address
+  session->udp_cli_port = DEFAULT_UDP_CLIENT_PORT;
+  session->udp_cli_addr.sin_family = AF_INET;
+  session->udp_cli_addr.sin_addr.s_addr = tcp_cli_addr->sin_addr.s_addr;
+  session->udp_cli_addr.sin_port = htons(session->udp_cli_port);
+
+  if ( (session->udp_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
+  {
+    ulog(LOG_ERROR, "Unable to open UDP socket.\n");
+    free(session);
+    return NULL;
+  }
+
+  opt = 1;
+  setsockopt(session->udp_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  // without it UDP hides a packet the qdisc or driver dropped behind a
+  // successful send, we want ENOBUFS back so the train can be written off
+  setsockopt(session->udp_socket, SOL_IP, IP_RECVERR, &opt, sizeof(opt));
+
+  if ( bind(session->udp_socket, (struct sockaddr *)&conf.udp_addr, sizeof(conf.udp_addr)) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to bind to UDP socket.\n");
+    close(session->udp_socket);
+    free(session);
+    return NULL;
+  }
+
+  // frames written by the raw sender claim to come from this socket
+  len = sizeof(session->udp_local_addr);
+  getsockname(session->udp_socket, (struct sockaddr *)&session->udp_local_addr, &len);
+
+  session_udp_connect(session, &session->udp_cli_addr);
+
+  // a segmented send is stamped once, not once per packet on the wire
+  if ( conf.send_mode != SEND_MODE_GSO )
+    session_tx_stamp_enable(session);
+
+  if ( conf.send_mode == SEND_MODE_ZEROCOPY )
+    session_zerocopy_enable(session);
+
+  return session;
+}
+
+void session_destroy(struct session_s *session)
+{
+  timer_cancel(&conf.timers, &session->release_timer);
+  timer_cancel(&conf.timers, &session->ack_timer);
+  timer_cancel(&conf.timers, &session->idle_timer);
+
+  // closing the descriptor also removes it from the event loop
+  close(session->tcp_fd);
+  close(session->udp_socket);
+
+  free(session);
+}
+
+void session_control_read(struct session_s *session)
+{
+  uint32_t ctl_message;
+  uint32_t ctl_code, ctl_value;
+  struct timespec start, end;
+  int offset = 0;
+  int n;
+
+  n = read(session->tcp_fd, session->ctl_buffer + session->ctl_buffer_length, SESSION_CTL_BUFFER_SIZE - session->ctl_buffer_length);
+
+  if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) )
+  {
+    ulog(LOG_INFO, "Terminating session due closed connection.\n");
+    session->fsm_state = FSM_END;
+    return;
+  }
+  else if ( n < 0 )
+    return;
+
+  session_idle_touch(session);
+
+  session->ctl_buffer_length += n;
+
+  // handle every complete message, keeping any trailing fragment
+  while ( (session->ctl_buffer_length - offset) >= (int)sizeof(uint32_t) &&
+          session->fsm_state != FSM_END )
+  {
+    memcpy(&ctl_message, session->ctl_buffer + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
+    decode_control_message(ntohl(ctl_message), &ctl_code, &ctl_value);
+
+    pace_now(&start);
+    session_control_handle(session, ctl_code, ctl_value);
+    pace_now(&end);
+
+    conf.metrics.self->control_messages++;
+    metrics_hist_record(&conf.metrics.self->control_handle, &start, &end);
+  }
+
+  session->ctl_buffer_length -= offset;
+  memmove(session->ctl_buffer, session->ctl_buffer + offset, session->ctl_buffer_length);
+}
+
+int session_control_send(struct session_s *session, uint32_t code, uint32_t value)
+{
+  uint32_t ctl_message = ((code & 0xff) << 24) | (value & 0xffffff);
+
+  if ( session->tcp_fd < 0 )
+    return 0;
+
+  // a client that stopped reading altogether is not worth our memory
+  if ( session->out_buffer_length + (int)sizeof(uint32_t) > SESSION_OUT_BUFFER_SIZE )
+  {
+    ulog(LOG_WARN, "Control channel to %s backed up, ending session.\n", session->host);
+    session->fsm_state = FSM_END;
+    return 1;
+  }
+
+  ulog(LOG_DEBUG, "[S>] M=%u C=%u V=%u\n", ctl_message, code, value);
+
+  ctl_message = htonl(ctl_message);
+  memcpy(session->out_buffer + session->out_buffer_length, &ctl_message, sizeof(uint32_t));
+  session->out_buffer_length += sizeof(uint32_t);
+
+  // whatever is already waiting for room goes first
+  if ( session->out_waiting )
+    return 0;
+
+  return session_control_flush(session);
+}
+
+int session_control_flush(struct session_s *session)
+{
+  struct epoll_event event;
+  int offset = 0;
+  int n;
+
+  while ( offset < session->out_buffer_length )
+  {
+    n = write(session->tcp_fd, session->out_buffer + offset, session->out_buffer_length - offset);
+
+    if ( n < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+        break;
+
+      ulog(LOG_INFO, "Terminating session, unable to write to %s (%s)\n", session->host, strerror(errno));
+      session->fsm_state = FSM_END;
+      return 1;
+    }
+
+    offset += n;
+  }
+
+  session->out_buffer_length -= offset;
+  memmove(session->out_buffer, session->out_buffer + offset, session->out_buffer_length);
+
+  // only watch for room while there is something waiting on it
+  if ( (session->out_buffer_length > 0) != session->out_waiting )
+  {
+    session->out_waiting = (session->out_buffer_length > 0);
+
+    event.events = session->out_waiting ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    event.data.ptr = session;
+
+    if ( epoll_ctl(conf.epoll_fd, EPOLL_CTL_MOD, session->tcp_fd, &event) != 0 )
+    {
+      ulog(LOG_ERROR, "Unable to watch control channel of %s, ending session.\n", session->host);
+      session->fsm_state = FSM_END;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void session_control_handle(struct session_s *session, uint32_t ctl_code, uint32_t ctl_value)
+{
+  switch ( ctl_code )
+  {
+    case MSG_SESSION_INIT:
+      ulog(LOG_INFO, "Intialising session.\n");
+      break;
+    case MSG_SESSION_END:
+      ulog(LOG_INFO, "Ending session.\n");
+      session->fsm_state = FSM_END;
+      break;
+    case MSG_SESSION_CLIENT_UDP_PORT_SET:
+      session->udp_cli_port = (short)ctl_value;
+      session->udp_cli_addr.sin_port = htons(session->udp_cli_port);
+      session_udp_connect(session, &session->udp_cli_addr);
+      ulog(LOG_INFO, "Setting client UDP listen port to: %u\n", session->udp_cli_port);
+      break;
+    case MSG_RTT_SYNC:
+      ulog(LOG_DEBUG, "RTT Sync\n");
+      session_control_send(session, MSG_RTT_SYNC, (0xffffff-ctl_value));
+      break;
+    case MSG_TRAIN_SPACING_SET:
+      session->train_spacing = (double)ctl_value;
+      ulog(LOG_INFO, "Setting train spacing to: %.0fus\n", session->train_spacing);
+      break;
+    case MSG_TRAIN_SPACING_MIN_SET:
+      session->train_spacing_min = (double)ctl_value;
+      ulog(LOG_INFO, "Setting minimum train spacing to: %.0fus\n", session->train_spacing_min);
+      break;
+    case MSG_TRAIN_SPACING_MAX_SET:
+      session->train_spacing_max = (double)ctl_value;
+      ulog(LOG_INFO, "Setting maximum train spacing to: %.0fus\n", session->train_spacing_max);
+      break;
+    case MSG_TRAIN_SCHEDULE_SET:
+      session->train_schedule = ctl_value;
+      ulog(LOG_INFO, "Setting train schedule to: %s\n", (session->train_schedule == TRAIN_SCHEDULE_POISSON) ? "poisson" : "periodic");
+      break;
+    case MSG_TRAIN_LENGTH_SET:
+      session->train_length = ctl_value;
+      ulog(LOG_INFO, "Setting train length to: %u packets\n", session->train_length);
+      break;
+    case MSG_TRAIN_LENGTH_MAX_SET:
+      session->train_length_max = ctl_value;
+      ulog(LOG_INFO, "Setting maximum train length to: %u packets\n", session->train_length_max);
+      break;
+    case MSG_TRAIN_PACKET_LENGTH_SET:
+      session->train_packet_length = ctl_value;
+      ulog(LOG_INFO, "Setting train packet length to: %u packets\n", session->train_packet_length);
+      break;
+    case MSG_TRAIN_PACKET_LENGTH_MIN_SET:
+      session->train_packet_length_min = ctl_value;
+      ulog(LOG_INFO, "Setting minimum train packet length to: %u bytes\n", session->train_packet_length_min);
+      break;
+    case MSG_TRAIN_PACKET_LENGTH_MAX_SET:
+      session->train_packet_length_max = ctl_value;
+      ulog(LOG_INFO, "Setting maximum train packet length to: %u bytes\n", session->train_packet_length_max);
+      break;
+    case MSG_TRAIN_ID_SET:
+      session->train_id = ctl_value;
+      ulog(LOG_INFO, "Setting train ID to: %d\n", session->train_id);
+      break;
+    case MSG_CHIRP_RATE_SET:
+      session->chirp_rate = (double)ctl_value / 1000.0;
+      ulog(LOG_INFO, "Setting chirp rate to: %.3f Mbps\n", session->chirp_rate);
+      break;
+    case MSG_CHIRP_SPREAD_SET:
+      session->chirp_spread = (double)ctl_value / CHIRP_SPREAD_SCALE;
+      session->chirp_spread = (session->chirp_spread < CHIRP_SPREAD_MIN) ? CHIRP_SPREAD_MIN : session->chirp_spread;
+      session->chirp_spread = (session->chirp_spread > CHIRP_SPREAD_MAX) ? CHIRP_SPREAD_MAX : session->chirp_spread;
+      ulog(LOG_INFO, "Setting chirp spread to: %.3f\n", session->chirp_spread);
+      break;
+    case MSG_TRAIN_SEND:
+      session->train_chirp = 0;
+      session_train_schedule(session);
+      break;
+    case MSG_CHIRP_SEND:
+      // without a rate there is nothing to sweep, send it as a plain train
+      session->train_chirp = (session->chirp_rate > 0);
+      if ( ! session->train_chirp )
+      {
+        ulog(LOG_WARN, "Chirp requested without a rate, sending a train.\n");
+      }
+      // nor is a chirp that would hold the sender longer than we allow
+      else if ( chirp_duration_us(session->chirp_rate, session->chirp_spread, session->train_length,
+                                  session->train_packet_length) > CHIRP_DURATION_MAX_US )
+      {
+        ulog(LOG_WARN, "Chirp requested would take over %d us, sending a train.\n", CHIRP_DURATION_MAX_US);
+        session->train_chirp = 0;
+      }
+      session_train_schedule(session);
+      break;
+    case MSG_PLAN_RESET:
+      session->plan_count = 0;
+      session->plan_active = 0;
+      session->train_pending = 0;
+      session->train_deferred = 0;
+      timer_cancel(&conf.timers, &session->release_timer);
+      ulog(LOG_INFO, "Resetting measurement plan.\n");
+      break;
+    case MSG_PLAN_ENTRY_ADD:
+      session_plan_entry_add(session, ctl_value);
+      break;
+    case MSG_PLAN_START:
+      session_plan_start(session, ctl_value);
+      break;
+    case MSG_HOST_RECEIVE_RATE_SET:
+      session->host_receive_rate = ctl_value;
+      ulog(LOG_INFO, "Client receive rate: %u Mbps\n", session->host_receive_rate);
+      break;
+    case MSG_HOST_SEND_RATE_GET:
+      session_control_send(session, MSG_HOST_SEND_RATE, (conf.host_send_rate > 0xffffff) ? 0xffffff : (uint32_t)conf.host_send_rate);
+      break;
+    case MSG_TRAIN_RECEIVE_ACK:
+    case MSG_TRAIN_RECEIVE_FAIL:
+      session->ack_state = ACK_STATE_IDLE;
+      timer_cancel(&conf.timers, &session->ack_timer);
+      break;
+    default:
+      ulog(LOG_INFO, "Unknown code received: %d\n", ctl_value);
+      break;
+  }
+}
+
+void session_stats_log(struct session_s *session)
+{
+  ulog(LOG_INFO, "Session statistics for %s:\n"
+                 "  Trains sent: %lu\n"
+                 "  Packets sent: %lu (%lu bytes)\n"
+                 "  Short sends: %lu\n"
+                 "  Dropped (ENOBUFS): %lu (%lu trains written off)\n"
+                 "  Trains without transmit timestamps: %lu\n"
+                 "  Measurement plans completed: %lu\n"
+                 "  Zerocopy sends completed: %lu (%lu copied, %lu trains sent around pinned pages)\n"
+                 "  Trains sent with sendmmsg() in place of io_uring: %lu\n"
+                 "  Heap allocations on send path: %u\n"
+                 "  Train spacing error: %.2fus mean, %.2fus max (%lu paced, %lu late)\n"
+                 "  Packet spacing error: %.2fus mean, %.2fus max (%lu paced, %lu late)\n"
+                 "  Slots granted: %lu (%lu bytes, %lu refused, %lu overrun)\n"
+                 "  Queueing delay: %.2fus mean, %.2fus max\n"
+                 "  Host rates: %.0f Mbps sending, %u Mbps client receiving\n",
+                 session->host,
+                 session->stats.trains, session->stats.packets, session->stats.bytes,
+                 session->stats.packets_short, session->stats.packets_enobufs,
+                 session->stats.trains_dropped,
+                 session->stats.trains_unstamped,
+                 session->stats.plans,
+                 session->stats.zerocopy_completed, session->stats.zerocopy_copied, session->stats.zerocopy_spared,
+                 session->stats.uring_fallbacks,
+                 conf.pool.send_allocs + conf.pool_spare.send_allocs,
+                 pace_stats_error_mean(&session->pace_trains), session->pace_trains.error_max,
+                 session->pace_trains.count, session->pace_trains.late,
+                 pace_stats_error_mean(&session->pace_packets), session->pace_packets.error_max,
+                 session->pace_packets.count, session->pace_packets.late,
+                 session->slot.grants, session->slot.bytes, session->slot.refused, session->stats.slots_overrun,
+                 slot_session_queue_mean(&session->slot), session->slot.queue_max,
+                 conf.host_send_rate, session->host_receive_rate);
+}
+
+int session_udp_connect(struct session_s *session, const struct sockaddr_in *client_address)
+{
+  struct sockaddr addr;
+
+  if ( ! send_mode_connected(conf.send_mode) )
+    return 0;
+
+  if ( NULL == client_address )
+  {
+    bzero(&addr, sizeof(addr));
+    addr.sa_family = AF_UNSPEC;
+
+    return connect(session->udp_socket, &addr, sizeof(addr));
+  }
+
+  if ( connect(session->udp_socket, (struct sockaddr *)client_address, sizeof(struct sockaddr_in)) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to connect UDP socket to client (%s)\n", strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+
+//
+// SESSION TIMERS
+//
+// train releases, acknowledgement deadlines and idle sessions all run off
+// the worker's timer wheel, the event loop sleeping until the nearest one.
+// releases are woken a little early and the pacing engine busy-waits the
+// remainder.
+//
+
+void session_release_timeout(void *arg)
+{
+  session_train_release((struct session_s *)arg);
+}
+
+void session_idle_timeout(void *arg)
+{
+  struct session_s *session = (struct session_s *)arg;
+
+  // a plan streaming or a train queued, sending or awaiting its
+  // acknowledgement is not idle
+  if ( session->plan_active || session->train_pending || (session->dataplane_pending > 0) ||
+       (session->ack_state == ACK_STATE_WAIT) )
+  {
+    session_idle_touch(session);
+    return;
+  }
+
+  ulog(LOG_WARN, "Session with %s idle for %ds, ending it.\n", session->host, SESSION_IDLE_TIMEOUT_S);
+  session->fsm_state = FSM_END;
+}
+
+void session_idle_touch(struct session_s *session)
+{
+  struct timespec deadline;
+
+  pace_now(&deadline);
+  deadline.tv_sec += SESSION_IDLE_TIMEOUT_S;
+
+  timer_arm(&conf.timers, &session->idle_timer, &deadline);
+}
+
+void sessions_reap()
+{
+  struct dataplane_cmd_s cmd;
+  int i = 0;
+
+  while ( i < conf.sessions_count )
+  {
+    // the data plane may still be sending for it, reaped once handed back
+    // and once the data thread has given up the pool pages it still pinned
+    if ( (conf.sessions[i]->fsm_state == FSM_END) && (conf.sessions[i]->dataplane_pending == 0) &&
+         (conf.sessions[i]->zerocopy_pending > 0) )
+    {
+      bzero(&cmd, sizeof(cmd));
+      cmd.type = DATAPLANE_CMD_RELEASE;
+      cmd.session = conf.sessions[i];
+
+      // a full queue is tried again on the next pass
+      dataplane_submit(&conf.dataplane, &cmd);
+      i++;
+    }
+    else if ( (conf.sessions[i]->fsm_state == FSM_END) && (conf.sessions[i]->dataplane_pending == 0) )
+    {
+      fprintf(stdout, "Session ended by %s (%d active)\n", conf.sessions[i]->host, conf.sessions_count - 1);
+
+      session_stats_log(conf.sessions[i]);
+      session_destroy(conf.sessions[i]);
+
+      conf.sessions[i] = conf.sessions[--conf.sessions_count];
+      conf.sessions[conf.sessions_count] = NULL;
+
+      conf.metrics.self->sessions_active--;
+    }
+    else
+      i++;
+  }
+}
+
+
+//
+// TRAIN PACING
+//
+
+double session_train_spacing_get(struct session_s *session)
+{
+  double spacing = session->train_spacing;
+
+  // a plan entry is spaced as its client sized it, the round trip floor
+  // only holds back trains asked for one at a time
+  if ( session->plan_active )
+  {
+    if ( (session->train_schedule == TRAIN_SCHEDULE_POISSON) && (spacing > 0) )
+      return pace_spacing_poisson(spacing, 2.0 * spacing);
+
+    return spacing;
+  }
+
+  if ( (session->train_schedule == TRAIN_SCHEDULE_POISSON) &&
+       (session->train_spacing_max > session->train_spacing_min) )
+    return pace_spacing_poisson(session->train_spacing_min, session->train_spacing_max);
+
+  // an explicit spacing is still bound by the negotiated range
+  if ( spacing < session->train_spacing_min )
+    spacing = session->train_spacing_min;
+
+  if ( (session->train_spacing_max > 0) && (spacing > session->train_spacing_max) )
+    spacing = session->train_spacing_max;
+
+  return spacing;
+}
+
+void session_train_schedule(struct session_s *session)
+{
+  struct timespec now;
+  struct timespec due;
+  struct timespec slot_start;
+  unsigned long bytes = session_train_bytes(session);
+  double duration = slot_train_duration_us(&conf.slot, bytes);
+  double spacing;
+  double gaps = 0.0;
+
+  // the previous train sets our spacing, wait for it to be handed back
+  if ( session->dataplane_pending > 0 )
+  {
+    session->train_deferred = 1;
+    return;
+  }
+
+  spacing = session_train_spacing_get(session);
+
+  pace_now(&now);
+
+  // the spacing is measured from the end of the previous train
+  session->train_paced = (spacing > 0) && session->train_sent_last_valid;
+
+  if ( session->train_paced )
+  {
+    session->train_release = session->train_sent_last;
+    timespec_add_ns(&session->train_release, (long)(spacing * 1000.0));
+
+    // asked for once the spacing had run out, there is nothing to pace
+    if ( timespec_cmp(&session->train_release, &now) <= 0 )
+      session->train_paced = 0;
+  }
+  else
+    session->train_release = now;
+
+  // a paced train or a chirp occupies the link for at least its packet gaps
+  if ( session->train_chirp )
+    gaps = chirp_duration_us(session->chirp_rate, session->chirp_spread, session->train_length, session->train_packet_length);
+  else if ( conf.packet_spacing > 0 )
+    gaps = (bytes / session->train_packet_length) * conf.packet_spacing;
+
+  if ( duration < gaps )
+    duration = gaps;
+
+  // a release already past takes the link from now, not from back then
+  slot_start = (timespec_cmp(&now, &session->train_release) > 0) ? now : session->train_release;
+  due = slot_start;
+
+  if ( slot_grant(&conf.slot, &session->slot, bytes, duration, &slot_start) != SLOT_GRANTED )
+  {
+    ulog(LOG_WARN, "Refusing train %u from %s, byte budget exhausted.\n", session->train_id, session->host);
+    session_control_send(session, MSG_TRAIN_REFUSED, session->train_id);
+    session->plan_active = 0;
+    conf.metrics.self->trains_refused++;
+    return;
+  }
+
+  // queued behind other trains on the link
+  if ( timespec_cmp(&slot_start, &due) > 0 )
+    session->train_release = slot_start;
+
+  // the next slot on the link starts no sooner than this
+  session->train_slot_end = slot_start;
+  timespec_add_ns(&session->train_slot_end, (long)(duration * 1000.0) + SLOT_GUARD_NS);
+
+  session->train_pending = 1;
+
+  // a plan goes back through the event loop between trains, so one long
+  // plan cannot hold off every other session
+  if ( ! session->plan_active && timespec_cmp(&now, &session->train_release) >= 0 )
+  {
+    session_train_release(session);
+    return;
+  }
+
+  // otherwise the wheel releases it when due, less the wake up slack
+  due = session->train_release;
+  timespec_add_ns(&due, -conf.pace.slack_ns);
+
+  timer_arm(&conf.timers, &session->release_timer, &due);
+}
+
+unsigned long session_train_bytes(struct session_s *session)
+{
+  unsigned int length = session->train_length;
+  unsigned int packet_length = session->train_packet_length;
+
+  // mirror the limits send_train() applies
+  packet_length = (packet_length < TRAIN_PACKET_LENGTH_MIN ) ? TRAIN_PACKET_LENGTH_MIN : packet_length;
+  packet_length = (packet_length > TRAIN_PACKET_LENGTH_MAX ) ? TRAIN_PACKET_LENGTH_MAX : packet_length;
+  length = (length > TRAIN_POOL_LENGTH_LIMIT) ? TRAIN_POOL_LENGTH_LIMIT : length;
+
+  return (unsigned long)length * packet_length;
+}
+
+void session_train_release(struct session_s *session)
+{
+  struct dataplane_cmd_s cmd;
+
+  if ( ! session->train_pending )
+    return;
+
+  session->train_pending = 0;
+  timer_cancel(&conf.timers, &session->release_timer);
+
+  bzero(&cmd, sizeof(cmd));
+  cmd.type = DATAPLANE_CMD_TRAIN;
+  cmd.session = session;
+  cmd.train_id = session->train_id;
+  cmd.length = session->train_length;
+  cmd.packet_length = session->train_packet_length;
+  cmd.release = session->train_release;
+  cmd.slot_end = session->train_slot_end;
+  cmd.paced = session->train_paced;
+  cmd.plan = session->plan_active;
+  cmd.chirp = session->train_chirp;
+  cmd.chirp_rate = session->chirp_rate;
+  cmd.chirp_spread = session->chirp_spread;
+
+  // the client only timestamps a plan, nothing is acknowledged. an
+  // acknowledgement may beat the train being handed back, so we wait from now
+  if ( ! cmd.plan )
+  {
+    session->ack_state = ACK_STATE_WAIT;
+    session->ack_retries = 0;
+  }
+
+  if ( dataplane_submit(&conf.dataplane, &cmd) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to queue train %u for %s, ending session.\n", cmd.train_id, session->host);
+    session->fsm_state = FSM_END;
+  }
+}
+
+
+//
+// DATA PLANE
+//
+// every worker sends its trains from a thread of its own, so building and
+// sending a long train never holds up the control messages of any session,
+// least of all the RTT probes the spacing is derived from. the event loop
+// queues a train once its slot is due and the data thread busy-waits the
+// last of the wake up slack, sends it and hands the command back through a
+// second queue. both queues are single producer and single consumer, and
+// an eventfd wakes whichever side was waiting.
+//
+// while a session has commands on the data plane the data thread owns its
+// train socket, transmit stamps and send statistics. the event loop only
+// takes them back, to schedule the next train or reap the session, once
+// every command has been handed back. the data thread never writes to the
+// control channel, the messages a train owes the client are left on the
+// session and sent by the event loop, followed by the train's marker.
+//
+
+int dataplane_start(struct dataplane_s *dataplane)
+{
+  sigset_t signals, previous;
+  int ret;
+
+  bzero(dataplane, sizeof(struct dataplane_s));
+  dataplane->command_fd = -1;
+  dataplane->completion_fd = -1;
+
+  if ( (spsc_init(&dataplane->commands, DATAPLANE_QUEUE_SIZE, sizeof(struct dataplane_cmd_s)) != 0) ||
+       (spsc_init(&dataplane->completions, DATAPLANE_QUEUE_SIZE, sizeof(struct dataplane_cmd_s)) != 0) )
+    return 1;
+
+  // the data thread sleeps on its eventfd, the event loop polls its own
+  if ( ((dataplane->command_fd = eventfd(0, EFD_CLOEXEC)) < 0) ||
+       ((dataplane->completion_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) )
+    return 1;
+
+  // signals are for the event loop, a train is never interrupted by one
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+  ret = pthread_create(&dataplane->thread, NULL, dataplane_run, dataplane);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if ( ret != 0 )
+    return 1;
+
+  dataplane->running = 1;
+
+  return 0;
+}
+
+void dataplane_stop(struct dataplane_s *dataplane)
+{
+  struct dataplane_cmd_s cmd;
+
+  if ( ! dataplane->running )
+    return;
+
+  bzero(&cmd, sizeof(cmd));
+  cmd.type = DATAPLANE_CMD_STOP;
+
+  // whatever is queued ahead of it is sent first
+  while ( dataplane_submit(dataplane, &cmd) != 0 )
+    sched_yield();
+
+  pthread_join(dataplane->thread, NULL);
+  dataplane->running = 0;
+
+  close(dataplane->command_fd);
+  close(dataplane->completion_fd);
+
+  spsc_free(&dataplane->commands);
+  spsc_free(&dataplane->completions);
+}
+
+int dataplane_submit(struct dataplane_s *dataplane, struct dataplane_cmd_s *cmd)
+{
+  uint64_t wake = 1;
+
+  if ( spsc_push(&dataplane->commands, cmd) != 0 )
+    return 1;
+
+  if ( NULL != cmd->session )
+    cmd->session->dataplane_pending++;
+
+  if ( write(dataplane->command_fd, &wake, sizeof(wake)) != sizeof(wake) )
+  {
+    ulog(LOG_DEBUG, "Unable to wake data plane (%s)\n", strerror(errno));
+  }
+
+  return 0;
+}
+
+void * dataplane_run(void *arg)
+{
+  struct dataplane_s *dataplane = (struct dataplane_s *)arg;
+  struct dataplane_cmd_s cmd;
+  uint64_t wake;
+
+  while ( 1 )
+  {
+    while ( spsc_pop(&dataplane->commands, &cmd) == 0 )
+    {
+      if ( cmd.type == DATAPLANE_CMD_STOP )
+        return NULL;
+
+      if ( cmd.type == DATAPLANE_CMD_TRAIN )
+        dataplane_train_send(&cmd);
+      else if ( cmd.type == DATAPLANE_CMD_MARKER )
+        session_train_marker_send(cmd.session, cmd.train_id, cmd.length, cmd.marker_seq);
+      else if ( cmd.type == DATAPLANE_CMD_RELEASE )
+        session_zerocopy_release(cmd.session);
+
+      // no more than DATAPLANE_QUEUE_SIZE are ever out, this only waits on
+      // an event loop that has fallen behind
+      while ( spsc_push(&dataplane->completions, &cmd) != 0 )
+        sched_yield();
+
+      wake = 1;
+      if ( write(dataplane->completion_fd, &wake, sizeof(wake)) != sizeof(wake) )
+      {
+        ulog(LOG_DEBUG, "Unable to wake event loop (%s)\n", strerror(errno));
+      }
+    }
+
+    // a command queued since the queue was found empty has already counted
+    if ( (read(dataplane->command_fd, &wake, sizeof(wake)) < 0) && (errno != EINTR) )
+    {
+      ulog(LOG_ERROR, "Data plane unable to wait for commands (%s)\n", strerror(errno));
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+void dataplane_train_send(struct dataplane_cmd_s *cmd)
+{
+  struct session_s *session = cmd->session;
+  struct timespec now;
+  int late;
+
+  late = pace_wait_until(&conf.pace, &cmd->release);
+
+  // a late train is the worst error of all, it counts towards the mean and max too
+  if ( cmd->paced )
+  {
+    if ( late )
+      session->pace_trains.late++;
+
+    pace_now(&now);
+    pace_record(&session->pace_trains, time_delta_ts_us(session->train_sent_last, cmd->release), time_delta_ts_us(session->train_sent_last, now));
+  }
+
+  send_train(cmd);
+
+  // slots are only as good as our estimate of the link, count every miss
+  if ( timespec_cmp(&session->train_sent_last, &cmd->slot_end) > 0 )
+  {
+    session->stats.slots_overrun++;
+    conf.metrics.self->trains_overrun++;
+  }
+}
+
+void dataplane_complete(struct dataplane_s *dataplane)
+{
+  struct dataplane_cmd_s cmd;
+  struct session_s *session;
+  uint64_t wake;
+
+  // the count only woke us, the queue tells what is done
+  if ( read(dataplane->completion_fd, &wake, sizeof(wake)) < 0 )
+    return;
+
+  while ( spsc_pop(&dataplane->completions, &cmd) == 0 )
+  {
+    session = cmd.session;
+    session->dataplane_pending--;
+
+    if ( session->fsm_state == FSM_END )
+      continue;
+
+    if ( cmd.type == DATAPLANE_CMD_TRAIN )
+      session_train_complete(session, &cmd);
+
+    // the client has moved on, the train it asked for meanwhile goes as
+    // soon as the data plane lets go of the session, whatever it handed back
+    if ( session->train_deferred && (session->dataplane_pending == 0) )
+    {
+      session->train_deferred = 0;
+      session_train_schedule(session);
+    }
+  }
+}
+
+void session_train_complete(struct session_s *session, const struct dataplane_cmd_s *cmd)
+{
+  struct dataplane_cmd_s marker;
+  uint32_t code, value;
+  unsigned int i;
+
+  // the gaps, any drop and MSG_TRAIN_SENT the data thread left behind
+  for (i=0; i<session->dataplane_messages_count; i++)
+  {
+    decode_control_message(session->dataplane_messages[i], &code, &value);
+    session_control_send(session, code, value);
+  }
+
+  session->dataplane_messages_count = 0;
+
+  // the marker follows its MSG_TRAIN_SENT
+  session->marker_seq++;
+
+  bzero(&marker, sizeof(marker));
+  marker.type = DATAPLANE_CMD_MARKER;
+  marker.session = session;
+  marker.train_id = cmd->train_id;
+  marker.length = cmd->length;
+  marker.marker_seq = session->marker_seq;
+
+  if ( dataplane_submit(&conf.dataplane, &marker) != 0 )
+  {
+    ulog(LOG_DEBUG, "Unable to queue marker for train %u\n", cmd->train_id);
+  }
+
+  if ( session->train_deferred )
+    return;
+
+  if ( cmd->plan )
+  {
+    // unless the plan was reset while this train was out
+    if ( session->plan_active && (cmd->train_id == session->train_id) )
+      session_plan_advance(session);
+  }
+  else if ( session->ack_state == ACK_STATE_WAIT )
+    session_ack_expect(session);
+}
+
+
+//
+// TRAIN ACKNOWLEDGEMENT
+//
+// every train ends with a marker packet sent in-band behind it, after its
+// MSG_TRAIN_SENT, so the client need not wait on the control channel to
+// know the train is over. either may be lost or overtaken, so both are
+// sent again each time the client's acknowledgement is overdue, backing off
+// until the client is given up on.
+//
+
+void session_train_marker_send(struct session_s *session, uint32_t train_id, unsigned int length, uint32_t seq)
+{
+  uint32_t marker[TRAIN_MARKER_LENGTH / sizeof(uint32_t)];
+
+  marker[0] = htonl(train_id);
+  marker[1] = htonl(TRAIN_MARKER_ID);
+  marker[2] = htonl(length);
+  marker[3] = htonl(seq);
+
+  if ( sendto(session->udp_socket, marker, sizeof(marker), 0, (struct sockaddr *)&session->udp_cli_addr, sizeof(struct sockaddr_in)) < 0 )
+  {
+    ulog(LOG_DEBUG, "Unable to send marker for train %u (%s)\n", train_id, strerror(errno));
+  }
+}
+
+void session_ack_expect(struct session_s *session)
+{
+  session->ack_state = ACK_STATE_WAIT;
+  session->ack_retries = 0;
+
+  pace_now(&session->ack_deadline);
+  timespec_add_ns(&session->ack_deadline, SESSION_ACK_TIMEOUT_MS * 1000000L);
+
+  timer_arm(&conf.timers, &session->ack_timer, &session->ack_deadline);
+}
+
+void session_ack_timeout(void *arg)
+{
+  struct session_s *session = (struct session_s *)arg;
+  struct dataplane_cmd_s cmd;
+
+  if ( session->ack_retries >= SESSION_ACK_RETRIES_MAX )
+  {
+    ulog(LOG_WARN, "Train %u never acknowledged by %s, ending session.\n", session->train_id, session->host);
+
+    session->ack_state = ACK_STATE_IDLE;
+    session->fsm_state = FSM_END;
+    return;
+  }
+
+  ulog(LOG_DEBUG, "Train %u unacknowledged, resending.\n", session->train_id);
+
+  session_control_send(session, MSG_TRAIN_SENT, session->train_id);
+
+  // the marker goes out on the train socket, which the data plane owns
+  bzero(&cmd, sizeof(cmd));
+  cmd.type = DATAPLANE_CMD_MARKER;
+  cmd.session = session;
+  cmd.train_id = session->train_id;
+  cmd.length = session->train_length;
+  cmd.marker_seq = session->marker_seq;
+
+  if ( dataplane_submit(&conf.dataplane, &cmd) != 0 )
+  {
+    ulog(LOG_DEBUG, "Unable to queue marker for train %u\n", session->train_id);
+  }
+
+  session->ack_retries++;
+
+  pace_now(&session->ack_deadline);
+  timespec_add_ns(&session->ack_deadline, (SESSION_ACK_TIMEOUT_MS * 1000000L) << session->ack_retries);
+
+  timer_arm(&conf.timers, &session->ack_timer, &session->ack_deadline);
+}
+
+
+//
+// MEASUREMENT PLANS
+//
+// a client may upload every train of a phase up front, as entries of train
+// length, packet length and spacing repeated a number of times. the plan is
+// then streamed on our own schedule with consecutive train IDs, saving the
+// control round trips each train would otherwise cost. entries take the
+// train parameters set when they are added, and their spacing is kept as
+// given rather than raised to the negotiated minimum. MSG_PLAN_DONE follows
+// the last train's MSG_TRAIN_SENT so the client need not time out on it.
+//
+
+void session_plan_entry_add(struct session_s *session, unsigned int count)
+{
+  struct plan_entry_s *entry;
+
+  if ( session->plan_active )
+  {
+    ulog(LOG_WARN, "Ignoring plan entry from %s, a plan is running.\n", session->host);
+    return;
+  }
+
+  if ( (count == 0) || (session->plan_count >= PLAN_ENTRIES_MAX) )
+  {
+    ulog(LOG_WARN, "Ignoring plan entry %d from %s.\n", session->plan_count, session->host);
+    return;
+  }
+
+  entry = &session->plan[session->plan_count++];
+  entry->length = session->train_length;
+  entry->packet_length = session->train_packet_length;
+  entry->spacing = session->train_spacing;
+  entry->count = count;
+
+  ulog(LOG_INFO, "Adding plan entry: %u trains of %u x %u bytes\n", entry->count, entry->length, entry->packet_length);
+}
+
+void session_plan_entry_load(struct session_s *session)
+{
+  struct plan_entry_s *entry = &session->plan[session->plan_entry];
+
+  session->train_length = entry->length;
+  session->train_packet_length = entry->packet_length;
+  session->train_spacing = entry->spacing;
+  session->plan_remaining = entry->count;
+}
+
+void session_plan_start(struct session_s *session, uint32_t train_id)
+{
+  session->train_id = train_id;
+
+  if ( session->plan_count == 0 )
+  {
+    session_control_send(session, MSG_PLAN_DONE, train_id);
+    return;
+  }
+
+  ulog(LOG_INFO, "Starting plan of %d entries at train %u.\n", session->plan_count, train_id);
+
+  session->train_chirp = 0;
+  session->plan_entry = 0;
+  session->plan_active = 1;
+  session_plan_entry_load(session);
+
+  session_train_schedule(session);
+}
+
+void session_plan_advance(struct session_s *session)
+{
+  session->train_id++;
+
+  if ( --session->plan_remaining == 0 )
+  {
+    if ( ++session->plan_entry >= session->plan_count )
+    {
+      session->plan_active = 0;
+      session->stats.plans++;
+
+      // the ID of the last train streamed
+      session_control_send(session, MSG_PLAN_DONE, session->train_id - 1);
+      return;
+    }
+
+    session_plan_entry_load(session);
+  }
+
+  session_train_schedule(session);
+}
+
+
+
+
+int init_packet_train()
+{
+  // generate a seed for randomizing
+  gettimeofday(&conf.time_now, (struct timezone*)0);
+  srandom(conf.time_now.tv_sec);
+
+  // prebuild enough packets for the longest train a client will ask for
+  return packet_pool_init(&conf.pool, TRAIN_LENGTH_MAX);
+}
+
+//
+// PACKET POOL
+//
+// all packets are built once at startup, each slot holding a full sized
+// random payload with its packet ID already in place. sending a train only
+// rewrites the train ID word of each slot so nothing is allocated, copied
+// or freed between the control message and the packets hitting the wire.
+//
+
+int packet_pool_init(struct packet_pool_s *pool, unsigned int length)
+{
+  pool->packets = NULL;
+  pool->length = 0;
+  pool->allocs = 0;
+  pool->send_allocs = 0;
+  pool->train_id = 0;
+  pool->pinned = 0;
+
+  return packet_pool_grow(pool, length);
+}
+
+int packet_pool_grow(struct packet_pool_s *pool, unsigned int length)
+{
+  char *packets;
+  char *packet;
+  uint32_t packet_id_n;
+  uint32_t train_id_n = htonl(pool->train_id);
+  unsigned int i, j;
+
+  if ( length <= pool->length )
+    return 0;
+
+  if ( (packets = realloc(pool->packets, length * TRAIN_PACKET_LENGTH_MAX)) == NULL )
+    return 1;
+
+  pool->allocs++;
+
+  for (i=pool->length; i<length; i++)
+  {
+    packet = packets + (i * TRAIN_PACKET_LENGTH_MAX);
+
+    // create random payload to compensate for any payload compression
+    for (j=0; j<TRAIN_PACKET_LENGTH_MAX; j++)
+      packet[j] = (char)(random() & 0xff);
+
+    // insert identifiers
+    packet_id_n = htonl(i);
+    memcpy(packet, &train_id_n, sizeof(uint32_t));
+    memcpy(packet + sizeof(uint32_t), &packet_id_n, sizeof(uint32_t));
+  }
+
+  pool->packets = packets;
+  pool->length = length;
+
+  return 0;
+}
+
+char * packet_pool_train(struct packet_pool_s *pool, uint32_t train_id, unsigned int length)
+{
+  uint32_t train_id_n = htonl(train_id);
+  unsigned int i;
+
+  // only grow when a client asks for a train longer than we prepared for
+  if ( length > pool->length )
+  {
+    if ( packet_pool_grow(pool, length) != 0 )
+      return NULL;
+
+    pool->send_allocs++;
+  }
+
+  // the pool remembers the last train so repeated sends are free
+  if ( pool->train_id != train_id )
+  {
+    for (i=0; i<pool->length; i++)
+      memcpy(pool->packets + (i * TRAIN_PACKET_LENGTH_MAX), &train_id_n, sizeof(uint32_t));
+
+    pool->train_id = train_id;
+  }
+
+  return pool->packets;
+}
+
+void packet_pool_free(struct packet_pool_s *pool)
+{
+  free(pool->packets);
+
+  pool->packets = NULL;
+  pool->length = 0;
+}
+
+int send_train(const struct dataplane_cmd_s *cmd)
+{
+  struct session_s *session = cmd->session;
+  uint32_t train_id = cmd->train_id;
+  unsigned int length = cmd->length;
+  unsigned int packet_length = cmd->packet_length;
+  int sent;
+  int stamped;
+  int stamps = 0;
+  int pinned;
+  int zerocopy;
+  char *packets;
+  struct metrics_worker_s *metrics = conf.metrics.self;
+  unsigned long packets_short = session->stats.packets_short;
+  unsigned long packets_enobufs = session->stats.packets_enobufs;
+  struct timespec start, built, end;
+  struct timespec sent_from;
 
   // ensure we meet the minimum/maximum packet length constraints
   packet_length = (packet_length < TRAIN_PACKET_LENGTH_MIN ) ? TRAIN_PACKET_LENGTH_MIN : packet_length;
   packet_length = (packet_length > TRAIN_PACKET_LENGTH_MAX ) ? TRAIN_PACKET_LENGTH_MAX : packet_length;
 
-  if ( (packet_train = malloc(packet_length*sizeof(char))) != NULL )
+  // ensure we don't let a client exhaust our memory
+  length = (length > TRAIN_POOL_LENGTH_LIMIT) ? TRAIN_POOL_LENGTH_LIMIT : length;
+
+  if ( length * (packet_length + SNDBUF_PACKET_OVERHEAD) > (unsigned int)session->udp_sndbuf )
+    session_sndbuf_size(session, length, packet_length);
+
+  pace_now(&start);
+
+  // stamps are taken on the system clock
+  clock_gettime(CLOCK_REALTIME, &sent_from);
+
+  // pages the kernel still holds for zerocopy sends must not be rewritten,
+  // the train is built in the spare pool and sent from there by copy
+  pinned = (conf.pool.pinned > 0);
+
+  if ( pinned )
+  {
+    packets = packet_pool_train(&conf.pool_spare, train_id, length);
+    session->stats.zerocopy_spared++;
+  }
+  else
+    packets = packet_pool_train(&conf.pool, train_id, length);
+
+  if ( NULL == packets )
+  {
+    ulog(LOG_ERROR, "Unable to build train of length: %u packets\n", length);
+    return 1;
+  }
+
+  pace_now(&built);
+
+  ulog(LOG_DEBUG, "Sending train ...\n");
+
+  session->dataplane_messages_count = 0;
+  stamped = session->tx_stamp;
+
+  if ( cmd->chirp )
+    sent = send_train_chirp(session, packets, length, packet_length, cmd->chirp_rate, cmd->chirp_spread);
+  else if ( conf.packet_spacing > 0 )
+    sent = send_train_paced(session, packets, length, packet_length);
+  else if ( conf.send_mode == SEND_MODE_TXRING && session_txring_ready(session) )
+  {
+    // frames from the ring never pass the session socket's timestamping
+    sent = send_train_txring(session, packets, length, packet_length);
+    stamped = 0;
+  }
+  else if ( conf.send_mode == SEND_MODE_MMSG )
+    sent = send_train_mmsg(session, packets, length, packet_length, 0);
+  else if ( conf.send_mode == SEND_MODE_GSO )
+    sent = send_train_gso(session, packets, length, packet_length);
+  else if ( conf.send_mode == SEND_MODE_URING )
+    sent = send_train_uring(session, packets, length, packet_length);
+  else if ( conf.send_mode == SEND_MODE_ZEROCOPY )
+  {
+    zerocopy = session->zerocopy && ! pinned;
+
+    sent = send_train_mmsg(session, packets, length, packet_length, zerocopy ? MSG_ZEROCOPY : 0);
+
+    // the pool must not be rewritten while the kernel still holds its pages
+    if ( zerocopy )
+    {
+      session->zerocopy_pending += sent;
+      conf.pool.pinned += sent;
+    }
+  }
+  else
+    sent = send_train_sendto(session, packets, length, packet_length);
+
+  pace_now(&session->train_sent_last);
+  session->train_sent_last_valid = 1;
+
+  session->stats.trains++;
+  session->stats.packets += sent;
+  session->stats.bytes += sent * packet_length;
+
+  end = session->train_sent_last;
+
+  metrics->trains++;
+  metrics->packets += sent;
+  metrics->bytes += sent * packet_length;
+  metrics->packets_short += session->stats.packets_short - packets_short;
+  metrics->packets_enobufs += session->stats.packets_enobufs - packets_enobufs;
+  metrics_hist_record(&metrics->train_build, &start, &built);
+  metrics_hist_record(&metrics->train_send, &built, &end);
+
+  if ( stamped || session->zerocopy_pending > 0 )
+    stamps = session_errqueue_drain(session, stamped ? length : 0, &sent_from);
+
+  // the receiver can only correct a train it has every gap for
+  if ( stamped && (stamps == length) && (sent == length) )
+    session_tx_stamp_send(session, length);
+  else if ( session->tx_stamp )
+    session->stats.trains_unstamped++;
+
+  // the client would otherwise sit out its receive timeout on the gap
+  if ( sent < (int)length )
+  {
+    session->stats.trains_dropped++;
+    metrics->trains_dropped++;
+
+    ulog(LOG_DEBUG, "Train %u lost %u of %u packets on the way out\n", train_id, length - sent, length);
+    session_dataplane_message(session, MSG_TRAIN_DROPPED, train_id);
+  }
+
+  session_dataplane_message(session, MSG_TRAIN_SENT, train_id);
+
+  ulog(LOG_DEBUG, "Heap allocations on send path: %u\n", conf.pool.send_allocs + conf.pool_spare.send_allocs);
+
+  return 0;
+}
+
+//
+// ERROR QUEUE
+//
+// the kernel stamps every packet as it is handed to the device and queues
+// the stamp on the socket's error queue, tagged with a per socket counter.
+// the gaps between consecutive stamps are returned ahead of MSG_TRAIN_SENT
+// so the receiver can tell our own scheduling hiccups from path dispersion.
+//
+// the counter only moves for packets that actually left, a failed send
+// takes no ID, so we never count along with it. stamps taken before the
+// train began belong to markers or trains gone before, the first one
+// taken since is the train's first packet and the rest follow from its ID.
+//
+// zerocopy completions arrive on the same queue, as ranges of send calls
+// whose pages the kernel has released. the pool is the kernel's until
+// every one has come back, however long that takes, and any train sent
+// meanwhile is built in the spare pool instead.
+//
+
+// stamps of the train in flight, sessions send one train at a time
+static struct timespec tx_stamps[TRAIN_POOL_LENGTH_LIMIT];
+static char tx_stamp_valid[TRAIN_POOL_LENGTH_LIMIT];
+
+int session_tx_stamp_enable(struct session_s *session)
+{
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+              SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+  session->tx_stamp = 0;
+
+  if ( setsockopt(session->udp_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0 )
+  {
+    ulog(LOG_WARN, "Transmit timestamps unavailable (%s)\n", strerror(errno));
+    return 1;
+  }
+
+  session->tx_stamp = 1;
+
+  return 0;
+}
+
+int session_zerocopy_enable(struct session_s *session)
+{
+  int opt = 1;
+
+  session->zerocopy = 0;
+  session->zerocopy_pending = 0;
+
+  if ( setsockopt(session->udp_socket, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) != 0 )
+  {
+    ulog(LOG_WARN, "Zerocopy sends unavailable (%s)\n", strerror(errno));
+    return 1;
+  }
+
+  session->zerocopy = 1;
+
+  return 0;
+}
+
+void session_zerocopy_release(struct session_s *session)
+{
+  // completions of a session that has ended never arrive, closing its socket
+  // lets the kernel go of the pages and the worker zerocopy again
+  if ( session->zerocopy_pending > 0 )
+  {
+    ulog(LOG_DEBUG, "Releasing %u zerocopy sends of an ended session\n", session->zerocopy_pending);
+  }
+
+  conf.pool.pinned -= (session->zerocopy_pending > conf.pool.pinned) ? conf.pool.pinned : session->zerocopy_pending;
+  session->zerocopy_pending = 0;
+}
+
+int session_sndbuf_size(struct session_s *session, unsigned int length, unsigned int packet_length)
+{
+  int size = length * (packet_length + SNDBUF_PACKET_OVERHEAD);
+  socklen_t len = sizeof(session->udp_sndbuf);
+
+  size = (size > SNDBUF_SIZE_MAX) ? SNDBUF_SIZE_MAX : size;
+
+  // the kernel doubles what it is asked for, and caps plain requests at
+  // wmem_max unless we may override it
+  if ( setsockopt(session->udp_socket, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) != 0 )
+    setsockopt(session->udp_socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  if ( getsockopt(session->udp_socket, SOL_SOCKET, SO_SNDBUF, &session->udp_sndbuf, &len) != 0 )
+    return 1;
+
+  if ( session->udp_sndbuf < size )
+  {
+    ulog(LOG_WARN, "Send buffer holds %d bytes, a train of %u needs %d\n", session->udp_sndbuf, length, size);
+
+    // as big as it gets, don't ask again for every train
+    session->udp_sndbuf = size;
+    return 1;
+  }
+
+  return 0;
+}
+
+int session_errqueue_drain(struct session_s *session, unsigned int length, const struct timespec *sent_from)
+{
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+  struct scm_timestamping *stamp;
+  struct sock_extended_err *err;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct pollfd pfd;
+  struct timespec deadline;
+  struct timespec now;
+  struct timespec wait;
+  struct timespec ts;
+  uint32_t base = 0;
+  uint32_t id;
+  uint32_t completed;
+  unsigned int collected = 0;
+  int base_valid = 0;
+  int ts_valid;
+  int n;
+
+  bzero(tx_stamp_valid, length);
+
+  pace_now(&deadline);
+  timespec_add_ns(&deadline, TX_STAMP_WAIT_US * 1000L);
+
+  pfd.fd = session->udp_socket;
+  pfd.events = POLLERR;
+
+  while ( (collected < length) || (session->zerocopy_pending > 0) )
+  {
+    bzero(&msg, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ( (n = recvmsg(session->udp_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) < 0 )
+    {
+      if ( (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) )
+        break;
+
+      // stamps trail the send by the device queue, give them a moment
+      pace_now(&now);
+      if ( timespec_cmp(&now, &deadline) >= 0 )
+      {
+        if ( session->zerocopy_pending > 0 )
+        {
+          ulog(LOG_DEBUG, "%u zerocopy sends still pin the pool\n", session->zerocopy_pending);
+        }
+        break;
+      }
+
+      // sleep until the kernel queues the next one, or the deadline
+      wait.tv_sec = 0;
+      wait.tv_nsec = (long)(time_delta_ts_us(now, deadline) * 1000.0);
+
+      ppoll(&pfd, 1, &wait, NULL);
+      continue;
+    }
+
+    ts_valid = 0;
+    err = NULL;
+
+    for (cmsg=CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(&msg, cmsg))
+    {
+      if ( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING) )
+      {
+        stamp = (struct scm_timestamping *)CMSG_DATA(cmsg);
+        ts = stamp->ts[0];
+        ts_valid = 1;
+      }
+      else if ( (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR) )
+        err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+    }
+
+    if ( (NULL != err) && (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) )
+    {
+      // one notification covers the inclusive range ee_info..ee_data
+      completed = err->ee_data - err->ee_info + 1;
+
+      if ( completed > session->zerocopy_pending )
+        completed = session->zerocopy_pending;
+
+      session->zerocopy_pending -= completed;
+      session->stats.zerocopy_completed += completed;
+
+      conf.pool.pinned -= (completed > conf.pool.pinned) ? conf.pool.pinned : completed;
+
+      // a copy made anyway costs more than a plain send, stop asking
+      if ( err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+      {
+        session->stats.zerocopy_copied += completed;
+
+        if ( session->zerocopy )
+        {
+          ulog(LOG_INFO, "Zerocopy sends to %s are copied, falling back to batched sends.\n", session->host);
+        }
+        session->zerocopy = 0;
+      }
+
+      continue;
+    }
+
+    if ( ! ts_valid || (NULL == err) || (err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) || (err->ee_info != SCM_TSTAMP_SND) )
+      continue;
+
+    // a marker or an earlier train's straggler
+    if ( timespec_cmp(&ts, sent_from) < 0 )
+      continue;
+
+    if ( ! base_valid )
+    {
+      base = err->ee_data;
+      base_valid = 1;
+    }
+
+    id = err->ee_data - base;
+    if ( (id >= length) || tx_stamp_valid[id] )
+      continue;
+
+    tx_stamps[id] = ts;
+    tx_stamp_valid[id] = 1;
+    collected++;
+  }
+
+  return collected;
+}
+
+void session_tx_stamp_send(struct session_s *session, unsigned int length)
+{
+  double gap_ns;
+  unsigned int i;
+
+  for (i=1; i<length; i++)
   {
-    // insert master random payload    
-    memcpy(packet_train, conf.random_packet, packet_length*sizeof(char));
-   
-    // insert identifiers
-    memcpy(packet_train, &train_id_n, sizeof(uint32_t));
-    memcpy(packet_train + sizeof(uint32_t), &packet_id_n, sizeof(uint32_t));
+    gap_ns = time_delta_ts_us(tx_stamps[i-1], tx_stamps[i]) * 1000.0;
 
+    // the value field is 24 bits wide
+    gap_ns = (gap_ns < 0) ? 0 : gap_ns;
+    gap_ns = (gap_ns > 0xffffff) ? 0xffffff : gap_ns;
+
+    session_dataplane_message(session, MSG_TRAIN_TX_GAP, (uint32_t)gap_ns);
   }
+}
 
-  return packet_train;
+void session_dataplane_message(struct session_s *session, uint32_t code, uint32_t value)
+{
+  // held in the order sent, the event loop writes them once handed the train back
+  if ( session->dataplane_messages_count < DATAPLANE_MESSAGES_MAX )
+    session->dataplane_messages[session->dataplane_messages_count++] = ((code & 0xff) << 24) | (value & 0xffffff);
 }
 
-int send_train(uint32_t train_id, unsigned int length, unsigned int packet_length, const struct sockaddr_in *client_address)
+
+//
+// SEND MODES
+//
+// each returns the number of packets that left in full, accounting any
+// short or dropped packets in the session statistics.
+//
+
+int send_train_sendto(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length)
 {
   int i, n;
-  char *packet_train[length];
+  int sent = 0;
+
+  for (i=0; i<length; i++)
+  {
+    n = sendto(session->udp_socket, packets + (i * TRAIN_PACKET_LENGTH_MAX), packet_length, 0, (struct sockaddr *)&session->udp_cli_addr, sizeof(struct sockaddr_in));
+    session->stats.syscalls++;
 
-  ulog(LOG_DEBUG, "Building train ...\n");
+    if ( n == (int)packet_length )
+      sent++;
+    else
+    {
+      if ( (n < 0) && (errno == ENOBUFS) )
+        session->stats.packets_enobufs++;
+      else
+        session->stats.packets_short++;
+
+      ulog(LOG_DEBUG, "Incomplete packet sent [%d, %d < %d] (%s)\n", i, n, packet_length, strerror(errno));
+    }
+  }
+
+  return sent;
+}
+
+// sized for the longest train so the send path never allocates
+static struct mmsghdr train_msgs[TRAIN_POOL_LENGTH_LIMIT];
+static struct iovec train_iovs[TRAIN_POOL_LENGTH_LIMIT];
 
-  // build the train
+int send_train_mmsg(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length, int flags)
+{
+  int i, n;
+  int sent = 0;
+
+  // the socket is connected so no per-packet address is needed
   for (i=0; i<length; i++)
-    packet_train[i] = create_packet_train(train_id, (uint32_t)i, packet_length);
+  {
+    train_iovs[i].iov_base = (char *)packets + (i * TRAIN_PACKET_LENGTH_MAX);
+    train_iovs[i].iov_len = packet_length;
 
-  ulog(LOG_DEBUG, "Sending train ...\n");
+    bzero(&train_msgs[i].msg_hdr, sizeof(struct msghdr));
+    train_msgs[i].msg_hdr.msg_iov = &train_iovs[i];
+    train_msgs[i].msg_hdr.msg_iovlen = 1;
+    train_msgs[i].msg_len = 0;
+  }
+
+  i = 0;
+  while ( i < length )
+  {
+    n = sendmmsg(session->udp_socket, &train_msgs[i], length - i, flags);
+    session->stats.syscalls++;
+
+    if ( n < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      // the head packet was refused, account for it and carry on with the rest
+      if ( errno == ENOBUFS )
+        session->stats.packets_enobufs++;
+      else
+        session->stats.packets_short++;
+
+      ulog(LOG_DEBUG, "Incomplete packet sent [%d] (%s)\n", i, strerror(errno));
+
+      i++;
+      continue;
+    }
+
+    for (; n>0; n--, i++)
+    {
+      if ( train_msgs[i].msg_len == packet_length )
+        sent++;
+      else
+      {
+        session->stats.packets_short++;
+        ulog(LOG_DEBUG, "Incomplete packet sent [%d, %u < %d]\n", i, train_msgs[i].msg_len, packet_length);
+      }
+    }
+  }
+
+  return sent;
+}
+
+int send_train_gso(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length)
+{
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  unsigned int segments;
+  unsigned int count;
+  int i, n;
+  int sent = 0;
+
+  // the stack splits each send back into packet_length datagrams
+  segments = GSO_BYTES_MAX / packet_length;
+  if ( segments > GSO_SEGMENTS_MAX )
+    segments = GSO_SEGMENTS_MAX;
 
-  // send the train
   for (i=0; i<length; i++)
   {
-    if ( (n=sendto(conf.udp_socket, packet_train[i], packet_length, 0, (struct sockaddr *)client_address, sizeof(struct sockaddr_in))) < packet_length )
+    train_iovs[i].iov_base = (char *)packets + (i * TRAIN_PACKET_LENGTH_MAX);
+    train_iovs[i].iov_len = packet_length;
+  }
+
+  i = 0;
+  while ( i < length )
+  {
+    count = length - i;
+    if ( count > segments )
+      count = segments;
+
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &train_iovs[i];
+    msg.msg_iovlen = count;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *(uint16_t *)CMSG_DATA(cmsg) = (uint16_t)packet_length;
+
+    n = sendmsg(session->udp_socket, &msg, 0);
+    session->stats.syscalls++;
+
+    if ( n < 0 )
     {
-      ulog(LOG_DEBUG, "Incomplete packet sent [%d, %d < %d] (%s)\n", i, n, packet_length, strerror(errno));
+      if ( errno == EINTR )
+        continue;
+
+      // the whole batch is lost with the send
+      if ( errno == ENOBUFS )
+        session->stats.packets_enobufs += count;
+      else
+        session->stats.packets_short += count;
+
+      ulog(LOG_DEBUG, "Incomplete segmented send [%d, %u packets] (%s)\n", i, count, strerror(errno));
+    }
+    else if ( n != (int)(count * packet_length) )
+    {
+      sent += n / packet_length;
+      session->stats.packets_short += count - (n / packet_length);
+    }
+    else
+      sent += count;
+
+    i += count;
+  }
+
+  return sent;
+}
+
+int send_train_paced(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length)
+{
+  struct timespec t_last;
+  struct timespec t_send;
+  struct timespec deadline;
+  long spacing_ns = (long)(conf.packet_spacing * 1000.0);
+  int i, n;
+  int sent = 0;
+
+  for (i=0; i<length; i++)
+  {
+    if ( i > 0 )
+    {
+      deadline = t_last;
+      timespec_add_ns(&deadline, spacing_ns);
+
+      if ( pace_wait_until(&conf.pace, &deadline) != 0 )
+        session->pace_packets.late++;
     }
+
+    pace_now(&t_send);
+
+    if ( i > 0 )
+      pace_record(&session->pace_packets, conf.packet_spacing, time_delta_ts_us(t_last, t_send));
+
+    t_last = t_send;
+
+    n = sendto(session->udp_socket, packets + (i * TRAIN_PACKET_LENGTH_MAX), packet_length, 0, (struct sockaddr *)&session->udp_cli_addr, sizeof(struct sockaddr_in));
+    session->stats.syscalls++;
+
+    if ( n == (int)packet_length )
+      sent++;
+    else if ( (n < 0) && (errno == ENOBUFS) )
+      session->stats.packets_enobufs++;
+    else
+      session->stats.packets_short++;
   }
 
-  send_control_message(conf.tcp_fd, MSG_TRAIN_SENT, train_id);
+  return sent;
+}
 
-  ulog(LOG_DEBUG, "Dismantling train ...\n");
+int send_train_chirp(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length, double rate, double spread)
+{
+  struct timespec t_start;
+  struct timespec t_last;
+  struct timespec t_send;
+  struct timespec deadline;
+  double offset = 0.0;
+  double gap;
+  int i, n;
+  int sent = 0;
 
-  // free the train
   for (i=0; i<length; i++)
-    free(packet_train[i]);
+  {
+    // deadlines run from the first packet, a late one does not shift the rest
+    if ( i > 0 )
+    {
+      gap = chirp_gap_us(rate, spread, length, packet_length, i);
+      offset += gap;
+
+      deadline = t_start;
+      timespec_add_ns(&deadline, (long)(offset * 1000.0));
+
+      if ( pace_wait_until(&conf.pace, &deadline) != 0 )
+        session->pace_packets.late++;
+    }
+
+    pace_now(&t_send);
+
+    if ( i == 0 )
+      t_start = t_send;
+    else
+      pace_record(&session->pace_packets, gap, time_delta_ts_us(t_last, t_send));
+
+    t_last = t_send;
+
+    n = sendto(session->udp_socket, packets + (i * TRAIN_PACKET_LENGTH_MAX), packet_length, 0, (struct sockaddr *)&session->udp_cli_addr, sizeof(struct sockaddr_in));
+    session->stats.syscalls++;
+
+    if ( n == (int)packet_length )
+      sent++;
+    else if ( (n < 0) && (errno == ENOBUFS) )
+      session->stats.packets_enobufs++;
+    else
+      session->stats.packets_short++;
+  }
+
+  return sent;
+}
+
+int session_txring_ready(struct session_s *session)
+{
+  if ( session->txring_mac_valid )
+    return 1;
+
+  // until the neighbour is known the socket path sends, and resolves it
+  if ( txring_resolve(&conf.txring, session->udp_cli_addr.sin_addr, session->txring_mac) != 0 )
+  {
+    ulog(LOG_DEBUG, "No link address for %s yet, sending through the socket.\n", session->host);
+    return 0;
+  }
+
+  session->txring_mac_valid = 1;
+
+  return 1;
+}
+
+int send_train_txring(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length)
+{
+  int sent = txring_send_train(&conf.txring, session->txring_mac, &session->udp_local_addr, &session->udp_cli_addr, packets, TRAIN_PACKET_LENGTH_MAX, length, packet_length);
+
+  session->stats.packets_short += length - sent;
+
+  // the ring is flushed with a single send()
+  session->stats.syscalls++;
+
+  return sent;
+}
+
+//
+// IO_URING SENDER
+//
+// the packet pool is registered with the ring as one fixed buffer, and
+// every packet of a train becomes a fixed buffer write on the connected
+// session socket. the writes are submitted together and waited for in the
+// same io_uring_enter(), one call per ring full of packets. the pool moves
+// when it grows, and is registered again before the next send. every write
+// submitted is reaped before the next batch, a ring that fails to hand them
+// back is closed along with them and opened again.
+//
+
+int packet_pool_uring_register(struct packet_pool_s *pool)
+{
+  if ( (conf.uring_pool_allocs == pool->allocs) && (conf.uring_pool_allocs > 0) )
+    return 0;
+
+  if ( conf.uring_pool_allocs > 0 )
+    uring_buffers_unregister(&conf.uring);
+
+  conf.uring_pool_allocs = 0;
+
+  if ( uring_buffers_register(&conf.uring, pool->packets, (size_t)pool->length * TRAIN_PACKET_LENGTH_MAX) != 0 )
+    return 1;
+
+  conf.uring_pool_allocs = pool->allocs;
+
+  return 0;
+}
+
+int send_train_uring(struct session_s *session, const char *packets, unsigned int length, unsigned int packet_length)
+{
+  struct uring_cqe_s cqe;
+  unsigned long enters = conf.uring.enters;
+  unsigned int batch;
+  unsigned int done = 0;
+  int failed = 0;
+  int i = 0;
+  int sent = 0;
+
+  // counted apart, a uring figure must not be sendmmsg()'s
+  if ( packet_pool_uring_register(&conf.pool) != 0 )
+  {
+    if ( session->stats.uring_fallbacks++ == 0 )
+    {
+      ulog(LOG_WARN, "Unable to register packet pool with io_uring, sending with sendmmsg()\n");
+    }
+
+    return send_train_mmsg(session, packets, length, packet_length, 0);
+  }
+
+  while ( (i < length) && ! failed )
+  {
+    batch = 0;
+
+    // packets are written in submission order unless the socket would block
+    while ( (i + batch < length) && (batch < conf.uring.sq_entries) &&
+            (uring_prep_write_fixed(&conf.uring, session->udp_socket, packets + ((i + batch) * TRAIN_PACKET_LENGTH_MAX), packet_length, i + batch) == 0) )
+      batch++;
+
+    if ( batch == 0 )
+    {
+      session->stats.packets_short += length - i;
+      break;
+    }
+
+    for (done=0; done<batch; )
+    {
+      if ( uring_submit(&conf.uring, batch - done, -1) != 0 )
+      {
+        failed = 1;
+        break;
+      }
+
+      while ( (done < batch) && uring_cqe_get(&conf.uring, &cqe) )
+      {
+        done++;
+
+        if ( cqe.res == (int)packet_length )
+          sent++;
+        else
+        {
+          if ( cqe.res == -ENOBUFS )
+            session->stats.packets_enobufs++;
+          else
+            session->stats.packets_short++;
+
+          ulog(LOG_DEBUG, "Incomplete packet sent [%lu, %d < %d]\n", (unsigned long)cqe.user_data, cqe.res, packet_length);
+        }
+      }
+    }
+
+    i += done;
+  }
+
+  session->stats.syscalls += conf.uring.enters - enters;
+
+  // writes left on the ring would complete into the next batch, closing it
+  // takes them along and the rest of the train is written off
+  if ( failed )
+  {
+    ulog(LOG_WARN, "io_uring failed mid train, opening the ring again\n");
+    session->stats.packets_short += length - i;
+
+    uring_free(&conf.uring);
+    conf.uring_pool_allocs = 0;
+
+    if ( uring_init(&conf.uring, URING_ENTRIES) != 0 )
+    {
+      ulog(LOG_WARN, "Unable to open io_uring again, sending with sendmmsg()\n");
+    }
+  }
+
+  return sent;
+}
+
+const char * send_mode_literal_get(int mode)
+{
+  switch (mode)
+  {
+    case SEND_MODE_SENDTO:
+      return "sendto";
+    case SEND_MODE_MMSG:
+      return "mmsg";
+    case SEND_MODE_TXRING:
+      return "txring";
+    case SEND_MODE_GSO:
+      return "gso";
+    case SEND_MODE_ZEROCOPY:
+      return "zerocopy";
+    case SEND_MODE_URING:
+      return "uring";
+  }
+
+  return "unknown";
+}
+
+int send_mode_connected(int mode)
+{
+  // the batched modes carry no per packet address
+  return (mode == SEND_MODE_MMSG) || (mode == SEND_MODE_GSO) || (mode == SEND_MODE_ZEROCOPY) || (mode == SEND_MODE_URING);
+}
+
+
+//
+// BENCHMARK
+//
+// sends trains of maximum length and packet size at a loopback sink that
+// never reads, reporting the packet rate each send mode achieves, the CPU
+// time it spent on every packet and the system calls on every train.
+//
+
+int benchmark_send()
+{
+  struct session_s session;
+  struct dataplane_cmd_s cmd;
+  struct sockaddr_in sink_addr;
+  socklen_t len = sizeof(sink_addr);
+  struct timespec t_start, t_end;
+  struct rusage ru_start, ru_end;
+  double elapsed;
+  double cpu;
+  int sink;
+  int mode;
+  int i;
+
+  int modes[] = { SEND_MODE_SENDTO, SEND_MODE_MMSG, SEND_MODE_GSO, SEND_MODE_ZEROCOPY, SEND_MODE_URING, SEND_MODE_TXRING };
+
+  bzero(&session, sizeof(session));
+  session.tcp_fd = -1;
+
+  if ( (session.udp_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+       (sink = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
+  {
+    fprintf(stderr, "Unable to open UDP socket.\n");
+    return 1;
+  }
+
+  bzero(&sink_addr, sizeof(sink_addr));
+  sink_addr.sin_family = AF_INET;
+  sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ( bind(sink, (struct sockaddr *)&sink_addr, sizeof(sink_addr)) != 0 ||
+       getsockname(sink, (struct sockaddr *)&sink_addr, &len) != 0 )
+  {
+    fprintf(stderr, "Unable to bind to UDP socket.\n");
+    return 1;
+  }
+
+  session.udp_cli_addr = sink_addr;
+
+  fprintf(stdout, "Benchmarking %d trains of %d x %d byte packets over loopback\n", BENCH_TRAIN_COUNT, TRAIN_LENGTH_MAX, TRAIN_PACKET_LENGTH_MAX);
+  fprintf(stdout, "%-10s %12s %12s %12s %14s %10s %10s\n", "mode", "packets/s", "Mbps", "cpu ns/pkt", "syscalls/train", "short", "enobufs");
+
+  for (mode=0; mode<sizeof(modes)/sizeof(int); mode++)
+  {
+    conf.send_mode = modes[mode];
+
+    // the raw sender needs CAP_NET_RAW, skip it rather than fail
+    if ( conf.send_mode == SEND_MODE_TXRING &&
+         txring_open(&conf.txring, "lo") != 0 )
+    {
+      fprintf(stdout, "%-10s %12s\n", send_mode_literal_get(conf.send_mode), "unavailable");
+      continue;
+    }
+
+    // as is io_uring on a kernel without it, or a build left without
+    if ( conf.send_mode == SEND_MODE_URING &&
+         uring_init(&conf.uring, URING_ENTRIES) != 0 )
+    {
+      fprintf(stdout, "%-10s %12s\n", send_mode_literal_get(conf.send_mode), "unavailable");
+      continue;
+    }
+
+    bzero(&session.stats, sizeof(session.stats));
+    session_udp_connect(&session, &sink_addr);
+
+    if ( conf.send_mode == SEND_MODE_ZEROCOPY &&
+         session_zerocopy_enable(&session) != 0 )
+    {
+      fprintf(stdout, "%-10s %12s\n", send_mode_literal_get(conf.send_mode), "unavailable");
+      session_udp_connect(&session, NULL);
+      continue;
+    }
+
+    getrusage(RUSAGE_SELF, &ru_start);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    bzero(&cmd, sizeof(cmd));
+    cmd.type = DATAPLANE_CMD_TRAIN;
+    cmd.session = &session;
+    cmd.length = TRAIN_LENGTH_MAX;
+    cmd.packet_length = TRAIN_PACKET_LENGTH_MAX;
+
+    for (i=0; i<BENCH_TRAIN_COUNT; i++)
+    {
+      cmd.train_id = i + 1;
+      send_train(&cmd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    getrusage(RUSAGE_SELF, &ru_end);
+    session_udp_connect(&session, NULL);
+
+    elapsed = (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+
+    // user and system time, the kernel's share is most of a send
+    cpu = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) + (ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) / 1e6 +
+          (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) + (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec) / 1e6;
+
+    // trains that went out through sendmmsg() say nothing about io_uring
+    if ( session.stats.uring_fallbacks > 0 )
+    {
+      fprintf(stdout, "%-10s %12s (%lu trains sent with sendmmsg())\n", send_mode_literal_get(conf.send_mode),
+              "unavailable", session.stats.uring_fallbacks);
+      continue;
+    }
+
+    fprintf(stdout, "%-10s %12.0f %12.2f %12.1f %14.2f %10lu %10lu\n", send_mode_literal_get(conf.send_mode),
+            (double)session.stats.packets / elapsed, (double)(session.stats.bytes << 3) / elapsed / 1e6,
+            session.stats.packets > 0 ? cpu * 1e9 / (double)session.stats.packets : 0.0,
+            (double)session.stats.syscalls / (double)BENCH_TRAIN_COUNT,
+            session.stats.packets_short, session.stats.packets_enobufs);
+  }
+
+  uring_free(&conf.uring);
+  conf.uring_pool_allocs = 0;
+
+  close(sink);
+  close(session.udp_socket);
+
+  txring_close(&conf.txring);
+  packet_pool_free(&conf.pool);
+  packet_pool_free(&conf.pool_spare);
 
   return 0;
 }
 
 
+//
+// HOST CAPABILITY
+//
+// before serving anyone each worker sends a few trains to itself over
+// loopback, unpaced, to learn how fast it can put a train on the wire. the
+// client weighs its estimate against this and its own receive rate, a path
+// faster than either host is only ever measured as fast as the hosts.
+//
+
+double host_send_rate_measure()
+{
+  struct session_s session;
+  struct sockaddr_in sink_addr;
+  socklen_t len = sizeof(sink_addr);
+  struct timespec t_start, t_end;
+  double rates[HOST_CALIBRATE_TRAINS];
+  double rates_ordered[HOST_CALIBRATE_TRAINS];
+  char buffer[TRAIN_PACKET_LENGTH_MAX];
+  char *packets;
+  double rate;
+  int sink;
+  int sent;
+  int i;
+
+  bzero(&session, sizeof(session));
+  session.tcp_fd = -1;
+
+  if ( (session.udp_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
+    return 0.0;
+
+  if ( (sink = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0 )
+  {
+    close(session.udp_socket);
+    return 0.0;
+  }
+
+  bzero(&sink_addr, sizeof(sink_addr));
+  sink_addr.sin_family = AF_INET;
+  sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ( bind(sink, (struct sockaddr *)&sink_addr, sizeof(sink_addr)) != 0 ||
+       getsockname(sink, (struct sockaddr *)&sink_addr, &len) != 0 )
+  {
+    close(sink);
+    close(session.udp_socket);
+    return 0.0;
+  }
+
+  session.udp_cli_addr = sink_addr;
+  session_udp_connect(&session, &sink_addr);
+
+  for (i=0; i<HOST_CALIBRATE_TRAINS; i++)
+  {
+    if ( (packets = packet_pool_train(&conf.pool, i + 1, TRAIN_LENGTH_MAX)) == NULL )
+      break;
+
+    pace_now(&t_start);
+
+    // the socket path of the send mode, the raw sender goes through mmsg until
+    // it knows a client's next hop
+    if ( conf.send_mode == SEND_MODE_SENDTO )
+      sent = send_train_sendto(&session, packets, TRAIN_LENGTH_MAX, TRAIN_PACKET_LENGTH_MAX);
+    else if ( conf.send_mode == SEND_MODE_GSO )
+      sent = send_train_gso(&session, packets, TRAIN_LENGTH_MAX, TRAIN_PACKET_LENGTH_MAX);
+    else if ( conf.send_mode == SEND_MODE_URING )
+      sent = send_train_uring(&session, packets, TRAIN_LENGTH_MAX, TRAIN_PACKET_LENGTH_MAX);
+    else
+      sent = send_train_mmsg(&session, packets, TRAIN_LENGTH_MAX, TRAIN_PACKET_LENGTH_MAX, 0);
+
+    pace_now(&t_end);
+
+    rates[i] = (double)((sent * TRAIN_PACKET_LENGTH_MAX) << 3) / time_delta_ts_us(t_start, t_end);
+
+    // keep the sink from overflowing, a drop costs less than a delivery
+    while ( recv(sink, buffer, sizeof(buffer), 0) > 0 );
+  }
+
+  session_udp_connect(&session, NULL);
+  close(sink);
+  close(session.udp_socket);
+
+  if ( i == 0 )
+    return 0.0;
+
+  array_sort(rates, rates_ordered, i);
+  rate = rates_ordered[i / 2];
+
+  // pacing packets apart caps every train at that rate
+  if ( (conf.packet_spacing > 0) && (rate > (double)(TRAIN_PACKET_LENGTH_MAX << 3) / conf.packet_spacing) )
+    rate = (double)(TRAIN_PACKET_LENGTH_MAX << 3) / conf.packet_spacing;
+
+  return rate;
+}
+
+
 int exit_clean()
 {
-  free(conf.random_packet);
+  int i;
+
+  // nothing may still be sending when the sessions and pool go
+  dataplane_stop(&conf.dataplane);
+
+  for (i=0; i<conf.sessions_count; i++)
+    session_destroy(conf.sessions[i]);
+
+  close(conf.epoll_fd);
+  close(conf.tcp_socket);
+
+  packet_pool_free(&conf.pool);
+  packet_pool_free(&conf.pool_spare);
+  slot_free(&conf.slot);
+  timer_wheel_free(&conf.timers);
+  metrics_free(&conf.metrics);
+
+  if ( conf.send_mode == SEND_MODE_TXRING )
+    txring_close(&conf.txring);
+
+  if ( conf.send_mode == SEND_MODE_URING )
+    uring_free(&conf.uring);
 
   return 0;
 }
@@ -1,5 +1,306 @@
 #ifndef LOCOD_H
 #define LOCOD_H
 
+#include <stdint.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+#include "pace.h"
+#include "slot.h"
+#include "txring.h"
+#include "timer.h"
+#include "metrics.h"
+#include "xtraffic.h"
+#include "uring.h"
+#include "spsc.h"
+
+// longest train we will ever build for a client
+#define TRAIN_POOL_LENGTH_LIMIT 4096
+
+// trains sent per mode when benchmarking
+#define BENCH_TRAIN_COUNT 20000
+
+// concurrent sessions served by one daemon
+#define SESSION_COUNT_MAX 64
+#define SESSION_EVENTS_MAX 64
+
+// forked workers sharing the control port
+#define WORKER_COUNT_MAX 64
+
+// control bytes buffered per session until a full message arrives
+#define SESSION_CTL_BUFFER_SIZE 256
+
+// control bytes held per session while the client's socket is full, room
+// for the messages of two of the longest trains
+#define SESSION_OUT_BUFFER_SIZE (8 * TRAIN_POOL_LENGTH_LIMIT)
+
+// resend the end of a train until the client acknowledges it, backing off
+// from the first timeout and ending the session once retries run out
+#define SESSION_ACK_TIMEOUT_MS  500
+#define SESSION_ACK_RETRIES_MAX 5
+
+// end a session whose client has gone quiet and has nothing in flight
+#define SESSION_IDLE_TIMEOUT_S 60
+
+// TRAIN ACKNOWLEDGEMENT STATES
+#define ACK_STATE_IDLE 0
+#define ACK_STATE_WAIT 1
+
+// how long to wait for a train's transmit timestamps
+#define TX_STAMP_WAIT_US 2000
+
+// TRAIN SEND MODES
+#define SEND_MODE_SENDTO   0
+#define SEND_MODE_MMSG     1
+#define SEND_MODE_TXRING   2
+#define SEND_MODE_GSO      3
+#define SEND_MODE_ZEROCOPY 4
+#define SEND_MODE_URING    5
+
+// kernel bookkeeping charged to the send buffer per datagram, on top of
+// its payload [bytes], and the most we will ask for on any one socket
+#define SNDBUF_PACKET_OVERHEAD 768
+#define SNDBUF_SIZE_MAX        (16 * 1024 * 1024)
+
+// DATA PLANE COMMANDS
+#define DATAPLANE_CMD_TRAIN   1
+#define DATAPLANE_CMD_MARKER  2
+#define DATAPLANE_CMD_STOP    3
+#define DATAPLANE_CMD_RELEASE 4
+
+// commands in flight per worker, at most a train and a marker per session
+#define DATAPLANE_QUEUE_SIZE 256
+
+// control messages a train leaves for the event loop, the gaps of the
+// longest train followed by its MSG_TRAIN_DROPPED and MSG_TRAIN_SENT
+#define DATAPLANE_MESSAGES_MAX (TRAIN_POOL_LENGTH_LIMIT + 2)
+
+// segments handed to the stack per UDP_SEGMENT send, kept under 64KB
+#define GSO_SEGMENTS_MAX 64
+#define GSO_BYTES_MAX    65000
+
+struct packet_pool_s
+{
+  // contiguous slots of TRAIN_PACKET_LENGTH_MAX bytes
+  char *packets;
+  unsigned int length;
+
+  // heap allocations made by the pool, total and after start up
+  unsigned int allocs;
+  unsigned int send_allocs;
+
+  // train ID currently written into every slot
+  uint32_t train_id;
+
+  // zerocopy sends, of any session, still holding pages of the slots
+  unsigned int pinned;
+};
+
+struct plan_entry_s
+{
+  unsigned int length;
+  unsigned int packet_length;
+  double spacing;
+
+  // trains sent with these parameters
+  unsigned int count;
+};
+
+struct session_s;
+
+// a train or marker for the data plane, handed back unchanged once sent
+struct dataplane_cmd_s
+{
+  int type;
+  struct session_s *session;
+
+  // taken from the session when queued, the control thread moves on
+  uint32_t train_id;
+  unsigned int length;
+  unsigned int packet_length;
+
+  // when the train is due, and whether it is paced off the previous one
+  struct timespec release;
+  int paced;
+
+  // part of a plan, streamed on without an acknowledgement
+  int plan;
+
+  // end of the slot granted on the link, the train should be out by then
+  struct timespec slot_end;
+
+  // a rate chirp, with its rate and spread as they stood when queued
+  int chirp;
+  double chirp_rate;
+  double chirp_spread;
+
+  // sequence number a marker carries
+  uint32_t marker_seq;
+};
+
+struct dataplane_s
+{
+  pthread_t thread;
+  int running;
+
+  // commands from the control thread, and the same commands once done
+  struct spsc_s commands;
+  struct spsc_s completions;
+
+  // eventfds waking each side when its queue gains an entry
+  int command_fd;
+  int completion_fd;
+};
+
+struct send_stats_s
+{
+  unsigned long trains;
+  unsigned long packets;
+  unsigned long bytes;
+
+  // packets that left partially or not at all
+  unsigned long packets_short;
+  unsigned long packets_enobufs;
+
+  // trains that lost packets on the way out, reported to the client as such
+  unsigned long trains_dropped;
+
+  // trains sent without a full set of transmit timestamps
+  unsigned long trains_unstamped;
+
+  // measurement plans streamed to completion
+  unsigned long plans;
+
+  // zerocopy sends completed, and those the kernel had to copy anyway
+  unsigned long zerocopy_completed;
+  unsigned long zerocopy_copied;
+
+  // trains copied from the spare pool while the kernel held the pool's pages
+  unsigned long zerocopy_spared;
+
+  // system calls made handing trains to the kernel
+  unsigned long syscalls;
+
+  // trains sent with sendmmsg() as the pool could not be registered with io_uring
+  unsigned long uring_fallbacks;
+
+  // trains still being sent when their granted slot ended
+  unsigned long slots_overrun;
+};
+
+struct session_s
+{
+  int fsm_state;
+
+  // control channel
+  int tcp_fd;
+  struct sockaddr_in tcp_cli_addr;
+  char host[INET_ADDRSTRLEN];
+
+  unsigned char ctl_buffer[SESSION_CTL_BUFFER_SIZE];
+  int ctl_buffer_length;
+
+  // control bytes the socket had no room for, written out on EPOLLOUT
+  unsigned char out_buffer[SESSION_OUT_BUFFER_SIZE];
+  int out_buffer_length;
+  int out_waiting;
+
+  // train destination
+  int udp_socket;
+  struct sockaddr_in udp_cli_addr;
+  int udp_cli_port;
+  struct sockaddr_in udp_local_addr;
+
+  // send buffer granted, grown to hold the largest train asked for [bytes]
+  int udp_sndbuf;
+
+  // commands queued on the data plane and not yet handed back, while any
+  // are the data thread owns the socket and the send side of the session
+  unsigned int dataplane_pending;
+
+  // a train asked for before the previous one was handed back
+  int train_deferred;
+
+  // control messages left by the data thread, only the event loop writes
+  // to the control channel and sends them once the train is handed back
+  uint32_t dataplane_messages[DATAPLANE_MESSAGES_MAX];
+  unsigned int dataplane_messages_count;
+
+  // next hop of the client, for the raw sender
+  unsigned char txring_mac[TXRING_ETH_ALEN];
+  int txring_mac_valid;
+
+  // transmit timestamping
+  int tx_stamp;
+
+  // MSG_ZEROCOPY sends still holding pages of the packet pool
+  int zerocopy;
+  unsigned int zerocopy_pending;
+
+  // train description
+  uint32_t train_id;
+
+  double train_spacing;
+  double train_spacing_min;
+  double train_spacing_max;
+
+  unsigned int train_length;
+  unsigned int train_length_max;
+
+  unsigned int train_packet_length;
+  unsigned int train_packet_length_min;
+  unsigned int train_packet_length_max;
+
+  int train_schedule;
+
+  // rate chirp: the rate of its last gap [Mbps], the ratio between
+  // consecutive gaps, and whether the pending train is one
+  double chirp_rate;
+  double chirp_spread;
+  int train_chirp;
+
+  // end of the previous train, for pacing the next one
+  struct timespec train_sent_last;
+  int train_sent_last_valid;
+
+  // a train held back until its release time
+  int train_pending;
+  int train_paced;
+  struct timespec train_release;
+  struct timespec train_slot_end;
+
+  // measurement plan uploaded by the client, and our place in it
+  struct plan_entry_s plan[PLAN_ENTRIES_MAX];
+  int plan_count;
+  int plan_active;
+  int plan_entry;
+  unsigned int plan_remaining;
+
+  // link admission
+  struct slot_session_s slot;
+
+  // acknowledgement of the last train sent
+  int ack_state;
+  int ack_retries;
+  struct timespec ack_deadline;
+
+  // train release, acknowledgement and idle deadlines on the worker's wheel
+  struct timer_s release_timer;
+  struct timer_s ack_timer;
+  struct timer_s idle_timer;
+
+  // sequence number of the last end of train marker
+  uint32_t marker_seq;
+
+  // fastest the client can timestamp a train, as it measured [Mbps]
+  unsigned int host_receive_rate;
+
+  // statistics
+  struct send_stats_s stats;
+  struct pace_stats_s pace_trains;
+  struct pace_stats_s pace_packets;
+};
 
 #endif  /* LOCOD_H */
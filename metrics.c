@@ -0,0 +1,427 @@
+#include "metrics.h"
+#include "common.h"
+#include "debug.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+//
+// METRICS
+//
+// counters and latency histograms live in shared memory, one block per
+// worker, created before any fork. each worker only ever writes its own
+// block so the hot path takes no locks. whichever worker serves scrapes
+// reads every block as it stands, a value a moment stale being harmless.
+//
+// scrapes are answered in the Prometheus text format over a short lived
+// HTTP/1.0 connection, on a loopback TCP port or a Unix socket. they share
+// the worker's event loop with its sessions, so a scrape is only ever read
+// and written as far as its socket allows and never holds the loop up.
+//
+
+static void metrics_conn_close(struct metrics_conn_s *conn);
+static int metrics_respond(struct metrics_s *metrics, struct metrics_conn_s *conn);
+
+int metrics_init(struct metrics_s *metrics, int workers_count)
+{
+  size_t size = sizeof(struct metrics_worker_s) * workers_count;
+  int i;
+
+  metrics->fd = -1;
+  metrics->conns_seq = 0;
+
+  for (i=0; i<METRICS_CONN_MAX; i++)
+  {
+    metrics->conns[i].fd = -1;
+    metrics->conns[i].state = METRICS_CONN_FREE;
+    metrics->conns[i].response = NULL;
+  }
+  metrics->workers_count = workers_count;
+  metrics->workers = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if ( metrics->workers == MAP_FAILED )
+  {
+    metrics->workers = NULL;
+    metrics->self = NULL;
+    return 1;
+  }
+
+  bzero(metrics->workers, size);
+  metrics->self = &metrics->workers[0];
+
+  return 0;
+}
+
+void metrics_free(struct metrics_s *metrics)
+{
+  int i;
+
+  for (i=0; i<METRICS_CONN_MAX; i++)
+    metrics_conn_close(&metrics->conns[i]);
+
+  if ( metrics->fd >= 0 )
+    close(metrics->fd);
+
+  if ( NULL != metrics->workers )
+    munmap(metrics->workers, sizeof(struct metrics_worker_s) * metrics->workers_count);
+
+  metrics->fd = -1;
+  metrics->workers = NULL;
+  metrics->self = NULL;
+}
+
+void metrics_worker_set(struct metrics_s *metrics, int worker_id)
+{
+  metrics->self = &metrics->workers[worker_id % metrics->workers_count];
+}
+
+int metrics_listen(struct metrics_s *metrics, const char *address)
+{
+  struct sockaddr_in addr_in;
+  struct sockaddr_un addr_un;
+  char *end;
+  long port;
+  int opt = 1;
+
+  port = strtol(address, &end, 10);
+
+  // a bare number is a loopback port, anything else a socket path
+  if ( *end == '\0' )
+  {
+    if ( (port <= 0) || (port > 65535) )
+      return 1;
+
+    if ( (metrics->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 )
+      return 1;
+
+    setsockopt(metrics->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    bzero(&addr_in, sizeof(addr_in));
+    addr_in.sin_family = AF_INET;
+    addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr_in.sin_port = htons((unsigned short)port);
+
+    if ( bind(metrics->fd, (struct sockaddr *)&addr_in, sizeof(addr_in)) != 0 )
+    {
+      close(metrics->fd);
+      metrics->fd = -1;
+      return 1;
+    }
+  }
+  else
+  {
+    if ( strlen(address) >= sizeof(addr_un.sun_path) )
+      return 1;
+
+    if ( (metrics->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 )
+      return 1;
+
+    bzero(&addr_un, sizeof(addr_un));
+    addr_un.sun_family = AF_UNIX;
+    strcpy(addr_un.sun_path, address);
+
+    // a socket left behind by an earlier run
+    unlink(address);
+
+    if ( bind(metrics->fd, (struct sockaddr *)&addr_un, sizeof(addr_un)) != 0 )
+    {
+      close(metrics->fd);
+      metrics->fd = -1;
+      return 1;
+    }
+  }
+
+  if ( listen(metrics->fd, 8) != 0 )
+  {
+    close(metrics->fd);
+    metrics->fd = -1;
+    return 1;
+  }
+
+  return 0;
+}
+
+void metrics_hist_record(struct metrics_hist_s *hist, const struct timespec *start, const struct timespec *end)
+{
+  double us = time_delta_ts_us(*start, *end);
+  double bound = 1.0;
+  int i = 0;
+
+  while ( (i < METRICS_HIST_BUCKETS - 1) && (us > bound) )
+  {
+    bound *= 2.0;
+    i++;
+  }
+
+  hist->buckets[i]++;
+  hist->count++;
+  hist->sum_us += us;
+}
+
+static int metrics_printf(char *buffer, size_t size, size_t *length, const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  if ( *length >= size )
+    return 1;
+
+  va_start(ap, format);
+  n = vsnprintf(buffer + *length, size - *length, format, ap);
+  va_end(ap);
+
+  if ( n < 0 )
+    return 1;
+
+  *length += n;
+
+  return 0;
+}
+
+static void metrics_counter_write(struct metrics_s *metrics, char *buffer, size_t size, size_t *length,
+                                  const char *name, const char *help, size_t offset)
+{
+  int w;
+
+  metrics_printf(buffer, size, length, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+
+  for (w=0; w<metrics->workers_count; w++)
+    metrics_printf(buffer, size, length, "%s{worker=\"%d\"} %lu\n", name, w,
+                   *(unsigned long *)((char *)&metrics->workers[w] + offset));
+}
+
+static void metrics_gauge_write(struct metrics_s *metrics, char *buffer, size_t size, size_t *length,
+                                const char *name, const char *help, size_t offset)
+{
+  int w;
+
+  metrics_printf(buffer, size, length, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+
+  for (w=0; w<metrics->workers_count; w++)
+    metrics_printf(buffer, size, length, "%s{worker=\"%d\"} %ld\n", name, w,
+                   *(long *)((char *)&metrics->workers[w] + offset));
+}
+
+static void metrics_hist_write(struct metrics_s *metrics, char *buffer, size_t size, size_t *length,
+                               const char *name, const char *help, size_t offset)
+{
+  struct metrics_hist_s *hist;
+  unsigned long cumulative;
+  double bound;
+  int w, i;
+
+  metrics_printf(buffer, size, length, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+  for (w=0; w<metrics->workers_count; w++)
+  {
+    hist = (struct metrics_hist_s *)((char *)&metrics->workers[w] + offset);
+    cumulative = 0;
+    bound = 1.0;
+
+    for (i=0; i<METRICS_HIST_BUCKETS - 1; i++, bound*=2.0)
+    {
+      cumulative += hist->buckets[i];
+      metrics_printf(buffer, size, length, "%s_bucket{worker=\"%d\",le=\"%g\"} %lu\n", name, w, bound / 1e6, cumulative);
+    }
+
+    cumulative += hist->buckets[i];
+    metrics_printf(buffer, size, length, "%s_bucket{worker=\"%d\",le=\"+Inf\"} %lu\n", name, w, cumulative);
+    metrics_printf(buffer, size, length, "%s_sum{worker=\"%d\"} %.9f\n", name, w, hist->sum_us / 1e6);
+    metrics_printf(buffer, size, length, "%s_count{worker=\"%d\"} %lu\n", name, w, hist->count);
+  }
+}
+
+#define METRICS_COUNTER(name, help, field) \
+  metrics_counter_write(metrics, body, sizeof(body), &length, name, help, offsetof(struct metrics_worker_s, field))
+
+#define METRICS_GAUGE(name, help, field) \
+  metrics_gauge_write(metrics, body, sizeof(body), &length, name, help, offsetof(struct metrics_worker_s, field))
+
+#define METRICS_HIST(name, help, field) \
+  metrics_hist_write(metrics, body, sizeof(body), &length, name, help, offsetof(struct metrics_worker_s, field))
+
+void metrics_serve(struct metrics_s *metrics, int epoll_fd)
+{
+  struct metrics_conn_s *conn;
+  struct epoll_event event;
+  int fd, i;
+
+  while ( (fd = accept4(metrics->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 )
+  {
+    conn = NULL;
+
+    // a free slot, or else the scrape that has had longest to finish
+    for (i=0; (i<METRICS_CONN_MAX) && (NULL == conn); i++)
+      if ( metrics->conns[i].state == METRICS_CONN_FREE )
+        conn = &metrics->conns[i];
+
+    for (i=0; (i<METRICS_CONN_MAX) && (NULL == conn || conn->state != METRICS_CONN_FREE); i++)
+      if ( (NULL == conn) || (metrics->conns[i].seq < conn->seq) )
+        conn = &metrics->conns[i];
+
+    metrics_conn_close(conn);
+
+    conn->fd = fd;
+    conn->state = METRICS_CONN_READING;
+    conn->request_length = 0;
+    conn->seq = ++metrics->conns_seq;
+
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+
+    if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0 )
+      metrics_conn_close(conn);
+  }
+}
+
+struct metrics_conn_s * metrics_conn_get(struct metrics_s *metrics, void *ptr)
+{
+  struct metrics_conn_s *conn = (struct metrics_conn_s *)ptr;
+
+  if ( (conn >= &metrics->conns[0]) && (conn < &metrics->conns[METRICS_CONN_MAX]) )
+    return conn;
+
+  return NULL;
+}
+
+void metrics_conn_run(struct metrics_s *metrics, struct metrics_conn_s *conn, int epoll_fd)
+{
+  struct epoll_event event;
+  ssize_t n;
+
+  if ( conn->state == METRICS_CONN_READING )
+  {
+    n = read(conn->fd, conn->request + conn->request_length, sizeof(conn->request) - 1 - conn->request_length);
+
+    if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) )
+      return;
+
+    if ( n < 0 )
+    {
+      metrics_conn_close(conn);
+      return;
+    }
+
+    conn->request_length += n;
+    conn->request[conn->request_length] = '\0';
+
+    // answered at the end of the request headers, or of what we will read
+    if ( (n > 0) && (conn->request_length < sizeof(conn->request) - 1) &&
+         (NULL == strstr(conn->request, "\r\n\r\n")) && (NULL == strstr(conn->request, "\n\n")) )
+      return;
+
+    event.events = EPOLLOUT;
+    event.data.ptr = conn;
+
+    if ( (metrics_respond(metrics, conn) != 0) ||
+         (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) != 0) )
+    {
+      ulog(LOG_DEBUG, "Unable to answer metrics scrape.\n");
+      metrics_conn_close(conn);
+      return;
+    }
+
+    conn->state = METRICS_CONN_WRITING;
+  }
+
+  // there is usually room for it all straight away
+  while ( conn->response_offset < conn->response_length )
+  {
+    n = write(conn->fd, conn->response + conn->response_offset, conn->response_length - conn->response_offset);
+
+    if ( n < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+        return;
+
+      ulog(LOG_DEBUG, "Unable to answer metrics scrape.\n");
+      break;
+    }
+
+    conn->response_offset += n;
+  }
+
+  metrics_conn_close(conn);
+}
+
+static void metrics_conn_close(struct metrics_conn_s *conn)
+{
+  // closing the descriptor also removes it from the event loop
+  if ( conn->fd >= 0 )
+    close(conn->fd);
+
+  free(conn->response);
+
+  conn->fd = -1;
+  conn->state = METRICS_CONN_FREE;
+  conn->response = NULL;
+}
+
+static int metrics_respond(struct metrics_s *metrics, struct metrics_conn_s *conn)
+{
+  static char body[METRICS_BODY_SIZE];
+  char header[128];
+  size_t header_length;
+  size_t length = 0;
+
+  METRICS_COUNTER("locod_sessions_accepted_total", "Sessions accepted.", sessions_accepted);
+  METRICS_GAUGE("locod_sessions_active", "Sessions currently open.", sessions_active);
+  METRICS_COUNTER("locod_control_messages_total", "Control messages handled.", control_messages);
+  METRICS_COUNTER("locod_trains_sent_total", "Trains sent.", trains);
+  METRICS_COUNTER("locod_trains_refused_total", "Trains refused by the slot scheduler.", trains_refused);
+  METRICS_COUNTER("locod_packets_sent_total", "Train packets sent.", packets);
+  METRICS_COUNTER("locod_bytes_sent_total", "Train bytes sent.", bytes);
+  METRICS_COUNTER("locod_packets_short_total", "Train packets sent partially or not at all.", packets_short);
+  METRICS_COUNTER("locod_packets_enobufs_total", "Train packets dropped with ENOBUFS.", packets_enobufs);
+  METRICS_COUNTER("locod_trains_dropped_total", "Trains that lost packets on the way out.", trains_dropped);
+  METRICS_COUNTER("locod_trains_overrun_total", "Trains still being sent when their slot ended.", trains_overrun);
+
+  METRICS_HIST("locod_control_handle_seconds", "Time spent handling one control message.", control_handle);
+  METRICS_HIST("locod_train_build_seconds", "Time spent building a train in the packet pool.", train_build);
+  METRICS_HIST("locod_train_send_seconds", "Time spent handing a train to the kernel.", train_send);
+
+  // a truncated body ends mid line, which would fail the whole scrape, so
+  // it is cut back to its last full line
+  if ( length >= sizeof(body) )
+  {
+    length = sizeof(body) - 1;
+
+    while ( (length > 0) && (body[length - 1] != '\n') )
+      length--;
+
+    ulog(LOG_WARN, "Metrics exceed %d bytes, scrape truncated\n", METRICS_BODY_SIZE);
+  }
+
+  snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                   "Content-Type: text/plain; version=0.0.4\r\n"
+                                   "Content-Length: %zu\r\n\r\n", length);
+
+  header_length = strlen(header);
+
+  if ( (conn->response = malloc(header_length + length)) == NULL )
+    return 1;
+
+  memcpy(conn->response, header, header_length);
+  memcpy(conn->response + header_length, body, length);
+
+  conn->response_length = header_length + length;
+  conn->response_offset = 0;
+
+  return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+
+// latency buckets double from 1us, the last catching everything above
+#define METRICS_HIST_BUCKETS 18
+
+// bytes of the request read before answering a scrape regardless
+#define METRICS_REQUEST_SIZE 1024
+
+// scrapes served at once, the oldest giving way to a new one
+#define METRICS_CONN_MAX 4
+
+// SCRAPE CONNECTION STATES
+#define METRICS_CONN_FREE    0
+#define METRICS_CONN_READING 1
+#define METRICS_CONN_WRITING 2
+
+// room for the full exposition of every worker
+#define METRICS_BODY_SIZE (512 * 1024)
+
+struct metrics_hist_s
+{
+  unsigned long buckets[METRICS_HIST_BUCKETS];
+  unsigned long count;
+  double sum_us;
+};
+
+struct metrics_worker_s
+{
+  unsigned long sessions_accepted;
+  long sessions_active;
+  unsigned long control_messages;
+
+  unsigned long trains;
+  unsigned long trains_refused;
+  unsigned long packets;
+  unsigned long bytes;
+  unsigned long packets_short;
+  unsigned long packets_enobufs;
+  unsigned long trains_dropped;
+  unsigned long trains_overrun;
+
+  struct metrics_hist_s control_handle;
+  struct metrics_hist_s train_build;
+  struct metrics_hist_s train_send;
+};
+
+// one scrape, read and answered as its socket allows
+struct metrics_conn_s
+{
+  int fd;
+  int state;
+
+  // request as read so far, only ever searched for its end
+  char request[METRICS_REQUEST_SIZE];
+  size_t request_length;
+
+  // header and body, and how much of them has been written
+  char *response;
+  size_t response_length;
+  size_t response_offset;
+
+  // order accepted in, for picking the oldest
+  unsigned long seq;
+};
+
+struct metrics_s
+{
+  // one block per worker in shared memory, each written only by its owner
+  struct metrics_worker_s *workers;
+  int workers_count;
+  struct metrics_worker_s *self;
+
+  // scrape listener, -1 when not serving, and the scrapes it accepted
+  int fd;
+  struct metrics_conn_s conns[METRICS_CONN_MAX];
+  unsigned long conns_seq;
+};
+
+// PUBLIC FUNCTIONS
+int metrics_init(struct metrics_s *metrics, int workers_count);
+void metrics_free(struct metrics_s *metrics);
+void metrics_worker_set(struct metrics_s *metrics, int worker_id);
+
+int metrics_listen(struct metrics_s *metrics, const char *address);
+void metrics_serve(struct metrics_s *metrics, int epoll_fd);
+struct metrics_conn_s * metrics_conn_get(struct metrics_s *metrics, void *ptr);
+void metrics_conn_run(struct metrics_s *metrics, struct metrics_conn_s *conn, int epoll_fd);
+
+void metrics_hist_record(struct metrics_hist_s *hist, const struct timespec *start, const struct timespec *end);
+
+#endif /* METRICS_H */
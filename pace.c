@@ -0,0 +1,130 @@
+#include "pace.h"
+#include "common.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+
+//
+// PACING ENGINE
+//
+// deadlines are honoured with a hybrid wait. we sleep with clock_nanosleep()
+// until shortly before the deadline and then busy-wait the remainder, the
+// sleep being cut short by the scheduler wake up slack measured at startup.
+//
+
+void pace_init(struct pace_s *pace)
+{
+  bzero(pace, sizeof(struct pace_s));
+
+  pace->slack_ns = PACE_SLACK_MAX_NS;
+}
+
+void pace_calibrate(struct pace_s *pace)
+{
+  struct timespec deadline;
+  struct timespec now;
+  double overshoot[PACE_CALIBRATE_COUNT];
+  double overshoot_ordered[PACE_CALIBRATE_COUNT];
+  int i;
+
+  for (i=0; i<PACE_CALIBRATE_COUNT; i++)
+  {
+    pace_now(&deadline);
+    timespec_add_ns(&deadline, PACE_CALIBRATE_SLEEP_NS);
+
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR );
+
+    pace_now(&now);
+    overshoot[i] = time_delta_ts_us(deadline, now) * 1000.0;
+  }
+
+  // take the 90th percentile so the odd long wake up costs a little spinning
+  array_sort(overshoot, overshoot_ordered, PACE_CALIBRATE_COUNT);
+
+  pace->slack_ns = (long)overshoot_ordered[(PACE_CALIBRATE_COUNT * 9) / 10];
+
+  if ( pace->slack_ns > PACE_SLACK_MAX_NS )
+    pace->slack_ns = PACE_SLACK_MAX_NS;
+
+  ulog(LOG_INFO, "Pacing wake up slack: %ldns\n", pace->slack_ns);
+}
+
+void pace_now(struct timespec *now)
+{
+  clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+int pace_wait_until(struct pace_s *pace, const struct timespec *deadline)
+{
+  struct timespec now;
+  struct timespec wake;
+
+  pace_now(&now);
+
+  // already late, nothing to wait for
+  if ( timespec_cmp(&now, deadline) >= 0 )
+    return 1;
+
+  // sleep for the bulk of the wait
+  wake = *deadline;
+  timespec_add_ns(&wake, -pace->slack_ns);
+
+  if ( timespec_cmp(&now, &wake) < 0 )
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR );
+
+  // and spin for the precise remainder
+  do
+  {
+    pace_now(&now);
+  }
+  while ( timespec_cmp(&now, deadline) < 0 );
+
+  return 0;
+}
+
+void pace_record(struct pace_stats_s *stats, double requested_us, double achieved_us)
+{
+  double error = achieved_us - requested_us;
+
+  stats->count++;
+  stats->error_total += error;
+
+  if ( error > stats->error_max )
+    stats->error_max = error;
+}
+
+double pace_stats_error_mean(const struct pace_stats_s *stats)
+{
+  if ( stats->count == 0 )
+    return 0.0;
+
+  return stats->error_total / (double)stats->count;
+}
+
+//
+// POISSON SPACING
+//
+// draws a gap from an exponential distribution shifted to start at the
+// minimum spacing and truncated at the maximum. sampling at exponential
+// intervals keeps the trains from aliasing with periodic cross traffic
+// (PASTA), the truncation keeps the gaps inside the negotiated range.
+//
+
+double pace_spacing_poisson(double spacing_min, double spacing_max)
+{
+  double range = spacing_max - spacing_min;
+  double mean = range / 2.0;
+  double u;
+
+  if ( range <= 0 )
+    return spacing_min;
+
+  u = (double)random() / ((double)RAND_MAX + 1.0);
+
+  // inverse of the truncated exponential distribution function
+  return spacing_min - mean * log(1.0 - u * (1.0 - exp(-range / mean)));
+}
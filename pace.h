@@ -0,0 +1,41 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <time.h>
+
+// number of sleeps used to calibrate the wake up slack
+#define PACE_CALIBRATE_COUNT 64
+#define PACE_CALIBRATE_SLEEP_NS 100000
+
+// never busy-wait longer than this, even on a sloppy timer
+#define PACE_SLACK_MAX_NS 2000000
+
+struct pace_stats_s
+{
+  // waits performed and deadlines that had already passed
+  unsigned long count;
+  unsigned long late;
+
+  // achieved minus requested spacing [us]
+  double error_total;
+  double error_max;
+};
+
+struct pace_s
+{
+  // how early we wake up from sleeping to busy-wait the remainder
+  long slack_ns;
+};
+
+// PUBLIC FUNCTIONS
+void pace_init(struct pace_s *pace);
+void pace_calibrate(struct pace_s *pace);
+
+void pace_now(struct timespec *now);
+int pace_wait_until(struct pace_s *pace, const struct timespec *deadline);
+void pace_record(struct pace_stats_s *stats, double requested_us, double achieved_us);
+double pace_stats_error_mean(const struct pace_stats_s *stats);
+
+double pace_spacing_poisson(double spacing_min, double spacing_max);
+
+#endif /* PACE_H */
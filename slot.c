@@ -0,0 +1,163 @@
+#include "slot.h"
+#include "common.h"
+#include "debug.h"
+
+#include <sys/mman.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+
+//
+// SLOT SCHEDULER
+//
+// trains from every session, and every worker, are admitted onto the link
+// one at a time. each train is granted a slot sized from its bytes at the
+// configured link rate and no slot starts before the previous one ends, so
+// one client never sees another client's train as cross traffic. grants
+// are first come first served, the lock only covering the slot arithmetic.
+//
+// each session is also held to a token bucket refilled at the session rate
+// and to a total byte budget. a train may borrow against the bucket, later
+// trains then wait for it to refill.
+//
+
+int slot_init(struct slot_s *slot)
+{
+  pthread_mutexattr_t attr;
+  int ret;
+
+  // created before any fork so every worker shares the one link
+  slot->shared = mmap(NULL, sizeof(struct slot_shared_s), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if ( slot->shared == MAP_FAILED )
+  {
+    slot->shared = NULL;
+    return 1;
+  }
+
+  bzero(slot->shared, sizeof(struct slot_shared_s));
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  ret = pthread_mutex_init(&slot->shared->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  if ( ret != 0 )
+  {
+    slot_free(slot);
+    return 1;
+  }
+
+  return 0;
+}
+
+void slot_free(struct slot_s *slot)
+{
+  if ( NULL != slot->shared )
+    munmap(slot->shared, sizeof(struct slot_shared_s));
+
+  slot->shared = NULL;
+}
+
+void slot_session_init(struct slot_session_s *session)
+{
+  bzero(session, sizeof(struct slot_session_s));
+}
+
+static void slot_lock(struct slot_shared_s *shared)
+{
+  if ( pthread_mutex_lock(&shared->lock) != EOWNERDEAD )
+    return;
+
+  // the dead worker may have left the end of the link's schedule half
+  // written, admission starts afresh from the next release
+  ulog(LOG_WARN, "Slot lock recovered from a dead worker.\n");
+
+  bzero(&shared->busy_until, sizeof(struct timespec));
+  pthread_mutex_consistent(&shared->lock);
+}
+
+static void slot_unlock(struct slot_shared_s *shared)
+{
+  pthread_mutex_unlock(&shared->lock);
+}
+
+double slot_train_duration_us(struct slot_s *slot, unsigned long bytes)
+{
+  // Mbps is bits per microsecond
+  return (double)(bytes << 3) / slot->link_rate;
+}
+
+int slot_grant(struct slot_s *slot, struct slot_session_s *session, unsigned long bytes, double duration_us, struct timespec *release)
+{
+  struct timespec start = *release;
+  double rate = slot->session_rate / 8.0;
+  double depth = TRAIN_LENGTH_MAX * TRAIN_PACKET_LENGTH_MAX;
+  double queued;
+
+  if ( (slot->session_budget > 0) && (session->bytes + bytes > slot->session_budget) )
+  {
+    session->refused++;
+    return SLOT_BUDGET_EXCEEDED;
+  }
+
+  // refill the bucket and wait out any debt left by earlier trains
+  if ( rate > 0 )
+  {
+    if ( session->refilled_valid )
+    {
+      session->tokens += time_delta_ts_us(session->refilled, start) * rate;
+
+      if ( session->tokens > depth )
+        session->tokens = depth;
+    }
+    else
+      session->tokens = depth;
+
+    if ( session->tokens < 0 )
+    {
+      timespec_add_ns(&start, (long)((-session->tokens / rate) * 1000.0));
+      session->tokens = 0;
+    }
+
+    session->tokens -= (double)bytes;
+    session->refilled = start;
+    session->refilled_valid = 1;
+  }
+
+  if ( NULL != slot->shared )
+  {
+    slot_lock(slot->shared);
+
+    if ( timespec_cmp(&start, &slot->shared->busy_until) < 0 )
+      start = slot->shared->busy_until;
+
+    slot->shared->busy_until = start;
+    timespec_add_ns(&slot->shared->busy_until, (long)(duration_us * 1000.0) + SLOT_GUARD_NS);
+    slot->shared->grants++;
+
+    slot_unlock(slot->shared);
+  }
+
+  queued = time_delta_ts_us(*release, start);
+
+  session->queue_total += queued;
+  if ( queued > session->queue_max )
+    session->queue_max = queued;
+
+  session->bytes += bytes;
+  session->grants++;
+
+  *release = start;
+
+  return SLOT_GRANTED;
+}
+
+double slot_session_queue_mean(const struct slot_session_s *session)
+{
+  if ( session->grants == 0 )
+    return 0.0;
+
+  return session->queue_total / (double)session->grants;
+}
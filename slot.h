@@ -0,0 +1,66 @@
+#ifndef SLOT_H
+#define SLOT_H
+
+#include <pthread.h>
+#include <time.h>
+
+// assumed egress rate when sizing a train's slot [Mbps]
+#define SLOT_LINK_RATE_DEFAULT 1000.0
+
+// idle gap left between consecutive slots
+#define SLOT_GUARD_NS 20000
+
+// GRANT RESULTS
+#define SLOT_GRANTED         0
+#define SLOT_BUDGET_EXCEEDED 1
+
+struct slot_shared_s
+{
+  // held while a grant is computed, shared by every worker and robust so
+  // a worker dying with it held cannot stall the rest
+  pthread_mutex_t lock;
+
+  // end of the last slot granted on the link
+  struct timespec busy_until;
+  unsigned long grants;
+};
+
+struct slot_s
+{
+  struct slot_shared_s *shared;
+
+  // link rate used to size slots [Mbps]
+  double link_rate;
+
+  // per session limits, 0 being unlimited [Mbps] [bytes]
+  double session_rate;
+  unsigned long session_budget;
+};
+
+struct slot_session_s
+{
+  // token bucket, in bytes, allowed to go negative to admit large trains
+  double tokens;
+  struct timespec refilled;
+  int refilled_valid;
+
+  // bytes and slots granted so far
+  unsigned long bytes;
+  unsigned long grants;
+  unsigned long refused;
+
+  // slot start minus requested release [us]
+  double queue_total;
+  double queue_max;
+};
+
+// PUBLIC FUNCTIONS
+int slot_init(struct slot_s *slot);
+void slot_free(struct slot_s *slot);
+void slot_session_init(struct slot_session_s *session);
+
+int slot_grant(struct slot_s *slot, struct slot_session_s *session, unsigned long bytes, double duration_us, struct timespec *release);
+double slot_train_duration_us(struct slot_s *slot, unsigned long bytes);
+double slot_session_queue_mean(const struct slot_session_s *session);
+
+#endif /* SLOT_H */
@@ -0,0 +1,74 @@
+#include "spsc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+//
+// SINGLE PRODUCER SINGLE CONSUMER QUEUE
+//
+// a ring of fixed size entries between exactly two threads. the producer
+// copies an entry in and then publishes it by moving the head, the consumer
+// copies it out and then hands the slot back by moving the tail. each index
+// is written by one side only, so neither ever takes a lock or waits on the
+// other. the indices run freely and wrap, the mask picks the slot.
+//
+
+int spsc_init(struct spsc_s *queue, unsigned int size, size_t entry_size)
+{
+  bzero(queue, sizeof(struct spsc_s));
+
+  // the mask only works for powers of two
+  if ( (size == 0) || (size & (size - 1)) )
+    return 1;
+
+  if ( (queue->entries = calloc(size, entry_size)) == NULL )
+    return 1;
+
+  queue->entry_size = entry_size;
+  queue->size = size;
+  queue->mask = size - 1;
+
+  return 0;
+}
+
+void spsc_free(struct spsc_s *queue)
+{
+  free(queue->entries);
+  queue->entries = NULL;
+}
+
+int spsc_push(struct spsc_s *queue, const void *entry)
+{
+  unsigned int head = queue->head;
+
+  if ( head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= queue->size )
+    return 1;
+
+  memcpy(queue->entries + (head & queue->mask) * queue->entry_size, entry, queue->entry_size);
+
+  // the entry must be in place before the consumer can see it
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int spsc_pop(struct spsc_s *queue, void *entry)
+{
+  unsigned int tail = queue->tail;
+
+  if ( tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) )
+    return 1;
+
+  memcpy(entry, queue->entries + (tail & queue->mask) * queue->entry_size, queue->entry_size);
+
+  // and copied out before the producer may reuse the slot
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+unsigned int spsc_count(struct spsc_s *queue)
+{
+  return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
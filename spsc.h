@@ -0,0 +1,32 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+
+// keeps each side's index on its own cache line
+#define SPSC_CACHE_LINE 64
+
+struct spsc_s
+{
+  // fixed size entries, a power of two of them
+  char *entries;
+  size_t entry_size;
+  unsigned int size;
+  unsigned int mask;
+
+  // next entry to fill, only ever written by the producer
+  unsigned int head __attribute__((aligned(SPSC_CACHE_LINE)));
+
+  // next entry to take, only ever written by the consumer
+  unsigned int tail __attribute__((aligned(SPSC_CACHE_LINE)));
+};
+
+// PUBLIC FUNCTIONS
+int spsc_init(struct spsc_s *queue, unsigned int size, size_t entry_size);
+void spsc_free(struct spsc_s *queue);
+
+int spsc_push(struct spsc_s *queue, const void *entry);
+int spsc_pop(struct spsc_s *queue, void *entry);
+unsigned int spsc_count(struct spsc_s *queue);
+
+#endif /* SPSC_H */
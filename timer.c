@@ -0,0 +1,229 @@
+#include "timer.h"
+#include "common.h"
+#include "debug.h"
+
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+
+//
+// TIMER WHEEL
+//
+// timers are hashed into slots by the tick they expire on, so arming and
+// cancelling only touch one slot's list. a single timerfd is armed for the
+// nearest occupied tick and the event loop runs the wheel when it fires,
+// visiting just the slots whose ticks have passed. timers further out than
+// one rotation share a slot with nearer ones and wait for their own tick.
+//
+// timers armed from an expiry callback are left for the next pass, even
+// if already due, so a session that keeps re-arming cannot starve the
+// rest of the event loop.
+//
+
+static unsigned long timer_tick_get(struct timer_wheel_s *wheel, const struct timespec *when)
+{
+  long long ns = (long long)(when->tv_sec - wheel->origin.tv_sec) * 1000000000LL +
+                 (when->tv_nsec - wheel->origin.tv_nsec);
+
+  if ( ns <= 0 )
+    return 0;
+
+  // round down, an early wake up is absorbed by the pacing engine
+  return (unsigned long)(ns / TIMER_TICK_NS);
+}
+
+static void timer_wheel_fd_arm(struct timer_wheel_s *wheel, unsigned long tick)
+{
+  struct itimerspec its;
+
+  bzero(&its, sizeof(its));
+
+  its.it_value = wheel->origin;
+  timespec_add_ns(&its.it_value, (long)tick * TIMER_TICK_NS);
+
+  // a tick already passed fires at once
+  if ( timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to arm timer wheel.\n");
+  }
+
+  wheel->armed_tick = tick;
+  wheel->armed = 1;
+}
+
+static void timer_wheel_fd_disarm(struct timer_wheel_s *wheel)
+{
+  struct itimerspec its;
+
+  bzero(&its, sizeof(its));
+  timerfd_settime(wheel->fd, 0, &its, NULL);
+
+  wheel->armed = 0;
+}
+
+static void timer_wheel_rearm(struct timer_wheel_s *wheel)
+{
+  struct timer_s *timer;
+  unsigned long next = 0;
+  int next_valid = 0;
+  unsigned long t;
+
+  if ( wheel->count == 0 )
+  {
+    timer_wheel_fd_disarm(wheel);
+    return;
+  }
+
+  // the first timer due in this rotation is the nearest, failing that the
+  // earliest of those further out
+  for (t=wheel->tick; t<wheel->tick + TIMER_WHEEL_SLOTS; t++)
+  {
+    for (timer=wheel->slots[t % TIMER_WHEEL_SLOTS]; timer!=NULL; timer=timer->next)
+    {
+      if ( ! next_valid || timer->expires < next )
+      {
+        next = timer->expires;
+        next_valid = 1;
+      }
+    }
+
+    if ( next_valid && next <= t )
+      break;
+  }
+
+  timer_wheel_fd_arm(wheel, next);
+}
+
+static void timer_unlink(struct timer_wheel_s *wheel, struct timer_s *timer)
+{
+  if ( NULL != timer->prev )
+    timer->prev->next = timer->next;
+  else
+    wheel->slots[timer->expires % TIMER_WHEEL_SLOTS] = timer->next;
+
+  if ( NULL != timer->next )
+    timer->next->prev = timer->prev;
+
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->armed = 0;
+
+  wheel->count--;
+}
+
+int timer_wheel_init(struct timer_wheel_s *wheel)
+{
+  bzero(wheel, sizeof(struct timer_wheel_s));
+
+  if ( (wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 )
+    return 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &wheel->origin);
+
+  return 0;
+}
+
+void timer_wheel_free(struct timer_wheel_s *wheel)
+{
+  if ( wheel->fd >= 0 )
+    close(wheel->fd);
+
+  wheel->fd = -1;
+}
+
+void timer_init(struct timer_s *timer, timer_expire_t expire, void *arg)
+{
+  bzero(timer, sizeof(struct timer_s));
+
+  timer->expire = expire;
+  timer->arg = arg;
+}
+
+void timer_arm(struct timer_wheel_s *wheel, struct timer_s *timer, const struct timespec *when)
+{
+  struct timer_s **slot;
+  unsigned long tick = timer_tick_get(wheel, when);
+
+  if ( timer->armed )
+    timer_unlink(wheel, timer);
+
+  // a deadline already passed is due on the tick being processed
+  if ( tick < wheel->tick )
+    tick = wheel->tick;
+
+  slot = &wheel->slots[tick % TIMER_WHEEL_SLOTS];
+
+  timer->expires = tick;
+  timer->run = wheel->runs;
+  timer->armed = 1;
+  timer->prev = NULL;
+  timer->next = *slot;
+
+  if ( NULL != *slot )
+    (*slot)->prev = timer;
+
+  *slot = timer;
+  wheel->count++;
+
+  if ( ! wheel->armed || tick < wheel->armed_tick )
+    timer_wheel_fd_arm(wheel, tick);
+}
+
+void timer_cancel(struct timer_wheel_s *wheel, struct timer_s *timer)
+{
+  // the timerfd may still fire for it, the wheel then finds nothing due
+  if ( timer->armed )
+    timer_unlink(wheel, timer);
+}
+
+void timer_wheel_run(struct timer_wheel_s *wheel)
+{
+  struct timer_s *timer;
+  struct timespec now;
+  uint64_t expirations;
+  unsigned long start = wheel->tick;
+  unsigned long end;
+  unsigned long t;
+
+  if ( read(wheel->fd, &expirations, sizeof(expirations)) < 0 )
+  {
+    // woken for nothing, or by a timer since cancelled
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  end = timer_tick_get(wheel, &now);
+  if ( end < start )
+    end = start;
+
+  // after a long stall every slot is visited once
+  if ( end - start >= TIMER_WHEEL_SLOTS )
+    start = end - TIMER_WHEEL_SLOTS + 1;
+
+  wheel->tick = end;
+  wheel->runs++;
+  wheel->armed = 0;
+
+  for (t=start; t<=end; t++)
+  {
+    // callbacks may cancel any timer, so restart the slot after each one
+    timer = wheel->slots[t % TIMER_WHEEL_SLOTS];
+
+    while ( NULL != timer )
+    {
+      if ( (timer->expires > end) || (timer->run == wheel->runs) )
+      {
+        timer = timer->next;
+        continue;
+      }
+
+      timer_unlink(wheel, timer);
+      timer->expire(timer->arg);
+
+      timer = wheel->slots[t % TIMER_WHEEL_SLOTS];
+    }
+  }
+
+  timer_wheel_rearm(wheel);
+}
@@ -0,0 +1,57 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <time.h>
+
+// wheel resolution and size, one rotation spanning 256ms
+#define TIMER_TICK_NS      250000L
+#define TIMER_WHEEL_SLOTS  1024
+
+typedef void (*timer_expire_t)(void *arg);
+
+struct timer_s
+{
+  // neighbours in the slot, valid while armed
+  struct timer_s *next;
+  struct timer_s *prev;
+  int armed;
+
+  // absolute tick the timer fires on, and the wheel run it was armed in
+  unsigned long expires;
+  unsigned long run;
+
+  timer_expire_t expire;
+  void *arg;
+};
+
+struct timer_wheel_s
+{
+  // timerfd driving the wheel, readable once the next slot is due
+  int fd;
+
+  // monotonic time of tick 0, and the last tick processed
+  struct timespec origin;
+  unsigned long tick;
+
+  // armed timers hashed by expiry tick
+  struct timer_s *slots[TIMER_WHEEL_SLOTS];
+  unsigned int count;
+
+  // tick the timerfd is armed for, while count > 0
+  unsigned long armed_tick;
+  int armed;
+
+  // expiry passes made, timers armed during one wait for the next
+  unsigned long runs;
+};
+
+// PUBLIC FUNCTIONS
+int timer_wheel_init(struct timer_wheel_s *wheel);
+void timer_wheel_free(struct timer_wheel_s *wheel);
+void timer_wheel_run(struct timer_wheel_s *wheel);
+
+void timer_init(struct timer_s *timer, timer_expire_t expire, void *arg);
+void timer_arm(struct timer_wheel_s *wheel, struct timer_s *timer, const struct timespec *when);
+void timer_cancel(struct timer_wheel_s *wheel, struct timer_s *timer);
+
+#endif /* TIMER_H */
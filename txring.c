@@ -0,0 +1,361 @@
+#include "txring.h"
+#include "debug.h"
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <net/if_arp.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+//
+// PACKET_MMAP TX RING
+//
+// frames are written straight into a ring shared with the kernel and the
+// whole train is handed over with a single send(), which then walks the
+// ring and queues every frame to the device without leaving the kernel.
+// with the qdisc bypassed the packets reach the NIC as close to back to
+// back as the host allows. only CAP_NET_RAW is needed.
+//
+
+#define TXRING_HDR_LEN (sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr))
+
+static char * txring_frame(struct txring_s *txring, unsigned int index)
+{
+  return txring->ring + (index * TXRING_FRAME_SIZE);
+}
+
+static unsigned int txring_flush(struct txring_s *txring, unsigned int first, unsigned int count)
+{
+  struct tpacket2_hdr *hdr;
+  unsigned int sent = 0;
+  unsigned int i;
+
+  // blocks until the kernel has walked every frame we queued
+  while ( send(txring->fd, NULL, 0, 0) < 0 )
+  {
+    if ( errno != EINTR )
+    {
+      ulog(LOG_DEBUG, "TX ring kick failed (%s)\n", strerror(errno));
+      break;
+    }
+  }
+
+  // frames the kernel refused are flagged, the rest are free again
+  for (i=0; i<count; i++)
+  {
+    hdr = (struct tpacket2_hdr *)txring_frame(txring, (first + i) % TXRING_FRAME_COUNT);
+
+    if ( hdr->tp_status == TP_STATUS_AVAILABLE )
+      sent++;
+    else if ( hdr->tp_status & TP_STATUS_WRONG_FORMAT )
+      hdr->tp_status = TP_STATUS_AVAILABLE;
+  }
+
+  return sent;
+}
+
+int txring_open(struct txring_s *txring, const char *ifname)
+{
+  struct tpacket_req req;
+  struct sockaddr_ll addr;
+  struct ifreq ifr;
+  int opt;
+
+  bzero(txring, sizeof(struct txring_s));
+  txring->ring = MAP_FAILED;
+
+  snprintf(txring->ifname, IF_NAMESIZE, "%s", ifname);
+
+  // protocol 0 so nothing received is ever queued to us
+  if ( (txring->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0 )
+  {
+    ulog(LOG_ERROR, "Unable to open packet socket (%s)\n", strerror(errno));
+    return 1;
+  }
+
+  if ( (txring->ifindex = if_nametoindex(ifname)) == 0 )
+  {
+    ulog(LOG_ERROR, "Unknown interface: %s\n", ifname);
+    goto fail;
+  }
+
+  bzero(&ifr, sizeof(ifr));
+  snprintf(ifr.ifr_name, IF_NAMESIZE, "%s", ifname);
+
+  if ( ioctl(txring->fd, SIOCGIFFLAGS, &ifr) == 0 )
+    txring->loopback = (ifr.ifr_flags & IFF_LOOPBACK) ? 1 : 0;
+
+  if ( ioctl(txring->fd, SIOCGIFHWADDR, &ifr) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to read hardware address of %s\n", ifname);
+    goto fail;
+  }
+
+  memcpy(txring->src_mac, ifr.ifr_hwaddr.sa_data, TXRING_ETH_ALEN);
+
+  ifr.ifr_addr.sa_family = AF_INET;
+  if ( ioctl(txring->fd, SIOCGIFADDR, &ifr) != 0 )
+  {
+    ulog(LOG_ERROR, "No IPv4 address on %s\n", ifname);
+    goto fail;
+  }
+
+  txring->src_ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+
+  opt = TPACKET_V2;
+  if ( setsockopt(txring->fd, SOL_PACKET, PACKET_VERSION, &opt, sizeof(opt)) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to select TPACKET_V2 (%s)\n", strerror(errno));
+    goto fail;
+  }
+
+  // the qdisc would only spread the train out again
+  opt = 1;
+  if ( setsockopt(txring->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &opt, sizeof(opt)) != 0 )
+  {
+    ulog(LOG_WARN, "Unable to bypass the qdisc on %s\n", ifname);
+  }
+
+  bzero(&req, sizeof(req));
+  req.tp_block_size = TXRING_BLOCK_SIZE;
+  req.tp_frame_size = TXRING_FRAME_SIZE;
+  req.tp_frame_nr = TXRING_FRAME_COUNT;
+  req.tp_block_nr = (TXRING_FRAME_COUNT * TXRING_FRAME_SIZE) / TXRING_BLOCK_SIZE;
+
+  if ( setsockopt(txring->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to set up TX ring (%s)\n", strerror(errno));
+    goto fail;
+  }
+
+  txring->ring_size = req.tp_block_size * req.tp_block_nr;
+  txring->ring = mmap(NULL, txring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, txring->fd, 0);
+
+  if ( txring->ring == MAP_FAILED )
+  {
+    ulog(LOG_ERROR, "Unable to map TX ring (%s)\n", strerror(errno));
+    goto fail;
+  }
+
+  bzero(&addr, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_ifindex = txring->ifindex;
+
+  if ( bind(txring->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 )
+  {
+    ulog(LOG_ERROR, "Unable to bind packet socket to %s (%s)\n", ifname, strerror(errno));
+    goto fail;
+  }
+
+  ulog(LOG_INFO, "TX ring on %s: %u frames of %u bytes\n", ifname, TXRING_FRAME_COUNT, TXRING_FRAME_SIZE);
+
+  return 0;
+
+fail:
+  txring_close(txring);
+  return 1;
+}
+
+void txring_close(struct txring_s *txring)
+{
+  if ( txring->ring != MAP_FAILED && NULL != txring->ring )
+    munmap(txring->ring, txring->ring_size);
+
+  if ( txring->fd > 0 )
+    close(txring->fd);
+
+  txring->ring = MAP_FAILED;
+  txring->fd = -1;
+}
+
+//
+// NEXT HOP RESOLUTION
+//
+// the frames bypass the neighbour subsystem so we look the next hop up the
+// same way the kernel would, the most specific route on our interface and
+// then its entry in the ARP cache.
+//
+
+int txring_resolve(struct txring_s *txring, struct in_addr dst, unsigned char *mac)
+{
+  char line[256];
+  char iface[IF_NAMESIZE + 1];
+  char ip[INET_ADDRSTRLEN + 1];
+  char hw[32];
+  unsigned int destination, gateway, flags, mask;
+  unsigned int hw_type;
+  uint32_t next_hop = dst.s_addr;
+  uint32_t best_mask = 0;
+  int best_valid = 0;
+  struct in_addr entry;
+  FILE *fp;
+  int found = 0;
+
+  // a loopback device ignores the link header entirely
+  if ( txring->loopback )
+  {
+    bzero(mac, TXRING_ETH_ALEN);
+    return 0;
+  }
+
+  if ( (fp = fopen("/proc/net/route", "r")) != NULL )
+  {
+    while ( fgets(line, sizeof(line), fp) != NULL )
+    {
+      if ( sscanf(line, "%16s %x %x %x %*d %*d %*d %x", iface, &destination, &gateway, &flags, &mask) != 5 )
+        continue;
+
+      if ( strcmp(iface, txring->ifname) != 0 || ! (flags & 0x1) )
+        continue;
+
+      // fields are in network order, as the kernel stores them
+      if ( (dst.s_addr & mask) != destination )
+        continue;
+
+      if ( best_valid && ntohl(mask) < best_mask )
+        continue;
+
+      best_mask = ntohl(mask);
+      best_valid = 1;
+      next_hop = (gateway != 0) ? gateway : dst.s_addr;
+    }
+
+    fclose(fp);
+  }
+
+  if ( (fp = fopen("/proc/net/arp", "r")) == NULL )
+    return 1;
+
+  while ( fgets(line, sizeof(line), fp) != NULL )
+  {
+    if ( sscanf(line, "%16s 0x%x 0x%x %31s %*s %16s", ip, &hw_type, &flags, hw, iface) != 5 )
+      continue;
+
+    if ( inet_pton(AF_INET, ip, &entry) != 1 || entry.s_addr != next_hop )
+      continue;
+
+    if ( strcmp(iface, txring->ifname) != 0 || ! (flags & ATF_COM) )
+      continue;
+
+    if ( sscanf(hw, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) == 6 )
+    {
+      found = 1;
+      break;
+    }
+  }
+
+  fclose(fp);
+
+  return found ? 0 : 1;
+}
+
+static uint16_t txring_ip_checksum(const void *header, unsigned int length)
+{
+  const uint16_t *word = header;
+  uint32_t sum = 0;
+
+  for (; length>1; length-=2)
+    sum += *word++;
+
+  while ( sum >> 16 )
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return (uint16_t)~sum;
+}
+
+int txring_send_train(struct txring_s *txring, const unsigned char *dst_mac, const struct sockaddr_in *src, const struct sockaddr_in *dst, const char *packets, unsigned int stride, unsigned int length, unsigned int packet_length)
+{
+  struct tpacket2_hdr *hdr;
+  struct ethhdr *eth;
+  struct iphdr *iph;
+  struct udphdr *udph;
+  unsigned int frame_length = TXRING_HDR_LEN + packet_length;
+  unsigned int first = txring->head;
+  unsigned int queued = 0;
+  unsigned int sent = 0;
+  unsigned int i;
+  char *frame;
+  char *data;
+  struct pollfd pfd;
+
+  if ( frame_length > TXRING_FRAME_SIZE - TPACKET2_HDRLEN )
+    return 0;
+
+  pfd.fd = txring->fd;
+  pfd.events = POLLOUT;
+
+  for (i=0; i<length; i++)
+  {
+    frame = txring_frame(txring, txring->head);
+    hdr = (struct tpacket2_hdr *)frame;
+
+    // the ring is full, flush what we have and wait for the kernel
+    while ( hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING) )
+    {
+      if ( queued > 0 )
+      {
+        sent += txring_flush(txring, first, queued);
+
+        first = txring->head;
+        queued = 0;
+      }
+      else
+        poll(&pfd, 1, 1);
+    }
+
+    data = frame + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+    eth = (struct ethhdr *)data;
+    memcpy(eth->h_dest, dst_mac, TXRING_ETH_ALEN);
+    memcpy(eth->h_source, txring->src_mac, TXRING_ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+
+    iph = (struct iphdr *)(data + sizeof(struct ethhdr));
+    iph->ihl = 5;
+    iph->version = 4;
+    iph->tos = 0;
+    iph->tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + packet_length);
+    iph->id = htons(txring->ip_id++);
+    iph->frag_off = htons(IP_DF);
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_UDP;
+    iph->check = 0;
+    iph->saddr = txring->src_ip.s_addr;
+    iph->daddr = dst->sin_addr.s_addr;
+    iph->check = txring_ip_checksum(iph, sizeof(struct iphdr));
+
+    // a zero checksum is legal for UDP over IPv4 and saves a pass over the payload
+    udph = (struct udphdr *)(data + sizeof(struct ethhdr) + sizeof(struct iphdr));
+    udph->source = src->sin_port;
+    udph->dest = dst->sin_port;
+    udph->len = htons(sizeof(struct udphdr) + packet_length);
+    udph->check = 0;
+
+    memcpy(data + TXRING_HDR_LEN, packets + (i * stride), packet_length);
+
+    hdr->tp_len = frame_length;
+
+    // the frame must be complete before the kernel may see it
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+    txring->head = (txring->head + 1) % TXRING_FRAME_COUNT;
+    queued++;
+  }
+
+  if ( queued > 0 )
+    sent += txring_flush(txring, first, queued);
+
+  return sent;
+}
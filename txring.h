@@ -0,0 +1,40 @@
+#ifndef TXRING_H
+#define TXRING_H
+
+#include <stdint.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+// ring geometry, each frame holds one full sized train packet
+#define TXRING_FRAME_SIZE  2048
+#define TXRING_BLOCK_SIZE  4096
+#define TXRING_FRAME_COUNT 1024
+
+#define TXRING_ETH_ALEN 6
+
+struct txring_s
+{
+  int fd;
+  char ifname[IF_NAMESIZE];
+  int ifindex;
+  int loopback;
+
+  // mapped PACKET_TX_RING and the next frame we will fill
+  char *ring;
+  size_t ring_size;
+  unsigned int head;
+
+  // our side of every frame
+  unsigned char src_mac[TXRING_ETH_ALEN];
+  struct in_addr src_ip;
+  uint16_t ip_id;
+};
+
+// PUBLIC FUNCTIONS
+int txring_open(struct txring_s *txring, const char *ifname);
+void txring_close(struct txring_s *txring);
+
+int txring_resolve(struct txring_s *txring, struct in_addr dst, unsigned char *mac);
+int txring_send_train(struct txring_s *txring, const unsigned char *dst_mac, const struct sockaddr_in *src, const struct sockaddr_in *dst, const char *packets, unsigned int stride, unsigned int length, unsigned int packet_length);
+
+#endif /* TXRING_H */
@@ -0,0 +1,445 @@
+#include "uring.h"
+#include "debug.h"
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <time.h>
+#endif
+
+//
+// IO_URING
+//
+// a thin layer over the raw system calls, enough for the train paths and
+// no more. sends are fixed buffer writes out of memory registered once, so
+// the kernel neither pins nor copies the pages per call, and a whole train
+// goes out on a single io_uring_enter(). receives are multishot: armed
+// once, every datagram completes into a buffer the kernel picks from a
+// ring we keep topped up, until it runs dry and the receive is re-armed.
+// a multishot recvmsg puts the datagram's control messages, such as its
+// receive timestamp, ahead of it in the same buffer.
+//
+// built only when HAVE_URING is defined, otherwise every call fails and
+// the callers keep to their socket paths.
+//
+
+#ifdef HAVE_URING
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags, void *arg, size_t arg_size)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int count)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int uring_init(struct uring_s *uring, unsigned int entries)
+{
+  struct io_uring_params params;
+
+  bzero(uring, sizeof(struct uring_s));
+  bzero(&params, sizeof(params));
+
+  if ( (uring->fd = uring_setup(entries, &params)) < 0 )
+    return 1;
+
+  uring->sq_entries = params.sq_entries;
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  if ( params.features & IORING_FEAT_SINGLE_MMAP )
+  {
+    if ( uring->cq_ring_size > uring->sq_ring_size )
+      uring->sq_ring_size = uring->cq_ring_size;
+
+    uring->cq_ring_size = uring->sq_ring_size;
+  }
+
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+
+  if ( uring->sq_ring == MAP_FAILED )
+  {
+    uring->sq_ring = NULL;
+    uring_free(uring);
+    return 1;
+  }
+
+  if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    uring->cq_ring = uring->sq_ring;
+  else
+  {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+
+    if ( uring->cq_ring == MAP_FAILED )
+    {
+      uring->cq_ring = NULL;
+      uring_free(uring);
+      return 1;
+    }
+  }
+
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+
+  if ( uring->sqes == MAP_FAILED )
+  {
+    uring->sqes = NULL;
+    uring_free(uring);
+    return 1;
+  }
+
+  uring->sq_head = (unsigned int *)((char *)uring->sq_ring + params.sq_off.head);
+  uring->sq_tail = (unsigned int *)((char *)uring->sq_ring + params.sq_off.tail);
+  uring->sq_mask = (unsigned int *)((char *)uring->sq_ring + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned int *)((char *)uring->sq_ring + params.sq_off.array);
+
+  uring->cq_head = (unsigned int *)((char *)uring->cq_ring + params.cq_off.head);
+  uring->cq_tail = (unsigned int *)((char *)uring->cq_ring + params.cq_off.tail);
+  uring->cq_mask = (unsigned int *)((char *)uring->cq_ring + params.cq_off.ring_mask);
+  uring->cqes = (char *)uring->cq_ring + params.cq_off.cqes;
+
+  return 0;
+}
+
+void uring_free(struct uring_s *uring)
+{
+  if ( NULL != uring->recv_ring )
+    munmap(uring->recv_ring, uring->recv_ring_size);
+
+  free(uring->recv_buffers);
+
+  if ( NULL != uring->sqes )
+    munmap(uring->sqes, uring->sqes_size);
+
+  if ( (NULL != uring->cq_ring) && (uring->cq_ring != uring->sq_ring) )
+    munmap(uring->cq_ring, uring->cq_ring_size);
+
+  if ( NULL != uring->sq_ring )
+    munmap(uring->sq_ring, uring->sq_ring_size);
+
+  if ( uring->fd >= 0 )
+    close(uring->fd);
+
+  bzero(uring, sizeof(struct uring_s));
+  uring->fd = -1;
+}
+
+int uring_buffers_register(struct uring_s *uring, void *base, size_t length)
+{
+  struct iovec iov;
+
+  iov.iov_base = base;
+  iov.iov_len = length;
+
+  return (uring_register(uring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) ? 1 : 0;
+}
+
+int uring_buffers_unregister(struct uring_s *uring)
+{
+  return (uring_register(uring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0) < 0) ? 1 : 0;
+}
+
+static void uring_recv_buffer_add(struct uring_s *uring, unsigned short bid)
+{
+  struct io_uring_buf_ring *ring = uring->recv_ring;
+  unsigned short tail = ring->tail;
+  struct io_uring_buf *buffer = &ring->bufs[tail & (URING_RECV_BUFFERS - 1)];
+
+  buffer->addr = (uint64_t)(uintptr_t)(uring->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE);
+  buffer->len = URING_RECV_BUFFER_SIZE;
+  buffer->bid = bid;
+
+  // the kernel only looks past the tail once it has moved
+  __atomic_store_n(&ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+int uring_recv_buffers_init(struct uring_s *uring)
+{
+  struct io_uring_buf_reg reg;
+  unsigned short i;
+
+  uring->recv_ring_size = sizeof(struct io_uring_buf) * URING_RECV_BUFFERS;
+  uring->recv_ring = mmap(NULL, uring->recv_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( uring->recv_ring == MAP_FAILED )
+  {
+    uring->recv_ring = NULL;
+    return 1;
+  }
+
+  if ( (uring->recv_buffers = malloc((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE)) == NULL )
+    return 1;
+
+  bzero(&reg, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)uring->recv_ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = URING_RECV_GROUP;
+
+  if ( uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 )
+    return 1;
+
+  for (i=0; i<URING_RECV_BUFFERS; i++)
+    uring_recv_buffer_add(uring, i);
+
+  return 0;
+}
+
+const char * uring_recv_buffer_get(struct uring_s *uring, uint32_t flags)
+{
+  if ( ! (flags & IORING_CQE_F_BUFFER) )
+    return NULL;
+
+  return uring->recv_buffers + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * URING_RECV_BUFFER_SIZE;
+}
+
+void uring_recv_buffer_release(struct uring_s *uring, uint32_t flags)
+{
+  if ( flags & IORING_CQE_F_BUFFER )
+    uring_recv_buffer_add(uring, (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT));
+}
+
+int uring_cqe_more(const struct uring_cqe_s *cqe)
+{
+  // a multishot request that has stopped needs arming again
+  return (cqe->flags & IORING_CQE_F_MORE) ? 1 : 0;
+}
+
+static struct io_uring_sqe * uring_sqe_get(struct uring_s *uring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int tail = *uring->sq_tail;
+  unsigned int index;
+
+  // a full queue is flushed rather than refused
+  if ( tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries )
+  {
+    if ( (uring_submit(uring, 0, 0) != 0) ||
+         (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) )
+      return NULL;
+  }
+
+  index = tail & *uring->sq_mask;
+  sqe = (struct io_uring_sqe *)uring->sqes + index;
+
+  bzero(sqe, sizeof(struct io_uring_sqe));
+  uring->sq_array[index] = index;
+
+  return sqe;
+}
+
+static void uring_sqe_queue(struct uring_s *uring)
+{
+  __atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+  uring->sq_queued++;
+}
+
+int uring_prep_write_fixed(struct uring_s *uring, int fd, const void *buffer, unsigned int length, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  if ( (sqe = uring_sqe_get(uring)) == NULL )
+    return 1;
+
+  // sockets have no position, -1 writes as write(2) would
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = fd;
+  sqe->off = (uint64_t)-1;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = length;
+  sqe->buf_index = 0;
+  sqe->user_data = user_data;
+
+  uring_sqe_queue(uring);
+
+  return 0;
+}
+
+int uring_prep_recv_multishot(struct uring_s *uring, int fd, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  if ( (sqe = uring_sqe_get(uring)) == NULL )
+    return 1;
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_RECV_GROUP;
+  sqe->user_data = user_data;
+
+  uring_sqe_queue(uring);
+
+  return 0;
+}
+
+int uring_prep_recvmsg_multishot(struct uring_s *uring, int fd, struct msghdr *msg, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  if ( (sqe = uring_sqe_get(uring)) == NULL )
+    return 1;
+
+  // the header only sizes the name and control data the kernel lays out
+  // ahead of every datagram in its buffer
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_RECV_GROUP;
+  sqe->user_data = user_data;
+
+  uring_sqe_queue(uring);
+
+  return 0;
+}
+
+const char * uring_recvmsg_payload(const struct msghdr *msg, const char *buffer, int length, struct msghdr *out, int *payload_length)
+{
+  const struct io_uring_recvmsg_out *header = (const struct io_uring_recvmsg_out *)buffer;
+  size_t offset = sizeof(struct io_uring_recvmsg_out) + msg->msg_namelen;
+
+  if ( (size_t)length < offset + msg->msg_controllen )
+    return NULL;
+
+  // as recvmsg() would have filled it in, so CMSG_FIRSTHDR() walks it
+  bzero(out, sizeof(struct msghdr));
+  out->msg_control = (void *)(buffer + offset);
+  out->msg_controllen = header->controllen;
+  out->msg_flags = header->flags;
+
+  offset += msg->msg_controllen;
+
+  // a datagram longer than the buffer arrives truncated
+  *payload_length = (int)(length - offset);
+  if ( header->payloadlen < (unsigned int)*payload_length )
+    *payload_length = header->payloadlen;
+
+  return buffer + offset;
+}
+
+int uring_prep_poll(struct uring_s *uring, int fd, short events, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe;
+
+  if ( (sqe = uring_sqe_get(uring)) == NULL )
+    return 1;
+
+  // one shot, completing straight away if the socket is already ready
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = (unsigned short)events;
+  sqe->user_data = user_data;
+
+  uring_sqe_queue(uring);
+
+  return 0;
+}
+
+int uring_submit(struct uring_s *uring, unsigned int wait, long timeout_us)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  int ret;
+
+  uring->enters++;
+
+  // entering with GETEVENTS also runs any completions the kernel deferred
+  if ( (wait > 0) && (timeout_us >= 0) )
+  {
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+
+    bzero(&arg, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    ret = uring_enter(uring->fd, uring->sq_queued, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  }
+  else
+    ret = uring_enter(uring->fd, uring->sq_queued, wait, IORING_ENTER_GETEVENTS, NULL, _NSIG / 8);
+
+  if ( ret < 0 )
+  {
+    // a timeout or a signal leaves the caller to look at what did complete
+    if ( (errno == ETIME) || (errno == EINTR) )
+      return 0;
+
+    ulog(LOG_DEBUG, "io_uring_enter failed (%s)\n", strerror(errno));
+    return 1;
+  }
+
+  uring->sq_queued -= ((unsigned int)ret > uring->sq_queued) ? uring->sq_queued : (unsigned int)ret;
+
+  return 0;
+}
+
+int uring_cqe_get(struct uring_s *uring, struct uring_cqe_s *cqe)
+{
+  struct io_uring_cqe *entry;
+  unsigned int head = *uring->cq_head;
+
+  if ( head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE) )
+    return 0;
+
+  entry = (struct io_uring_cqe *)uring->cqes + (head & *uring->cq_mask);
+
+  cqe->user_data = entry->user_data;
+  cqe->res = entry->res;
+  cqe->flags = entry->flags;
+
+  __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+#else
+
+int uring_init(struct uring_s *uring, unsigned int entries)
+{
+  bzero(uring, sizeof(struct uring_s));
+  uring->fd = -1;
+
+  errno = ENOSYS;
+
+  return 1;
+}
+
+void uring_free(struct uring_s *uring)
+{
+  uring->fd = -1;
+}
+
+int uring_buffers_register(struct uring_s *uring, void *base, size_t length) { return 1; }
+int uring_buffers_unregister(struct uring_s *uring) { return 1; }
+int uring_recv_buffers_init(struct uring_s *uring) { return 1; }
+const char * uring_recv_buffer_get(struct uring_s *uring, uint32_t flags) { return NULL; }
+void uring_recv_buffer_release(struct uring_s *uring, uint32_t flags) {}
+int uring_cqe_more(const struct uring_cqe_s *cqe) { return 0; }
+int uring_prep_write_fixed(struct uring_s *uring, int fd, const void *buffer, unsigned int length, uint64_t user_data) { return 1; }
+int uring_prep_recv_multishot(struct uring_s *uring, int fd, uint64_t user_data) { return 1; }
+int uring_prep_recvmsg_multishot(struct uring_s *uring, int fd, struct msghdr *msg, uint64_t user_data) { return 1; }
+const char * uring_recvmsg_payload(const struct msghdr *msg, const char *buffer, int length, struct msghdr *out, int *payload_length) { return NULL; }
+int uring_prep_poll(struct uring_s *uring, int fd, short events, uint64_t user_data) { return 1; }
+int uring_submit(struct uring_s *uring, unsigned int wait, long timeout_us) { return 1; }
+int uring_cqe_get(struct uring_s *uring, struct uring_cqe_s *cqe) { return 0; }
+
+#endif /* HAVE_URING */
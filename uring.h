@@ -0,0 +1,80 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// submission and completion entries, a whole train fits in one submit
+#define URING_ENTRIES 256
+
+// provided buffers for multishot receives, each holding one datagram
+#define URING_RECV_BUFFERS     256
+#define URING_RECV_BUFFER_SIZE 2048
+#define URING_RECV_GROUP       1
+
+// a completion, copied out of the ring so the slot is free at once
+struct uring_cqe_s
+{
+  uint64_t user_data;
+  int32_t res;
+  uint32_t flags;
+};
+
+struct uring_s
+{
+  int fd;
+
+  // submission queue, its index array and the entries themselves
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  void *sqes;
+  size_t sqes_size;
+  unsigned int sq_entries;
+
+  // entries filled since the last submit
+  unsigned int sq_queued;
+
+  // completion queue, sharing the submission mapping where the kernel allows
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  void *cqes;
+
+  // provided buffer ring and the buffers it hands out, NULL until set up
+  void *recv_ring;
+  size_t recv_ring_size;
+  char *recv_buffers;
+
+  // the only system call the backend makes once running
+  unsigned long enters;
+};
+
+// PUBLIC FUNCTIONS
+int uring_init(struct uring_s *uring, unsigned int entries);
+void uring_free(struct uring_s *uring);
+
+int uring_buffers_register(struct uring_s *uring, void *base, size_t length);
+int uring_buffers_unregister(struct uring_s *uring);
+
+int uring_recv_buffers_init(struct uring_s *uring);
+const char * uring_recv_buffer_get(struct uring_s *uring, uint32_t flags);
+int uring_cqe_more(const struct uring_cqe_s *cqe);
+void uring_recv_buffer_release(struct uring_s *uring, uint32_t flags);
+
+int uring_prep_write_fixed(struct uring_s *uring, int fd, const void *buffer, unsigned int length, uint64_t user_data);
+int uring_prep_recv_multishot(struct uring_s *uring, int fd, uint64_t user_data);
+int uring_prep_recvmsg_multishot(struct uring_s *uring, int fd, struct msghdr *msg, uint64_t user_data);
+const char * uring_recvmsg_payload(const struct msghdr *msg, const char *buffer, int length, struct msghdr *out, int *payload_length);
+int uring_prep_poll(struct uring_s *uring, int fd, short events, uint64_t user_data);
+
+int uring_submit(struct uring_s *uring, unsigned int wait, long timeout_us);
+int uring_cqe_get(struct uring_s *uring, struct uring_cqe_s *cqe);
+
+#endif /* URING_H */
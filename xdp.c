@@ -0,0 +1,468 @@
+#include "xdp.h"
+#include "debug.h"
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_XDP
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/if_ether.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+//
+// AF_XDP
+//
+// a small XDP program on the interface hands every IPv4 UDP datagram for
+// our port, unfragmented and without IP options, to an AF_XDP socket. the
+// frame lands in packet memory we share with the kernel and its descriptor
+// on a receive ring we read without a system call, the frame then going
+// straight back on the fill ring. anything else, and anything arriving on
+// a queue without our socket, carries on up the stack as before, as does
+// our port too until xdp_redirect_set() puts the socket in the map.
+//
+// the program is a handful of instructions loaded through the raw bpf()
+// system call, no libbpf, and held on the interface by a link that goes
+// with the process. the driver's own XDP hook is tried first, the generic
+// one, which any interface has, after it or when asked for.
+//
+// frames carry no receive timestamp here, they are stamped as they are
+// taken off the ring.
+//
+// built only when HAVE_XDP is defined, otherwise opening fails and the
+// callers keep to their socket paths.
+//
+
+// frame headers the program looks past: ethernet, IPv4 without options, UDP
+#define XDP_HEADERS_LENGTH (14 + 20 + 8)
+
+// queues the socket map has room for
+#define XDP_QUEUES_MAX 64
+
+#ifdef HAVE_XDP
+
+static int xdp_bpf(int cmd, union bpf_attr *attr)
+{
+  return (int)syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+static struct bpf_insn xdp_insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+  struct bpf_insn insn;
+
+  bzero(&insn, sizeof(insn));
+  insn.code = code;
+  insn.dst_reg = dst;
+  insn.src_reg = src;
+  insn.off = off;
+  insn.imm = imm;
+
+  return insn;
+}
+
+static int xdp_program_load(struct xdp_s *xdp, uint16_t port)
+{
+  struct bpf_insn insns[32];
+  int jumps[16];
+  int count = 0, jumps_count = 0;
+  char log[4096];
+  union bpf_attr attr;
+  int i;
+
+  // r2 = data, r3 = data_end, nothing shorter than the headers is ours
+  insns[count++] = xdp_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, 0, 0);
+  insns[count++] = xdp_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_1, 4, 0);
+  insns[count++] = xdp_insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+  insns[count++] = xdp_insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XDP_HEADERS_LENGTH);
+  jumps[jumps_count++] = count;
+  insns[count++] = xdp_insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+
+  // IPv4, no options, UDP, not a fragment, to our port. loads keep the
+  // byte order of the frame, so do the values they are checked against
+  insns[count++] = xdp_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 12, 0);
+  jumps[jumps_count++] = count;
+  insns[count++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(ETH_P_IP));
+  insns[count++] = xdp_insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 14, 0);
+  jumps[jumps_count++] = count;
+  insns[count++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x45);
+  insns[count++] = xdp_insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 23, 0);
+  jumps[jumps_count++] = count;
+  insns[count++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, IPPROTO_UDP);
+  insns[count++] = xdp_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 20, 0);
+  insns[count++] = xdp_insn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff));
+  jumps[jumps_count++] = count;
+  insns[count++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0);
+  insns[count++] = xdp_insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 36, 0);
+  jumps[jumps_count++] = count;
+  insns[count++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(port));
+
+  // to the socket of the queue it came in on, up the stack if there is none
+  insns[count++] = xdp_insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, 16, 0);
+  insns[count++] = xdp_insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xdp->map_fd);
+  insns[count++] = xdp_insn(0, 0, 0, 0, 0);
+  insns[count++] = xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+  insns[count++] = xdp_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+  insns[count++] = xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  // every check that fails lands here
+  for (i=0; i<jumps_count; i++)
+    insns[jumps[i]].off = count - (jumps[i] + 1);
+
+  insns[count++] = xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+  insns[count++] = xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  bzero(&attr, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.expected_attach_type = BPF_XDP;
+  attr.insns = (uint64_t)(uintptr_t)insns;
+  attr.insn_cnt = count;
+  attr.license = (uint64_t)(uintptr_t)"GPL";
+  attr.log_buf = (uint64_t)(uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+
+  log[0] = '\0';
+
+  if ( (xdp->prog_fd = xdp_bpf(BPF_PROG_LOAD, &attr)) < 0 )
+  {
+    ulog(LOG_DEBUG, "XDP program rejected (%s):\n%s\n", strerror(errno), log);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int xdp_program_attach(struct xdp_s *xdp, int generic)
+{
+  union bpf_attr attr;
+
+  bzero(&attr, sizeof(attr));
+  attr.link_create.prog_fd = xdp->prog_fd;
+  attr.link_create.target_ifindex = xdp->ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+
+  if ( ! generic )
+  {
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+
+    if ( (xdp->link_fd = xdp_bpf(BPF_LINK_CREATE, &attr)) >= 0 )
+    {
+      xdp->attach = XDP_ATTACH_DRIVER;
+      return 0;
+    }
+
+    ulog(LOG_DEBUG, "No driver XDP on interface %d (%s), trying generic\n", xdp->ifindex, strerror(errno));
+  }
+
+  attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+
+  if ( (xdp->link_fd = xdp_bpf(BPF_LINK_CREATE, &attr)) < 0 )
+    return 1;
+
+  xdp->attach = XDP_ATTACH_GENERIC;
+
+  return 0;
+}
+
+static int xdp_ring_map(struct xdp_s *xdp, struct xdp_ring_s *ring, struct xdp_ring_offset *offset, unsigned int entries, size_t entry_size, off_t page_offset)
+{
+  ring->map_size = offset->desc + entries * entry_size;
+  ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xdp->fd, page_offset);
+
+  if ( ring->map == MAP_FAILED )
+  {
+    ring->map = NULL;
+    return 1;
+  }
+
+  ring->producer = (unsigned int *)((char *)ring->map + offset->producer);
+  ring->consumer = (unsigned int *)((char *)ring->map + offset->consumer);
+  ring->descs = (char *)ring->map + offset->desc;
+  ring->mask = entries - 1;
+
+  return 0;
+}
+
+static int xdp_socket_open(struct xdp_s *xdp)
+{
+  struct xdp_umem_reg umem;
+  struct xdp_mmap_offsets offsets;
+  struct sockaddr_xdp addr;
+  socklen_t length = sizeof(offsets);
+  int rx_size = XDP_RX_RING_SIZE;
+  int fill_size = XDP_FILL_RING_SIZE;
+  int completion_size = XDP_COMPLETION_RING_SIZE;
+  uint64_t *fill;
+  int i;
+
+  if ( (xdp->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) < 0 )
+    return 1;
+
+  xdp->umem_size = (size_t)XDP_FRAMES * XDP_FRAME_SIZE;
+  xdp->umem = mmap(NULL, xdp->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( xdp->umem == MAP_FAILED )
+  {
+    xdp->umem = NULL;
+    return 1;
+  }
+
+  bzero(&umem, sizeof(umem));
+  umem.addr = (uint64_t)(uintptr_t)xdp->umem;
+  umem.len = xdp->umem_size;
+  umem.chunk_size = XDP_FRAME_SIZE;
+
+  // the kernel wants a completion ring with any packet memory, even when
+  // nothing is ever sent from it
+  if ( setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem)) != 0 ||
+       setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size)) != 0 ||
+       setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) != 0 ||
+       setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion_size, sizeof(completion_size)) != 0 ||
+       getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &length) != 0 )
+    return 1;
+
+  if ( xdp_ring_map(xdp, &xdp->rx, &offsets.rx, rx_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+       xdp_ring_map(xdp, &xdp->fill, &offsets.fr, fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+       xdp_ring_map(xdp, &xdp->completion, &offsets.cr, completion_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0 )
+    return 1;
+
+  // every frame starts out with the kernel
+  fill = (uint64_t *)xdp->fill.descs;
+
+  for (i=0; i<XDP_FILL_RING_SIZE; i++)
+    fill[i] = (uint64_t)i * XDP_FRAME_SIZE;
+
+  __atomic_store_n(xdp->fill.producer, XDP_FILL_RING_SIZE, __ATOMIC_RELEASE);
+
+  // the generic hook can only copy into our memory
+  bzero(&addr, sizeof(addr));
+  addr.sxdp_family = AF_XDP;
+  addr.sxdp_ifindex = xdp->ifindex;
+  addr.sxdp_queue_id = xdp->queue;
+  addr.sxdp_flags = (xdp->attach == XDP_ATTACH_GENERIC) ? XDP_COPY : 0;
+
+  if ( bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 )
+    return 1;
+
+  return 0;
+}
+
+int xdp_open(struct xdp_s *xdp, const char *ifname, int queue, uint16_t port, int generic)
+{
+  union bpf_attr attr;
+
+  bzero(xdp, sizeof(struct xdp_s));
+  xdp->fd = -1;
+  xdp->prog_fd = -1;
+  xdp->map_fd = -1;
+  xdp->link_fd = -1;
+  xdp->queue = queue;
+
+  if ( (xdp->ifindex = if_nametoindex(ifname)) == 0 )
+    return 1;
+
+  if ( (queue < 0) || (queue >= XDP_QUEUES_MAX) )
+  {
+    errno = EINVAL;
+    return 1;
+  }
+
+  bzero(&attr, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = XDP_QUEUES_MAX;
+
+  if ( (xdp->map_fd = xdp_bpf(BPF_MAP_CREATE, &attr)) < 0 ||
+       xdp_program_load(xdp, port) != 0 ||
+       xdp_program_attach(xdp, generic) != 0 ||
+       xdp_socket_open(xdp) != 0 )
+    goto fail;
+
+  // nothing is redirected to us until the caller says so
+  return 0;
+
+fail:
+  {
+    int error = errno;
+
+    xdp_close(xdp);
+    errno = error;
+  }
+
+  return 1;
+}
+
+int xdp_redirect_set(struct xdp_s *xdp, int enable)
+{
+  union bpf_attr attr;
+  uint32_t key = xdp->queue;
+  uint32_t value = xdp->fd;
+
+  // without an entry for the queue the program passes everything on
+  bzero(&attr, sizeof(attr));
+  attr.map_fd = xdp->map_fd;
+  attr.key = (uint64_t)(uintptr_t)&key;
+
+  if ( enable )
+  {
+    attr.value = (uint64_t)(uintptr_t)&value;
+    attr.flags = BPF_ANY;
+
+    return ( xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0 );
+  }
+
+  return ( (xdp_bpf(BPF_MAP_DELETE_ELEM, &attr) != 0) && (errno != ENOENT) );
+}
+
+void xdp_close(struct xdp_s *xdp)
+{
+  // the program goes first, so nothing is redirected into a closed socket
+  if ( xdp->link_fd >= 0 )
+    close(xdp->link_fd);
+
+  if ( xdp->prog_fd >= 0 )
+    close(xdp->prog_fd);
+
+  if ( xdp->map_fd >= 0 )
+    close(xdp->map_fd);
+
+  if ( NULL != xdp->rx.map )
+    munmap(xdp->rx.map, xdp->rx.map_size);
+
+  if ( NULL != xdp->fill.map )
+    munmap(xdp->fill.map, xdp->fill.map_size);
+
+  if ( NULL != xdp->completion.map )
+    munmap(xdp->completion.map, xdp->completion.map_size);
+
+  if ( xdp->fd >= 0 )
+    close(xdp->fd);
+
+  if ( NULL != xdp->umem )
+    munmap(xdp->umem, xdp->umem_size);
+
+  bzero(xdp, sizeof(struct xdp_s));
+  xdp->fd = -1;
+  xdp->prog_fd = -1;
+  xdp->map_fd = -1;
+  xdp->link_fd = -1;
+}
+
+static const char * xdp_udp_payload(const char *frame, unsigned int length, int *payload_length)
+{
+  unsigned int offset;
+  uint16_t udp_length;
+
+  if ( length < XDP_HEADERS_LENGTH )
+    return NULL;
+
+  // the program let through only what it could vouch for, still the
+  // lengths are ours to trust or not
+  offset = 14 + (frame[14] & 0x0f) * 4;
+
+  if ( offset + 8 > length )
+    return NULL;
+
+  memcpy(&udp_length, frame + offset + 4, sizeof(udp_length));
+  udp_length = ntohs(udp_length);
+
+  if ( (udp_length < 8) || (offset + udp_length > length) )
+    return NULL;
+
+  *payload_length = udp_length - 8;
+
+  return frame + offset + 8;
+}
+
+int xdp_receive(struct xdp_s *xdp, char *buffer, size_t size, int *n, struct timespec *t_mark)
+{
+  unsigned int consumer = *xdp->rx.consumer;
+  unsigned int producer;
+  struct xdp_desc *desc;
+  const char *payload;
+  uint64_t *fill;
+  int payload_length = 0;
+
+  while ( consumer != __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE) )
+  {
+    desc = (struct xdp_desc *)xdp->rx.descs + (consumer & xdp->rx.mask);
+
+    if ( (payload = xdp_udp_payload(xdp->umem + desc->addr, desc->len, &payload_length)) != NULL )
+    {
+      clock_gettime(CLOCK_REALTIME, t_mark);
+
+      *n = ((size_t)payload_length > size) ? (int)size : payload_length;
+      memcpy(buffer, payload, *n);
+    }
+    else
+      xdp->ignored++;
+
+    // the frame goes straight back to the kernel, the fill ring has room
+    // for every frame there is
+    fill = (uint64_t *)xdp->fill.descs;
+    producer = *xdp->fill.producer;
+    fill[producer & xdp->fill.mask] = desc->addr;
+    __atomic_store_n(xdp->fill.producer, producer + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(xdp->rx.consumer, ++consumer, __ATOMIC_RELEASE);
+
+    if ( NULL != payload )
+      return 1;
+  }
+
+  return 0;
+}
+
+#else
+
+int xdp_open(struct xdp_s *xdp, const char *ifname, int queue, uint16_t port, int generic)
+{
+  bzero(xdp, sizeof(struct xdp_s));
+  xdp->fd = -1;
+
+  errno = ENOSYS;
+
+  return 1;
+}
+
+void xdp_close(struct xdp_s *xdp)
+{
+  xdp->fd = -1;
+}
+
+int xdp_redirect_set(struct xdp_s *xdp, int enable) { return 1; }
+int xdp_receive(struct xdp_s *xdp, char *buffer, size_t size, int *n, struct timespec *t_mark) { return 0; }
+
+#endif /* HAVE_XDP */
+
+const char * xdp_attach_literal_get(int attach)
+{
+  switch ( attach )
+  {
+    case XDP_ATTACH_DRIVER:
+      return "driver";
+    case XDP_ATTACH_GENERIC:
+      return "generic";
+  }
+
+  return "none";
+}
@@ -0,0 +1,66 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// frames of the packet memory shared with the kernel, each holding one
+#define XDP_FRAMES     4096
+#define XDP_FRAME_SIZE 2048
+
+// descriptors per ring, the fill ring holds every frame
+#define XDP_RX_RING_SIZE         2048
+#define XDP_FILL_RING_SIZE       XDP_FRAMES
+#define XDP_COMPLETION_RING_SIZE 64
+
+// how the program went on to the interface
+#define XDP_ATTACH_NONE    0
+#define XDP_ATTACH_DRIVER  1
+#define XDP_ATTACH_GENERIC 2
+
+// one of the rings shared with the kernel, indices run freely and wrap
+struct xdp_ring_s
+{
+  void *map;
+  size_t map_size;
+
+  unsigned int *producer;
+  unsigned int *consumer;
+  void *descs;
+  unsigned int mask;
+};
+
+struct xdp_s
+{
+  int fd;
+  int ifindex;
+  int queue;
+
+  // the program redirecting our port, the socket map it looks up and the
+  // link holding it on the interface, which goes with the last close
+  int prog_fd;
+  int map_fd;
+  int link_fd;
+  int attach;
+
+  // packet memory and the rings over it, no transmit ring
+  char *umem;
+  size_t umem_size;
+  struct xdp_ring_s rx;
+  struct xdp_ring_s fill;
+  struct xdp_ring_s completion;
+
+  // frames taken off the ring that were not ours
+  unsigned long ignored;
+};
+
+// PUBLIC FUNCTIONS
+int xdp_open(struct xdp_s *xdp, const char *ifname, int queue, uint16_t port, int generic);
+void xdp_close(struct xdp_s *xdp);
+int xdp_redirect_set(struct xdp_s *xdp, int enable);
+
+int xdp_receive(struct xdp_s *xdp, char *buffer, size_t size, int *n, struct timespec *t_mark);
+const char * xdp_attach_literal_get(int attach);
+
+#endif /* XDP_H */
@@ -0,0 +1,342 @@
+#include "xtraffic.h"
+#include "common.h"
+#include "debug.h"
+
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <math.h>
+
+//
+// CROSS TRAFFIC
+//
+// a generator process offers UDP load of a known shape to a target sitting
+// behind the same bottleneck as the measured path, so the estimators can be
+// judged against conditions that are known and repeatable. every draw comes
+// from a private generator seeded from the command line, two runs with the
+// same options send the same sizes at the same instants.
+//
+//   cbr      fixed gaps, each packet spaced by its own length at the rate
+//   poisson  exponentially distributed gaps with the same mean
+//   pareto   on/off source, heavy tailed periods, twice the rate while on
+//
+
+static volatile sig_atomic_t xtraffic_running;
+
+static void xtraffic_signal(int signal)
+{
+  xtraffic_running = 0;
+}
+
+void xtraffic_init(struct xtraffic_s *xtraffic)
+{
+  bzero(xtraffic, sizeof(struct xtraffic_s));
+
+  xtraffic->model = XTRAFFIC_MODEL_NONE;
+
+  xtraffic->target.sin_family = AF_INET;
+  xtraffic->target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  xtraffic->target.sin_port = htons(XTRAFFIC_PORT_DEFAULT);
+
+  // as srand48(1) would
+  xtraffic->seed[0] = 0x330e;
+  xtraffic->seed[1] = 1;
+  xtraffic->seed[2] = 0;
+
+  xtraffic_sizes_parse(xtraffic, XTRAFFIC_SIZES_DEFAULT);
+}
+
+int xtraffic_model_parse(struct xtraffic_s *xtraffic, const char *spec)
+{
+  char *copy = strdup(spec);
+  char *model, *rate, *seed;
+  char *save = NULL;
+  unsigned long value;
+  int ret = 1;
+
+  if ( NULL == copy )
+    return 1;
+
+  model = strtok_r(copy, ":", &save);
+  rate = strtok_r(NULL, ":", &save);
+  seed = strtok_r(NULL, ":", &save);
+
+  if ( (NULL == model) || (NULL == rate) )
+    goto done;
+
+  if ( strcmp(model, "cbr") == 0 )
+    xtraffic->model = XTRAFFIC_MODEL_CBR;
+  else if ( strcmp(model, "poisson") == 0 )
+    xtraffic->model = XTRAFFIC_MODEL_POISSON;
+  else if ( strcmp(model, "pareto") == 0 )
+    xtraffic->model = XTRAFFIC_MODEL_PARETO;
+  else
+    goto done;
+
+  if ( (xtraffic->rate = strtod(rate, (char **)NULL)) <= 0 )
+    goto done;
+
+  if ( NULL != seed )
+  {
+    value = strtoul(seed, (char **)NULL, 10);
+
+    xtraffic->seed[1] = (unsigned short)(value & 0xffff);
+    xtraffic->seed[2] = (unsigned short)((value >> 16) & 0xffff);
+  }
+
+  ret = 0;
+
+done:
+  free(copy);
+
+  if ( ret != 0 )
+    xtraffic->model = XTRAFFIC_MODEL_NONE;
+
+  return ret;
+}
+
+int xtraffic_sizes_parse(struct xtraffic_s *xtraffic, const char *list)
+{
+  char *copy = strdup(list);
+  char *entry, *weight;
+  char *save = NULL;
+  unsigned long size, count;
+  unsigned int sizes_count = 0;
+  int ret = 1;
+
+  if ( NULL == copy )
+    return 1;
+
+  // "size[*weight]" entries, separated by commas
+  for (entry=strtok_r(copy, ",", &save); entry!=NULL; entry=strtok_r(NULL, ",", &save))
+  {
+    count = 1;
+
+    if ( (weight = strchr(entry, '*')) != NULL )
+    {
+      *weight++ = '\0';
+      count = strtoul(weight, (char **)NULL, 10);
+    }
+
+    size = strtoul(entry, (char **)NULL, 10);
+
+    if ( (size < XTRAFFIC_SIZE_MIN) || (size > XTRAFFIC_SIZE_MAX) ||
+         (count == 0) || (sizes_count + count > XTRAFFIC_SIZES_MAX) )
+      goto done;
+
+    while ( count-- > 0 )
+      xtraffic->sizes[sizes_count++] = (unsigned int)size;
+  }
+
+  if ( sizes_count == 0 )
+    goto done;
+
+  xtraffic->sizes_count = sizes_count;
+  ret = 0;
+
+done:
+  free(copy);
+
+  return ret;
+}
+
+int xtraffic_target_parse(struct xtraffic_s *xtraffic, const char *target)
+{
+  char *copy = strdup(target);
+  char *port;
+  struct hostent *host;
+  int ret = 1;
+
+  if ( NULL == copy )
+    return 1;
+
+  if ( (port = strchr(copy, ':')) != NULL )
+  {
+    *port++ = '\0';
+
+    if ( atoi(port) <= 0 || atoi(port) > 65535 )
+      goto done;
+
+    xtraffic->target.sin_port = htons((unsigned short)atoi(port));
+  }
+
+  if ( (host = gethostbyname(copy)) == NULL || host->h_addrtype != AF_INET )
+    goto done;
+
+  memcpy(&xtraffic->target.sin_addr, host->h_addr_list[0], sizeof(struct in_addr));
+  ret = 0;
+
+done:
+  free(copy);
+
+  return ret;
+}
+
+const char * xtraffic_model_literal_get(int model)
+{
+  switch ( model )
+  {
+    case XTRAFFIC_MODEL_CBR:
+      return "cbr";
+    case XTRAFFIC_MODEL_POISSON:
+      return "poisson";
+    case XTRAFFIC_MODEL_PARETO:
+      return "pareto";
+  }
+
+  return "none";
+}
+
+static double xtraffic_pareto_period(struct xtraffic_s *xtraffic)
+{
+  double scale = XTRAFFIC_PARETO_PERIOD_US * (XTRAFFIC_PARETO_SHAPE - 1.0) / XTRAFFIC_PARETO_SHAPE;
+  double period;
+
+  // inverse of the distribution function, u taken from (0,1]
+  period = scale / pow(1.0 - erand48(xtraffic->seed), 1.0 / XTRAFFIC_PARETO_SHAPE);
+
+  return (period > XTRAFFIC_PARETO_CAP_US) ? XTRAFFIC_PARETO_CAP_US : period;
+}
+
+static void xtraffic_run(struct xtraffic_s *xtraffic)
+{
+  static char payload[XTRAFFIC_SIZE_MAX];
+  struct pace_s pace;
+  struct timespec start, next, now;
+  unsigned long packets = 0, bytes = 0, failed = 0, dropped = 0;
+  unsigned int size;
+  double on_left = 0.0;
+  double gap, elapsed;
+  int fd;
+
+  if ( (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 )
+  {
+    fprintf(stderr, "Unable to open cross traffic socket.\n");
+    return;
+  }
+
+  pace_init(&pace);
+  pace_calibrate(&pace);
+
+  if ( xtraffic->model == XTRAFFIC_MODEL_PARETO )
+    on_left = xtraffic_pareto_period(xtraffic);
+
+  pace_now(&start);
+  next = start;
+
+  while ( xtraffic_running )
+  {
+    size = xtraffic->sizes[(unsigned int)(erand48(xtraffic->seed) * xtraffic->sizes_count)];
+
+    // after a stall carry on from now, a burst would not be the model asked for
+    if ( pace_wait_until(&pace, &next) != 0 )
+    {
+      pace_now(&now);
+
+      if ( time_delta_ts_us(next, now) > XTRAFFIC_BACKLOG_MAX_US )
+      {
+        next = now;
+        dropped++;
+      }
+    }
+
+    if ( sendto(fd, payload, size - XTRAFFIC_HEADER_BYTES, 0, (struct sockaddr *)&xtraffic->target, sizeof(xtraffic->target)) < 0 )
+      failed++;
+    else
+    {
+      packets++;
+      bytes += size;
+    }
+
+    // time the datagram takes at the offered rate [us]
+    gap = (double)(size << 3) / xtraffic->rate;
+
+    switch ( xtraffic->model )
+    {
+      case XTRAFFIC_MODEL_POISSON:
+        gap *= -log(1.0 - erand48(xtraffic->seed));
+        break;
+      case XTRAFFIC_MODEL_PARETO:
+        // on and off periods share a mean, so twice the rate while on
+        gap /= 2.0;
+        on_left -= gap;
+
+        if ( on_left <= 0 )
+        {
+          gap += xtraffic_pareto_period(xtraffic);
+          on_left = xtraffic_pareto_period(xtraffic);
+        }
+        break;
+    }
+
+    timespec_add_ns(&next, (long)(gap * 1000.0));
+  }
+
+  pace_now(&now);
+  elapsed = time_delta_ts_us(start, now);
+
+  fprintf(stdout, "Cross traffic (%s): %lu packets, %lu bytes, %.3f Mbps over %.1fs (%lu failed, %lu stalls)\n",
+          xtraffic_model_literal_get(xtraffic->model), packets, bytes,
+          elapsed > 0 ? (double)(bytes << 3) / elapsed : 0.0, elapsed / 1e6, failed, dropped);
+
+  close(fd);
+}
+
+int xtraffic_start(struct xtraffic_s *xtraffic)
+{
+  struct sigaction action;
+  pid_t pid;
+
+  if ( xtraffic->model == XTRAFFIC_MODEL_NONE )
+    return 0;
+
+  // the generator must not repeat anything still buffered
+  fflush(stdout);
+
+  if ( (pid = fork()) < 0 )
+    return 1;
+
+  if ( pid == 0 )
+  {
+    // never outlive the daemon, however it goes
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    bzero(&action, sizeof(action));
+    action.sa_handler = xtraffic_signal;
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    xtraffic_running = 1;
+    xtraffic_run(xtraffic);
+
+    exit(0);
+  }
+
+  xtraffic->pid = pid;
+
+  fprintf(stdout, "Cross traffic: %s at %.1f Mbps to %s:%d\n", xtraffic_model_literal_get(xtraffic->model),
+          xtraffic->rate, inet_ntoa(xtraffic->target.sin_addr), ntohs(xtraffic->target.sin_port));
+
+  return 0;
+}
+
+void xtraffic_stop(struct xtraffic_s *xtraffic)
+{
+  if ( xtraffic->pid <= 0 )
+    return;
+
+  kill(xtraffic->pid, SIGTERM);
+  while ( waitpid(xtraffic->pid, NULL, 0) < 0 && errno == EINTR );
+
+  xtraffic->pid = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef XTRAFFIC_H
+#define XTRAFFIC_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pace.h"
+
+// CROSS TRAFFIC MODELS
+#define XTRAFFIC_MODEL_NONE    0
+#define XTRAFFIC_MODEL_CBR     1
+#define XTRAFFIC_MODEL_POISSON 2
+#define XTRAFFIC_MODEL_PARETO  3
+
+// entries in the packet size mix, weights expanded in place
+#define XTRAFFIC_SIZES_MAX 64
+
+// IP datagram length limits [bytes], payload being length less the headers
+#define XTRAFFIC_SIZE_MIN     40
+#define XTRAFFIC_SIZE_MAX     1500
+#define XTRAFFIC_HEADER_BYTES 28
+
+// IMIX, 7:4:1 of small, medium and full sized datagrams
+#define XTRAFFIC_SIZES_DEFAULT "40*7,576*4,1500"
+
+// the discard service, nothing answers it on most hosts
+#define XTRAFFIC_PORT_DEFAULT 9
+
+// on/off source: mean period [us], tail index and longest period kept
+#define XTRAFFIC_PARETO_PERIOD_US 20000.0
+#define XTRAFFIC_PARETO_SHAPE     1.5
+#define XTRAFFIC_PARETO_CAP_US    1000000.0
+
+// a sender this far behind drops the backlog rather than bursting it out [us]
+#define XTRAFFIC_BACKLOG_MAX_US 10000
+
+struct xtraffic_s
+{
+  int model;
+
+  // mean offered load [Mbps]
+  double rate;
+
+  // IP datagram lengths drawn uniformly, repeated entries weighing more
+  unsigned int sizes[XTRAFFIC_SIZES_MAX];
+  unsigned int sizes_count;
+
+  struct sockaddr_in target;
+
+  // fixed so every run offers the same sequence of packets and gaps
+  unsigned short seed[3];
+
+  // generator process, 0 when not running
+  pid_t pid;
+};
+
+// PUBLIC FUNCTIONS
+void xtraffic_init(struct xtraffic_s *xtraffic);
+int xtraffic_model_parse(struct xtraffic_s *xtraffic, const char *spec);
+int xtraffic_sizes_parse(struct xtraffic_s *xtraffic, const char *list);
+int xtraffic_target_parse(struct xtraffic_s *xtraffic, const char *target);
+
+int xtraffic_start(struct xtraffic_s *xtraffic);
+void xtraffic_stop(struct xtraffic_s *xtraffic);
+
+const char * xtraffic_model_literal_get(int model);
+
+#endif /* XTRAFFIC_H */